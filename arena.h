@@ -1,5 +1,9 @@
 #ifndef ARENA_H_
 #define ARENA_IMPLEMENTATION
+#if defined(__linux__) && !defined(ARENA_BACKEND)
+#define ARENA_BACKEND ARENA_BACKEND_LINUX_MMAP
+#define ARENA_LINUX_MMAP_HUGE_PAGES
+#endif
 #include "libs/arena.h"
 #endif
 /* Now we can include arena.h in our jumbo build and not have to
@@ -0,0 +1,826 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "utils.c"
+#include "libs/base64.c"
+#include "libs/base85.c"
+#include "libs/sha256.c"
+#include "lz_block.c"
+#include "chained_hash.c"
+#include "tree_hash.c"
+#include "chunk_dedup.c"
+#include "delta.c"
+
+#include "libs/munit/munit.c"
+
+#ifndef APP_VERSION
+#define APP_VERSION git
+#endif
+
+#define QUOTE(name) #name
+#define EXPAND_AND_QUOTE(str) QUOTE(str)
+#define QUOTED_APP_VERSION EXPAND_AND_QUOTE(APP_VERSION)
+
+/*
+ * Micro-benchmarks for the codecs, hashing and string helpers.
+ *
+ * Every benchmark is a munit test. Within one run the operation is repeated
+ * until at least BENCH_MIN_SECONDS have passed, and the suite's iterations
+ * give several such runs of which the fastest is kept. Use munit's own
+ * options to narrow things down, e.g. `./bench bench/b64_encode --param size 4096`.
+ *
+ * munit runs each test in a forked child, so the measurements are collected
+ * in a shared anonymous mapping and written out by the parent at the end,
+ * as a table on stdout and as JSON with `--json FILE`.
+ */
+
+#define BENCH_MIN_SECONDS 0.1
+#define BENCH_MAX_RECORDS 1024
+/* Line size of the transfer hashing benchmarks, a chunk size which show often settles on. */
+#define BENCH_HASH_CHUNK_BYTES 49152
+#define BENCH_MAX_THREADS 16
+
+typedef struct {
+    char name[32];
+    char impl[16];
+    size_t size;            /* Input size, or the number of existing files. */
+    size_t bytes_per_op;    /* 0 if a throughput figure makes no sense. */
+    double ns_per_op;
+    unsigned int samples;
+} BenchRecord;
+
+typedef struct {
+    int count;
+    BenchRecord records[BENCH_MAX_RECORDS];
+} BenchResults;
+
+static BenchResults *bench_results = NULL;
+static const char *bench_json_filename = NULL;
+
+/* Somewhere for results to go so that the work isn't optimised away. */
+static volatile unsigned char bench_sink;
+
+typedef struct {
+    size_t size;
+    unsigned char *input;
+    unsigned char *output;
+    unsigned char *encoded;
+    unsigned int encoded_length;
+    char *path;             /* Temporary file or directory, if the benchmark uses one. */
+    size_t existing_files;
+    int threads;
+} BenchBuffers;
+
+typedef void (*BenchOperation)(BenchBuffers *buffers);
+
+/**
+ * Keep the best measurement of a (name, impl, size) across iterations.
+ */
+static void bench_record(const char *name, const char *impl, size_t size, size_t bytes_per_op, double ns_per_op) {
+    for (int i=0; i<bench_results->count; i++) {
+        BenchRecord *record = &bench_results->records[i];
+        if (strcmp(record->name, name) == 0 && strcmp(record->impl, impl) == 0 && record->size == size) {
+            if (ns_per_op < record->ns_per_op) {
+                record->ns_per_op = ns_per_op;
+            }
+            record->samples++;
+            return;
+        }
+    }
+    if (bench_results->count == BENCH_MAX_RECORDS) {
+        return;
+    }
+    BenchRecord *record = &bench_results->records[bench_results->count];
+    snprintf(record->name, sizeof(record->name), "%s", name);
+    snprintf(record->impl, sizeof(record->impl), "%s", impl);
+    record->size = size;
+    record->bytes_per_op = bytes_per_op;
+    record->ns_per_op = ns_per_op;
+    record->samples = 1;
+    bench_results->count++;
+}
+
+/**
+ * Time an operation, doubling the repetitions until the run is long enough.
+ */
+static void bench_run(const char *name, const char *impl, size_t size, size_t bytes_per_op,
+        BenchOperation operation, BenchBuffers *buffers) {
+
+    operation(buffers);    /* Warm up caches and fault in the buffers. */
+
+    unsigned long repetitions = 1;
+    double elapsed;
+    for (;;) {
+        double start_time = now_seconds();
+        for (unsigned long i=0; i<repetitions; i++) {
+            operation(buffers);
+        }
+        elapsed = now_seconds() - start_time;
+        if (elapsed >= BENCH_MIN_SECONDS) {
+            break;
+        }
+        repetitions *= 2;
+    }
+
+    double ns_per_op = elapsed * 1e9 / repetitions;
+    bench_record(name, impl, size, bytes_per_op, ns_per_op);
+    if (bytes_per_op != 0) {
+        munit_logf(MUNIT_LOG_INFO, "%s %s %zu: %.1f ns/op, %.1f MB/s", name, impl, size, ns_per_op,
+            bytes_per_op / ns_per_op * 1e3);
+    } else {
+        munit_logf(MUNIT_LOG_INFO, "%s %s %zu: %.1f ns/op", name, impl, size, ns_per_op);
+    }
+}
+
+/* Parameters */
+
+static char *size_params[] = { "16", "256", "4096", "65536", "1048576", "16777216", "67108864", NULL };
+static char *reference_size_params[] = { "1048576", "16777216", "67108864", NULL };
+static char *hash_size_params[] = { "32", NULL };
+static char *strip_size_params[] = { "16", "256", "4096", NULL };
+static char *existing_files_params[] = { "0", "100", "10000", NULL };
+static char *b64_impl_params[] = { "scalar", "sse41", "avx2", "neon", NULL };
+static char *sha256_impl_params[] = { "scalar", "shani", "armv8", NULL };
+/* The smallest, the default and the largest chunk that show sends. */
+static char *chunk_size_params[] = { "3072", "49152", "196608", NULL };
+static char *chunk_data_params[] = { "text", "random", NULL };
+static char *transfer_hash_size_params[] = { "1048576", "16777216", NULL };
+static char *threads_params[] = { "1", "2", "4", "8", "16", NULL };
+
+static bool select_b64_impl(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return b64_set_impl(B64_IMPL_SCALAR);
+    }
+    if (strcmp(name, "sse41") == 0) {
+        return b64_set_impl(B64_IMPL_SSE41);
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return b64_set_impl(B64_IMPL_AVX2);
+    }
+    if (strcmp(name, "neon") == 0) {
+        return b64_set_impl(B64_IMPL_NEON);
+    }
+    return false;
+}
+
+static bool select_sha256_impl(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return sha256_set_impl(SHA256_IMPL_SCALAR);
+    }
+    if (strcmp(name, "shani") == 0) {
+        return sha256_set_impl(SHA256_IMPL_SHANI);
+    }
+    if (strcmp(name, "armv8") == 0) {
+        return sha256_set_impl(SHA256_IMPL_ARMV8);
+    }
+    return false;
+}
+
+static size_t get_size_param(const MunitParameter params[], const char *key) {
+    const char *value = munit_parameters_get(params, key);
+    return value == NULL ? 0 : strtoull(value, NULL, 10);
+}
+
+/* Fixtures */
+
+/**
+ * Random input of the `size` parameter's length, with room for encoding it.
+ */
+static void *buffers_setup(const MunitParameter params[], void *user_data) {
+    BenchBuffers *buffers = calloc(1, sizeof(BenchBuffers));
+    buffers->size = get_size_param(params, "size");
+    buffers->input = malloc(buffers->size + 1);
+    munit_rand_memory(buffers->size, buffers->input);
+
+    size_t output_size = b64e_size(buffers->size) + 1;
+    if (output_size < buffers->size * 2 + 1) {
+        output_size = buffers->size * 2 + 1;
+    }
+    buffers->output = malloc(output_size);
+
+    b64_set_impl(B64_IMPL_AUTO);
+    buffers->encoded = malloc(b64e_size(buffers->size) + 1);
+    buffers->encoded_length = b64_encode(buffers->input, buffers->size, buffers->encoded) - 1;
+    return buffers;
+}
+
+/**
+ * As buffers_setup(), but with the input encoded in base85.
+ */
+static void *b85_setup(const MunitParameter params[], void *user_data) {
+    BenchBuffers *buffers = buffers_setup(params, user_data);
+    free(buffers->encoded);
+    buffers->encoded = malloc(b85e_size(buffers->size) + 1);
+    buffers->encoded_length = b85_encode(buffers->input, buffers->size, buffers->encoded);
+    return buffers;
+}
+
+static void buffers_tear_down(void *fixture) {
+    BenchBuffers *buffers = fixture;
+    if (buffers->path != NULL) {
+        unlink(buffers->path);
+        free(buffers->path);
+    }
+    free(buffers->input);
+    free(buffers->output);
+    free(buffers->encoded);
+    free(buffers);
+    b64_set_impl(B64_IMPL_AUTO);
+    sha256_set_impl(SHA256_IMPL_AUTO);
+}
+
+/**
+ * A chunk of log-like text or random bytes, depending on the `data`
+ * parameter, and the chunk packed.
+ */
+static void *chunk_setup(const MunitParameter params[], void *user_data) {
+    BenchBuffers *buffers = calloc(1, sizeof(BenchBuffers));
+    buffers->size = get_size_param(params, "size");
+    buffers->input = malloc(buffers->size + 1);
+    if (strcmp(munit_parameters_get(params, "data"), "text") == 0) {
+        size_t length = 0;
+        for (unsigned int i=0; length < buffers->size; i++) {
+            char line[128];
+            int line_length = snprintf(line, sizeof(line),
+                "2024-05-%02u 12:%02u:%02u INFO request id=%u path=/api/items/%u status=200 bytes=%u\n",
+                i % 28 + 1, i / 60 % 60, i % 60, i * 7919 % 100000, munit_rand_int_range(1, 5000),
+                munit_rand_int_range(100, 99999));
+            size_t count = buffers->size - length < (size_t) line_length ? buffers->size - length : line_length;
+            memcpy(buffers->input + length, line, count);
+            length += count;
+        }
+    } else {
+        munit_rand_memory(buffers->size, buffers->input);
+    }
+
+    buffers->output = malloc(LZ_BLOCK_PACKED_BOUND(buffers->size));
+    buffers->encoded = malloc(LZ_BLOCK_PACKED_BOUND(buffers->size));
+    buffers->encoded_length = lz_block_pack(buffers->input, buffers->size, true, buffers->encoded);
+    return buffers;
+}
+
+/**
+ * Random input written to a temporary file for the command line tools to read.
+ */
+static void *reference_file_setup(const MunitParameter params[], void *user_data) {
+    BenchBuffers *buffers = calloc(1, sizeof(BenchBuffers));
+    buffers->size = get_size_param(params, "size");
+    buffers->input = malloc(buffers->size);
+    munit_rand_memory(buffers->size, buffers->input);
+
+    buffers->path = strdup("/tmp/extraterm_bench_XXXXXX");
+    int fd = mkstemp(buffers->path);
+    munit_assert_int(fd, !=, -1);
+    FILE *fhandle = fdopen(fd, "wb");
+    munit_assert_size(fwrite(buffers->input, 1, buffers->size, fhandle), ==, buffers->size);
+    munit_assert_int(fclose(fhandle), ==, 0);
+    return buffers;
+}
+
+/**
+ * A directory holding `bench.txt` and `existing` numbered variations of it.
+ */
+static void *existing_files_setup(const MunitParameter params[], void *user_data) {
+    BenchBuffers *buffers = calloc(1, sizeof(BenchBuffers));
+    buffers->existing_files = get_size_param(params, "existing");
+    buffers->path = strdup("/tmp/extraterm_bench_XXXXXX");
+    munit_assert_not_null(mkdtemp(buffers->path));
+
+    char path[PATH_MAX];
+    for (size_t i=0; i<buffers->existing_files; i++) {
+        if (i == 0) {
+            snprintf(path, sizeof(path), "%s/bench.txt", buffers->path);
+        } else {
+            snprintf(path, sizeof(path), "%s/bench(%zu).txt", buffers->path, i);
+        }
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        munit_assert_int(fd, !=, -1);
+        close(fd);
+    }
+    return buffers;
+}
+
+static void existing_files_tear_down(void *fixture) {
+    BenchBuffers *buffers = fixture;
+    char path[PATH_MAX];
+    DIR *dir = opendir(buffers->path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(path, sizeof(path), "%s/%s", buffers->path, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    rmdir(buffers->path);
+    free(buffers->path);
+    free(buffers);
+}
+
+/* Operations */
+
+static void op_b64_encode(BenchBuffers *buffers) {
+    b64_encode(buffers->input, buffers->size, buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_b64_decode(BenchBuffers *buffers) {
+    b64_decode(buffers->encoded, buffers->encoded_length, buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_b64_decode_validate(BenchBuffers *buffers) {
+    unsigned int decoded_length;
+    b64_decode_validate(buffers->encoded, buffers->encoded_length, buffers->output, &decoded_length);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_b85_encode(BenchBuffers *buffers) {
+    b85_encode(buffers->input, buffers->size, buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_b85_decode_validate(BenchBuffers *buffers) {
+    unsigned int decoded_length;
+    b85_decode_validate(buffers->encoded, buffers->encoded_length, buffers->output, &decoded_length);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_sha256_hash(BenchBuffers *buffers) {
+    sha256_context ctx;
+    uint8_t hash[SHA256_SIZE_BYTES];
+    sha256_init(&ctx);
+    sha256_hash(&ctx, buffers->input, buffers->size);
+    sha256_done(&ctx, hash);
+    bench_sink ^= hash[0];
+}
+
+static void op_print_hex(BenchBuffers *buffers) {
+    print_hex(buffers->input, buffers->size);
+}
+
+static void op_sha256_hash_to_hex(BenchBuffers *buffers) {
+    char hex[SHA256_SIZE_BYTES * 2 + 1];
+    sha256_hash_to_hex(buffers->input, hex);
+    bench_sink ^= hex[0];
+}
+
+/* The copy is part of what is measured, as string_strip() works in place. */
+static void op_string_strip(BenchBuffers *buffers) {
+    memcpy(buffers->output, buffers->input, buffers->size + 1);
+    string_strip((char *) buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_find_suitable_filename(BenchBuffers *buffers) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bench.txt", buffers->path);
+    char *filename = find_suitable_filename(path);
+    bench_sink ^= filename[0];
+    free(filename);
+}
+
+static void op_lz_block_pack(BenchBuffers *buffers) {
+    lz_block_pack(buffers->input, buffers->size, true, buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_lz_block_unpack(BenchBuffers *buffers) {
+    lz_block_unpack(buffers->encoded, buffers->encoded_length, buffers->output);
+    bench_sink ^= buffers->output[0];
+}
+
+static void op_byte_entropy_bits(BenchBuffers *buffers) {
+    bench_sink ^= (unsigned char) byte_entropy_bits(buffers->input, buffers->size);
+}
+
+/* The serial hashing which the chained integrity mode is stuck with. */
+static void op_chained_hash(BenchBuffers *buffers) {
+    ChainedHash chain;
+    chained_hash_init(&chain);
+    for (size_t offset=0; offset<buffers->size; offset+=BENCH_HASH_CHUNK_BYTES) {
+        size_t length = buffers->size - offset < BENCH_HASH_CHUNK_BYTES ? buffers->size - offset : BENCH_HASH_CHUNK_BYTES;
+        chained_hash_update(&chain, buffers->input + offset, length);
+    }
+    chained_hash_update(&chain, "", 0);
+    bench_sink ^= chain.previous_hash[0];
+}
+
+/* Finding the chunk boundaries, which chunk dedup does on top of hashing each chunk. */
+static void op_chunk_dedup_cut(BenchBuffers *buffers) {
+    size_t count = 0;
+    for (size_t offset=0; offset<buffers->size; count++) {
+        offset += chunk_dedup_cut(buffers->input + offset, buffers->size - offset);
+    }
+    bench_sink ^= (unsigned char) count;
+}
+
+/* What a delta costs per byte where nothing matches: the checksum rolls on and is looked up. */
+static void op_delta_weak_roll(BenchBuffers *buffers) {
+    const size_t block_size = DELTA_MIN_BLOCK_BYTES;
+    uint32_t weak = delta_weak_checksum(buffers->input, block_size);
+    for (size_t i=0; i + block_size < buffers->size; i++) {
+        weak = delta_weak_roll(weak, buffers->input[i], buffers->input[i + block_size], block_size);
+        bench_sink ^= buffers->output[weak & 0xffff];
+    }
+}
+
+typedef struct {
+    BenchBuffers *buffers;
+    size_t first_chunk;
+    size_t end_chunk;
+} LeafRange;
+
+static void *hash_leaf_range(void *arg) {
+    LeafRange *range = arg;
+    BenchBuffers *buffers = range->buffers;
+    for (size_t i=range->first_chunk; i<range->end_chunk; i++) {
+        size_t offset = i * BENCH_HASH_CHUNK_BYTES;
+        size_t length = buffers->size - offset < BENCH_HASH_CHUNK_BYTES ? buffers->size - offset : BENCH_HASH_CHUNK_BYTES;
+        tree_hash_leaf(buffers->input + offset, length, buffers->output + i * SHA256_SIZE_BYTES);
+    }
+    return NULL;
+}
+
+/* Leaves are hashed by `threads` threads, each taking a run of the lines, and then joined into the root. */
+static void op_tree_hash(BenchBuffers *buffers) {
+    size_t chunk_count = (buffers->size + BENCH_HASH_CHUNK_BYTES - 1) / BENCH_HASH_CHUNK_BYTES;
+    pthread_t threads[BENCH_MAX_THREADS];
+    LeafRange ranges[BENCH_MAX_THREADS];
+    for (int t=0; t<buffers->threads; t++) {
+        ranges[t].buffers = buffers;
+        ranges[t].first_chunk = chunk_count * t / buffers->threads;
+        ranges[t].end_chunk = chunk_count * (t + 1) / buffers->threads;
+        pthread_create(&threads[t], NULL, hash_leaf_range, &ranges[t]);
+    }
+    for (int t=0; t<buffers->threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    TreeHash tree;
+    tree_hash_init(&tree);
+    for (size_t i=0; i<chunk_count; i++) {
+        tree_hash_push(&tree, buffers->output + i * SHA256_SIZE_BYTES);
+    }
+    unsigned char root[SHA256_SIZE_BYTES];
+    tree_hash_root(&tree, root);
+    bench_sink ^= root[0];
+}
+
+static void op_coreutils_base64(BenchBuffers *buffers) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "base64 '%s' > /dev/null", buffers->path);
+    system(command);
+}
+
+static void op_coreutils_sha256sum(BenchBuffers *buffers) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "sha256sum '%s' > /dev/null", buffers->path);
+    system(command);
+}
+
+/* Benchmarks */
+
+MunitResult bench_b64_encode(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    const char *impl = munit_parameters_get(params, "impl");
+    if (!select_b64_impl(impl)) {
+        return MUNIT_SKIP;
+    }
+    bench_run("b64_encode", impl, buffers->size, buffers->size, op_b64_encode, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_b64_decode(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("b64_decode", "scalar", buffers->size, buffers->size, op_b64_decode, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_b64_decode_validate(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    const char *impl = munit_parameters_get(params, "impl");
+    if (!select_b64_impl(impl)) {
+        return MUNIT_SKIP;
+    }
+    bench_run("b64_decode_validate", impl, buffers->size, buffers->size, op_b64_decode_validate, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_b85_encode(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    /* The other half of the trade-off against b64_encode: how much less goes over the wire. */
+    unsigned int b85_length = b85e_size(buffers->size);
+    unsigned int b64_length = b64e_size(buffers->size);
+    munit_logf(MUNIT_LOG_INFO, "b85_encode %zu: %u chars against %u in base64, %.1f%% fewer", buffers->size,
+        b85_length, b64_length, b64_length != 0 ? 100.0 * (b64_length - b85_length) / b64_length : 0);
+    bench_run("b85_encode", "scalar", buffers->size, buffers->size, op_b85_encode, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_b85_decode_validate(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("b85_decode_validate", "scalar", buffers->size, buffers->size, op_b85_decode_validate, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_sha256_hash(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    const char *impl = munit_parameters_get(params, "impl");
+    if (!select_sha256_impl(impl)) {
+        return MUNIT_SKIP;
+    }
+    bench_run("sha256_hash", impl, buffers->size, buffers->size, op_sha256_hash, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_print_hex(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+
+    /* Formatting and stdio buffering is what is measured, not a terminal. */
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    bench_run("print_hex", "", buffers->size, buffers->size, op_print_hex, buffers);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    return MUNIT_OK;
+}
+
+MunitResult bench_sha256_hash_to_hex(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("sha256_hash_to_hex", "", buffers->size, buffers->size, op_sha256_hash_to_hex, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_string_strip(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+
+    /* A name padded with whitespace on both ends. */
+    size_t size = buffers->size;
+    memset(buffers->input, ' ', size);
+    memset(buffers->input + size / 4, 'x', size / 2);
+    buffers->input[size - 1] = '\n';
+    buffers->input[size] = '\0';
+
+    bench_run("string_strip", "", size, size, op_string_strip, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_find_suitable_filename(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("find_suitable_filename", "", buffers->existing_files, 0, op_find_suitable_filename, buffers);
+    return MUNIT_OK;
+}
+
+/* Speeds are per byte of the chunk before packing. The packed size goes to the log. */
+MunitResult bench_lz_block_pack(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    const char *data = munit_parameters_get(params, "data");
+    munit_logf(MUNIT_LOG_INFO, "lz_block_pack %s %zu: packed to %u bytes, %.1f%%", data, buffers->size,
+        buffers->encoded_length, 100.0 * buffers->encoded_length / buffers->size);
+    bench_run("lz_block_pack", data, buffers->size, buffers->size, op_lz_block_pack, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_lz_block_unpack(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("lz_block_unpack", munit_parameters_get(params, "data"), buffers->size, buffers->size,
+        op_lz_block_unpack, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_byte_entropy_bits(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("byte_entropy_bits", munit_parameters_get(params, "data"), buffers->size, buffers->size,
+        op_byte_entropy_bits, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_chained_hash(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("chained_hash", "", buffers->size, buffers->size, op_chained_hash, buffers);
+    return MUNIT_OK;
+}
+
+/* Compare with sha256_hash, which every chunk also goes through. */
+MunitResult bench_chunk_dedup_cut(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("chunk_dedup_cut", "", buffers->size, buffers->size, op_chunk_dedup_cut, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_delta_weak_roll(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    bench_run("delta_weak_roll", "", buffers->size, buffers->size, op_delta_weak_roll, buffers);
+    return MUNIT_OK;
+}
+
+/* Compare with chained_hash. The speed-up from more threads is capped by the number of cores. */
+MunitResult bench_tree_hash(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    const char *threads = munit_parameters_get(params, "threads");
+    buffers->threads = atoi(threads);
+    char impl[16];
+    snprintf(impl, sizeof(impl), "%s thread%s", threads, buffers->threads == 1 ? "" : "s");
+    bench_run("tree_hash", impl, buffers->size, buffers->size, op_tree_hash, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_coreutils_base64(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    if (system("command -v base64 > /dev/null 2>&1") != 0) {
+        return MUNIT_SKIP;
+    }
+    bench_run("coreutils_base64", "reference", buffers->size, buffers->size, op_coreutils_base64, buffers);
+    return MUNIT_OK;
+}
+
+MunitResult bench_coreutils_sha256sum(const MunitParameter params[], void *fixture) {
+    BenchBuffers *buffers = fixture;
+    if (system("command -v sha256sum > /dev/null 2>&1") != 0) {
+        return MUNIT_SKIP;
+    }
+    bench_run("coreutils_sha256sum", "reference", buffers->size, buffers->size, op_coreutils_sha256sum, buffers);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum b64_params[] = {
+    { "size", size_params },
+    { "impl", b64_impl_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum sha256_params[] = {
+    { "size", size_params },
+    { "impl", sha256_impl_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum sized_params[] = {
+    { "size", size_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum hash_params[] = {
+    { "size", hash_size_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum strip_params[] = {
+    { "size", strip_size_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum reference_params[] = {
+    { "size", reference_size_params },
+    { NULL, NULL }
+};
+
+static MunitParameterEnum chunk_params[] = {
+    { "size", chunk_size_params },
+    { "data", chunk_data_params },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum transfer_hash_params[] = {
+    { "size", transfer_hash_size_params },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum tree_hash_params[] = {
+    { "size", transfer_hash_size_params },
+    { "threads", threads_params },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum existing_params[] = {
+    { "existing", existing_files_params },
+    { NULL, NULL }
+};
+
+MunitTest tests[] = {
+    /*name                      test                          setup                 tear_down                 options                 parameters */
+    { "/b64_encode",            bench_b64_encode,             buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, b64_params },
+    { "/b64_decode",            bench_b64_decode,             buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, sized_params },
+    { "/b64_decode_validate",   bench_b64_decode_validate,    buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, b64_params },
+    { "/b85_encode",            bench_b85_encode,             b85_setup,            buffers_tear_down,        MUNIT_TEST_OPTION_NONE, sized_params },
+    { "/b85_decode_validate",   bench_b85_decode_validate,    b85_setup,            buffers_tear_down,        MUNIT_TEST_OPTION_NONE, sized_params },
+    { "/sha256_hash",           bench_sha256_hash,            buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, sha256_params },
+    { "/print_hex",             bench_print_hex,              buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, sized_params },
+    { "/sha256_hash_to_hex",    bench_sha256_hash_to_hex,     buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, hash_params },
+    { "/string_strip",          bench_string_strip,           buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, strip_params },
+    { "/lz_block_pack",         bench_lz_block_pack,          chunk_setup,          buffers_tear_down,        MUNIT_TEST_OPTION_NONE, chunk_params },
+    { "/lz_block_unpack",       bench_lz_block_unpack,        chunk_setup,          buffers_tear_down,        MUNIT_TEST_OPTION_NONE, chunk_params },
+    { "/byte_entropy_bits",     bench_byte_entropy_bits,      chunk_setup,          buffers_tear_down,        MUNIT_TEST_OPTION_NONE, chunk_params },
+    { "/chained_hash",          bench_chained_hash,           buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, transfer_hash_params },
+    { "/tree_hash",             bench_tree_hash,              buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, tree_hash_params },
+    { "/chunk_dedup_cut",       bench_chunk_dedup_cut,        buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, transfer_hash_params },
+    { "/delta_weak_roll",       bench_delta_weak_roll,        buffers_setup,        buffers_tear_down,        MUNIT_TEST_OPTION_NONE, transfer_hash_params },
+    { "/find_suitable_filename", bench_find_suitable_filename, existing_files_setup, existing_files_tear_down, MUNIT_TEST_OPTION_NONE, existing_params },
+    { "/coreutils_base64",      bench_coreutils_base64,       reference_file_setup, buffers_tear_down,        MUNIT_TEST_OPTION_NONE, reference_params },
+    { "/coreutils_sha256sum",   bench_coreutils_sha256sum,    reference_file_setup, buffers_tear_down,        MUNIT_TEST_OPTION_NONE, reference_params },
+
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite suite = {
+    "bench", /* name */
+    tests, /* tests */
+    NULL, /* suites */
+    3, /* iterations */
+    MUNIT_SUITE_OPTION_NONE /* options */
+};
+
+static munit_bool parse_json_argument(const MunitSuite *suite, void *user_data, int *arg, int argc,
+        char* const argv[]) {
+    if (*arg + 1 >= argc) {
+        fputs("[Error] --json needs a file name.\n", stderr);
+        return false;
+    }
+    (*arg)++;
+    bench_json_filename = argv[*arg];
+    return true;
+}
+
+static void write_json_help(const MunitArgument *argument, void *user_data) {
+    printf(" --json FILE\n"
+           "           Write the results as JSON to FILE.\n");
+}
+
+static const MunitArgument arguments[] = {
+    { "json", parse_json_argument, write_json_help },
+    { NULL, NULL, NULL }
+};
+
+static void print_results_table() {
+    printf("\n%-24s %-10s %10s %14s %12s\n", "benchmark", "impl", "size", "ns/op", "MB/s");
+    for (int i=0; i<bench_results->count; i++) {
+        BenchRecord *record = &bench_results->records[i];
+        printf("%-24s %-10s %10zu %14.1f", record->name, record->impl, record->size, record->ns_per_op);
+        if (record->bytes_per_op != 0) {
+            printf(" %12.1f\n", record->bytes_per_op / record->ns_per_op * 1e3);
+        } else {
+            printf(" %12s\n", "-");
+        }
+    }
+}
+
+static bool write_results_json(const char *filename) {
+    FILE *fhandle = fopen(filename, "w");
+    if (fhandle == NULL) {
+        fprintf(stderr, "[Error] Unable to write '%s'.\n", filename);
+        return false;
+    }
+
+    fprintf(fhandle, "{\n  \"version\": \"%s\",\n  \"benchmarks\": [", QUOTED_APP_VERSION);
+    for (int i=0; i<bench_results->count; i++) {
+        BenchRecord *record = &bench_results->records[i];
+        fprintf(fhandle, "%s\n    {\"name\": \"%s\", \"impl\": \"%s\", \"size\": %zu, \"samples\": %u, \"ns_per_op\": %.3f",
+            i == 0 ? "" : ",", record->name, record->impl, record->size, record->samples, record->ns_per_op);
+        if (record->bytes_per_op != 0) {
+            fprintf(fhandle, ", \"mb_per_s\": %.3f}", record->bytes_per_op / record->ns_per_op * 1e3);
+        } else {
+            fprintf(fhandle, ", \"mb_per_s\": null}");
+        }
+    }
+    fprintf(fhandle, "\n  ]\n}\n");
+    return fclose(fhandle) == 0;
+}
+
+int main(int argc, char **argv) {
+    bench_results = mmap(NULL, sizeof(BenchResults), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bench_results == MAP_FAILED) {
+        fputs("[Error] Unable to map the results area.\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    int rc = munit_suite_main_custom(&suite, NULL, argc, argv, arguments);
+
+    print_results_table();
+    if (bench_json_filename != NULL && !write_results_json(bench_json_filename)) {
+        rc = EXIT_FAILURE;
+    }
+    return rc;
+}
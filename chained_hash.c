@@ -0,0 +1,41 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libs/sha256.h"
+
+/**
+ * Running state of the transfer protocol's chained hash.
+ *
+ * The hash of each line covers the hash of the previous line followed by
+ * the line's payload. The very first line has no predecessor and hashes
+ * only its own payload.
+ */
+typedef struct {
+    bool is_previous_hash;
+    unsigned char previous_hash[SHA256_SIZE_BYTES];
+} ChainedHash;
+
+void chained_hash_init(ChainedHash *chain) {
+    chain->is_previous_hash = false;
+}
+
+/**
+ * Advance the chain over the next payload.
+ *
+ * The new hash is left in `chain->previous_hash`.
+ */
+void chained_hash_update(ChainedHash *chain, const void *data, size_t length) {
+    sha256_context hash;
+    sha256_init(&hash);
+    if (chain->is_previous_hash) {
+        sha256_hash(&hash, chain->previous_hash, SHA256_SIZE_BYTES);
+    }
+    sha256_hash(&hash, data, length);
+    sha256_done(&hash, chain->previous_hash);
+    chain->is_previous_hash = true;
+}
@@ -0,0 +1,282 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "libs/sha256.h"
+
+/*
+ * The "chunk-dedup" transfer mode, which skips the parts of a file that
+ * the terminal already holds from earlier transfers.
+ *
+ * The file is cut into chunks at places chosen by its contents, using a
+ * rolling hash, so an edit only changes the chunks around it and the rest
+ * still match what was sent before. After the start record, `show` offers
+ * every chunk as a line `C:<SHA-256 in hex>:<length>`, in file order, and
+ * ends the offer with `Q:<hex>`, the SHA-256 of all the chunk digests one
+ * after the other, which guards the list itself.
+ *
+ * The terminal answers on our tty with `#W:<hex>` lines, a bitmap of the
+ * chunks it wants. Each hex digit covers the next 4 chunks, the highest bit
+ * first, and the lines carry on until every chunk is covered. The data
+ * lines then carry the wanted chunks one after the other, hashed as usual,
+ * and the terminal fills in the others from its store. It checks every
+ * chunk of the result against its digest.
+ */
+
+#define TRANSFER_MODE_CHUNK_DEDUP "chunk-dedup"
+
+/* Chunks are cut at about every CHUNK_DEDUP_AVERAGE_BYTES, within these bounds. */
+#define CHUNK_DEDUP_MIN_BYTES (4 * 1024)
+#define CHUNK_DEDUP_AVERAGE_BYTES (16 * 1024)
+#define CHUNK_DEDUP_MAX_BYTES (64 * 1024)
+
+/* A cut needs more zero bits before the average size and fewer after it,
+   which keeps the sizes close to the average. The top bits of the hash
+   depend on the most bytes. */
+#define CHUNK_DEDUP_MASK_SMALL (0xffffULL << 48)
+#define CHUNK_DEDUP_MASK_LARGE (0xfffULL << 52)
+
+/* How many chunks one hex digit of an answer covers. */
+#define CHUNK_DEDUP_CHUNKS_PER_DIGIT 4
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    unsigned char digest[SHA256_SIZE_BYTES];
+    bool is_wanted;
+} DedupChunk;
+
+/**
+ * The chunks of one file and what the terminal made of them.
+ */
+typedef struct {
+    DedupChunk *chunks;
+    size_t count;
+    size_t capacity;
+    size_t answered;            /* Chunks covered by the answer so far. */
+    size_t wanted_count;
+    uint64_t wanted_bytes;
+
+    /* Where dedup_plan_next_range() has got to. */
+    size_t next_chunk;
+    uint64_t next_offset;
+} DedupPlan;
+
+/* Rolling hash table. It must never change, or chunks held by terminals stop matching. */
+static uint64_t chunk_dedup_gear[256];
+static bool is_chunk_dedup_gear_ready = false;
+
+static void chunk_dedup_init_gear() {
+    if (is_chunk_dedup_gear_ready) {
+        return;
+    }
+    /* splitmix64 */
+    uint64_t state = 0x6368756e6b646564ULL;
+    for (int i=0; i<256; i++) {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        chunk_dedup_gear[i] = z ^ (z >> 31);
+    }
+    is_chunk_dedup_gear_ready = true;
+}
+
+/**
+ * Find where the first chunk of some data ends.
+ *
+ * @param length The data available, which must be at least
+ *          CHUNK_DEDUP_MAX_BYTES unless the data ends there.
+ * @return the length of the chunk.
+ */
+size_t chunk_dedup_cut(const unsigned char *data, size_t length) {
+    if (length <= CHUNK_DEDUP_MIN_BYTES) {
+        return length;
+    }
+    chunk_dedup_init_gear();
+    size_t limit = length < CHUNK_DEDUP_MAX_BYTES ? length : CHUNK_DEDUP_MAX_BYTES;
+    size_t average = limit < CHUNK_DEDUP_AVERAGE_BYTES ? limit : CHUNK_DEDUP_AVERAGE_BYTES;
+
+    uint64_t hash = 0;
+    size_t i = CHUNK_DEDUP_MIN_BYTES;
+    for (; i<average; i++) {
+        hash = (hash << 1) + chunk_dedup_gear[data[i]];
+        if ((hash & CHUNK_DEDUP_MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i<limit; i++) {
+        hash = (hash << 1) + chunk_dedup_gear[data[i]];
+        if ((hash & CHUNK_DEDUP_MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+void dedup_plan_init(DedupPlan *plan) {
+    memset(plan, 0, sizeof(*plan));
+}
+
+void dedup_plan_free(DedupPlan *plan) {
+    free(plan->chunks);
+    plan->chunks = NULL;
+}
+
+/**
+ * Add the next chunk of the file.
+ *
+ * @return false if out of memory.
+ */
+bool dedup_plan_add(DedupPlan *plan, const unsigned char *digest, uint32_t length) {
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity == 0 ? 64 : plan->capacity * 2;
+        DedupChunk *chunks = realloc(plan->chunks, capacity * sizeof(DedupChunk));
+        if (chunks == NULL) {
+            return false;
+        }
+        plan->chunks = chunks;
+        plan->capacity = capacity;
+    }
+    DedupChunk *chunk = &plan->chunks[plan->count];
+    chunk->offset = plan->count == 0 ? 0 : plan->chunks[plan->count - 1].offset + plan->chunks[plan->count - 1].length;
+    chunk->length = length;
+    memcpy(chunk->digest, digest, SHA256_SIZE_BYTES);
+    chunk->is_wanted = false;
+    plan->count++;
+    return true;
+}
+
+/**
+ * Cut a whole regular file into chunks.
+ *
+ * The file is read with pread(), which leaves its offset where it was.
+ *
+ * @return false if the file couldn't be read, or was shorter than `size`.
+ */
+bool dedup_plan_scan(DedupPlan *plan, int fd, off_t size) {
+    const size_t capacity = 16 * CHUNK_DEDUP_MAX_BYTES;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return false;
+    }
+
+    off_t read_offset = 0;
+    size_t start = 0;
+    size_t end = 0;
+    bool ok = true;
+    while (ok) {
+        /* Keep at least the largest chunk in the buffer until the file runs out. */
+        if (end - start < CHUNK_DEDUP_MAX_BYTES && read_offset < size) {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            while (end < capacity && read_offset < size) {
+                ssize_t count = pread(fd, buffer + end, capacity - end, read_offset);
+                if (count <= 0) {
+                    ok = false;
+                    break;
+                }
+                end += count;
+                read_offset += count;
+            }
+        }
+        if (!ok || start == end) {
+            break;
+        }
+
+        size_t length = chunk_dedup_cut(buffer + start, end - start);
+        unsigned char digest[SHA256_SIZE_BYTES];
+        sha256(buffer + start, length, digest);
+        ok = dedup_plan_add(plan, digest, length);
+        start += length;
+    }
+    free(buffer);
+    return ok;
+}
+
+/**
+ * Hash of the list of chunks, which ends the offer.
+ */
+void dedup_plan_list_hash(const DedupPlan *plan, unsigned char *hash) {
+    sha256_context context;
+    sha256_init(&context);
+    for (size_t i=0; i<plan->count; i++) {
+        sha256_hash(&context, plan->chunks[i].digest, SHA256_SIZE_BYTES);
+    }
+    sha256_done(&context, hash);
+}
+
+/**
+ * Take in the hex digits of one line of the terminal's answer.
+ *
+ * @return false if there is something other than hex digits.
+ */
+bool dedup_plan_take_answer(DedupPlan *plan, const char *hex, size_t length) {
+    for (size_t i=0; i<length; i++) {
+        int value = hex_char_value(hex[i]);
+        if (value < 0) {
+            return false;
+        }
+        for (int bit=CHUNK_DEDUP_CHUNKS_PER_DIGIT-1; bit>=0 && plan->answered < plan->count; bit--) {
+            DedupChunk *chunk = &plan->chunks[plan->answered++];
+            chunk->is_wanted = (value >> bit) & 1;
+            if (chunk->is_wanted) {
+                plan->wanted_count++;
+                plan->wanted_bytes += chunk->length;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @return true once the answer covers every chunk.
+ */
+bool dedup_plan_is_answered(const DedupPlan *plan) {
+    return plan->answered == plan->count;
+}
+
+/**
+ * Find the next piece of the file to send, skipping the chunks which the
+ * terminal already has.
+ *
+ * @param offset Receives where the piece starts in the file.
+ * @param length Holds the most to send and receives the length of the
+ *          piece, which only spans wanted chunks next to each other.
+ * @return false once every wanted chunk has been handed out.
+ */
+bool dedup_plan_next_range(DedupPlan *plan, uint64_t *offset, size_t *length) {
+    while (plan->next_chunk < plan->count && !plan->chunks[plan->next_chunk].is_wanted) {
+        plan->next_chunk++;
+        plan->next_offset = plan->next_chunk < plan->count ? plan->chunks[plan->next_chunk].offset : 0;
+    }
+    if (plan->next_chunk == plan->count) {
+        return false;
+    }
+
+    *offset = plan->next_offset;
+    size_t taken = 0;
+    while (taken < *length && plan->next_chunk < plan->count && plan->chunks[plan->next_chunk].is_wanted) {
+        DedupChunk *chunk = &plan->chunks[plan->next_chunk];
+        uint64_t remaining = chunk->offset + chunk->length - plan->next_offset;
+        size_t take = remaining < *length - taken ? remaining : *length - taken;
+        taken += take;
+        plan->next_offset += take;
+        if (take == remaining) {
+            plan->next_chunk++;
+            plan->next_offset = plan->next_chunk < plan->count ? plan->chunks[plan->next_chunk].offset : 0;
+        }
+    }
+    *length = taken;
+    return true;
+}
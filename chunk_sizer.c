@@ -0,0 +1,116 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+/**
+ * Picks the size of the data chunks sent to the terminal.
+ *
+ * Every data line carries a hash and some framing, so on a fast local
+ * terminal big chunks are much cheaper. On a slow link though a big line
+ * takes a long time to get through, and everything typed or printed after
+ * it has to wait. The sizer watches how long writes to the terminal block
+ * and how much is left in the tty's output queue, estimates the link's
+ * throughput, and aims for lines which take about CHUNK_SIZER_TARGET_SECONDS
+ * to get through.
+ *
+ * Chunk sizes are always a multiple of 3 so that only the last line of a
+ * transfer needs base64 padding.
+ */
+typedef struct {
+    int fd;
+    size_t chunk_bytes;
+    size_t min_bytes;
+    size_t max_bytes;
+    double bytes_per_second;    /* Estimated link throughput, 0 until a write has blocked. */
+    double line_expansion;      /* Line bytes sent per chunk byte. */
+} ChunkSizer;
+
+#define CHUNK_SIZER_MIN_BYTES (3 * 256)
+#define CHUNK_SIZER_LIMIT_BYTES (3 * 64 * 1024)
+#define CHUNK_SIZER_TARGET_SECONDS 0.05
+
+/* Writes which return quicker than this didn't have to wait for the link. */
+#define CHUNK_SIZER_BLOCKED_SECONDS 0.001
+
+static size_t round_down_to_3(size_t bytes) {
+    return bytes - bytes % 3;
+}
+
+/**
+ * @param initial_bytes Chunk size to start with.
+ * @param max_bytes Largest chunk the terminal accepts.
+ * @param line_expansion The line encoding's expansion, see line_encoding_expansion(). Packed chunks
+ *          are never much bigger than their data, so this stays an upper bound for them.
+ */
+void chunk_sizer_init(ChunkSizer *sizer, int fd, size_t initial_bytes, size_t max_bytes, double line_expansion) {
+    sizer->fd = fd;
+    sizer->line_expansion = line_expansion;
+    sizer->max_bytes = round_down_to_3(max_bytes < CHUNK_SIZER_LIMIT_BYTES ? max_bytes : CHUNK_SIZER_LIMIT_BYTES);
+    if (sizer->max_bytes < 3) {
+        sizer->max_bytes = 3;
+    }
+    sizer->min_bytes = CHUNK_SIZER_MIN_BYTES < sizer->max_bytes ? CHUNK_SIZER_MIN_BYTES : sizer->max_bytes;
+    initial_bytes = round_down_to_3(initial_bytes);
+    sizer->chunk_bytes = initial_bytes < sizer->min_bytes ? sizer->min_bytes
+        : initial_bytes > sizer->max_bytes ? sizer->max_bytes : initial_bytes;
+    sizer->bytes_per_second = 0;
+}
+
+/**
+ * Bytes written to the terminal which haven't left this machine yet.
+ */
+static size_t terminal_output_queue_bytes(int fd) {
+#ifdef TIOCOUTQ
+    int queued = 0;
+    if (ioctl(fd, TIOCOUTQ, &queued) == 0 && queued > 0) {
+        return queued;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Adjust the chunk size after a write to the terminal.
+ *
+ * @param written_bytes Bytes the write sent.
+ * @param elapsed_seconds How long the write took.
+ */
+void chunk_sizer_update(ChunkSizer *sizer, size_t written_bytes, double elapsed_seconds) {
+    size_t queued_bytes = terminal_output_queue_bytes(sizer->fd);
+
+    if (elapsed_seconds >= CHUNK_SIZER_BLOCKED_SECONDS) {
+        /* The write waited for the link to drain, so its speed is the link's. */
+        double sample = written_bytes / elapsed_seconds;
+        sizer->bytes_per_second = sizer->bytes_per_second == 0 ? sample
+            : 0.75 * sizer->bytes_per_second + 0.25 * sample;
+    } else if (queued_bytes == 0) {
+        /* The link kept up. Grow until it doesn't. */
+        size_t grown = sizer->chunk_bytes * 2;
+        if (sizer->bytes_per_second != 0 && grown > sizer->bytes_per_second * CHUNK_SIZER_TARGET_SECONDS) {
+            /* An old estimate is no longer trustworthy. */
+            sizer->bytes_per_second = 0;
+        }
+        sizer->chunk_bytes = grown < sizer->max_bytes ? grown : sizer->max_bytes;
+        return;
+    }
+
+    if (sizer->bytes_per_second == 0) {
+        return;
+    }
+
+    /* Anything still queued has to go out before the next line. */
+    double budget_bytes = sizer->bytes_per_second * CHUNK_SIZER_TARGET_SECONDS - queued_bytes;
+    double target = budget_bytes / sizer->line_expansion;
+    if (target <= sizer->min_bytes) {
+        sizer->chunk_bytes = sizer->min_bytes;
+    } else if (target >= sizer->max_bytes) {
+        sizer->chunk_bytes = sizer->max_bytes;
+    } else {
+        sizer->chunk_bytes = round_down_to_3(target);
+    }
+}
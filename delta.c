@@ -0,0 +1,497 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "libs/sha256.h"
+
+/*
+ * The "delta" transfer mode, which sends a file as its changes against the
+ * previous version of the same filename that the terminal holds, the way
+ * rsync does.
+ *
+ * After the start record, the terminal sends on our tty the line
+ * `#S:<block size>:<length of its version>`, then the signatures of that
+ * version's blocks in `#G:` lines. Each signature is the weak rolling
+ * checksum of the block as 8 hex digits, followed by the first
+ * DELTA_STRONG_BYTES of its SHA-256 in hex. The last block may be short.
+ * A length of 0 means that the terminal has no previous version, and the
+ * transfer carries on as a plain one.
+ *
+ * Otherwise the data lines carry a stream of instructions which rebuild
+ * the file from the previous version:
+ *
+ *   'C' <first block> <block count>    Copy blocks of the previous version.
+ *   'L' <length> <bytes>               Literal bytes, at most DELTA_MAX_LITERAL_BYTES.
+ *   'E' <SHA-256 of the whole file>    The end, which the result is checked against.
+ *
+ * The numbers are 4 bytes little endian, as in lz-block. The stream is
+ * split into lines wherever it suits, and they are hashed and encoded as
+ * usual.
+ */
+
+#define TRANSFER_MODE_DELTA "delta"
+
+#define DELTA_MIN_BLOCK_BYTES 512
+#define DELTA_MAX_BLOCK_BYTES (64 * 1024)
+#define DELTA_MAX_LITERAL_BYTES (64 * 1024)
+#define DELTA_STRONG_BYTES 16
+/* Hex digits of one signature in a `#G:` line. */
+#define DELTA_SIGNATURE_HEX_LENGTH (8 + DELTA_STRONG_BYTES * 2)
+
+#define DELTA_RECORD_COPY 'C'
+#define DELTA_RECORD_LITERAL 'L'
+#define DELTA_RECORD_END 'E'
+
+typedef struct {
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG_BYTES];
+} DeltaSignature;
+
+/**
+ * The signatures of the terminal's version of a file, looked up by weak checksum.
+ */
+typedef struct {
+    uint32_t block_size;
+    uint64_t base_length;
+    DeltaSignature *blocks;
+    size_t count;
+    size_t received;
+    uint32_t tail_length;       /* Length of a short last block, or 0. */
+
+    /* Chains of the whole blocks with the same hash of their weak checksum. */
+    uint32_t *heads;            /* Block index + 1, or 0. */
+    uint32_t *next;
+    int table_bits;
+} DeltaBase;
+
+/**
+ * One instruction of a delta.
+ */
+typedef struct {
+    char type;
+    uint32_t first_block;
+    uint32_t block_count;
+    const unsigned char *literal;
+    uint32_t literal_length;
+    const unsigned char *file_hash;
+} DeltaRecord;
+
+/**
+ * The weak checksum of rsync: the sum of the bytes, and the sum of those sums.
+ */
+uint32_t delta_weak_checksum(const unsigned char *data, size_t length) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i=0; i<length; i++) {
+        a += data[i];
+        b += (uint32_t) (length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * Move the window of a weak checksum on by one byte.
+ *
+ * @param out The byte leaving the window at the start.
+ * @param in The byte joining it at the end.
+ */
+static inline uint32_t delta_weak_roll(uint32_t weak, unsigned char out, unsigned char in, size_t length) {
+    uint32_t a = ((weak & 0xffff) - out + in) & 0xffff;
+    uint32_t b = ((weak >> 16) - (uint32_t) length * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+void delta_block_signature(const unsigned char *block, size_t length, DeltaSignature *signature) {
+    unsigned char digest[SHA256_SIZE_BYTES];
+    signature->weak = delta_weak_checksum(block, length);
+    sha256(block, length, digest);
+    memcpy(signature->strong, digest, DELTA_STRONG_BYTES);
+}
+
+/**
+ * The block size which the terminal should use for a version of `length`
+ * bytes, about its square root as in rsync.
+ */
+uint32_t delta_block_size(uint64_t length) {
+    uint64_t size = DELTA_MIN_BLOCK_BYTES;
+    while (size < DELTA_MAX_BLOCK_BYTES && size * size < length) {
+        size *= 2;
+    }
+    return size;
+}
+
+void delta_base_init(DeltaBase *base) {
+    memset(base, 0, sizeof(*base));
+}
+
+void delta_base_free(DeltaBase *base) {
+    free(base->blocks);
+    free(base->heads);
+    free(base->next);
+    delta_base_init(base);
+}
+
+/**
+ * Take the `#S:` line which starts the signatures, without its prefix.
+ *
+ * @return false if it is malformed or out of range, or out of memory.
+ */
+bool delta_base_take_header(DeltaBase *base, const char *text) {
+    char *end;
+    unsigned long long block_size = strtoull(text, &end, 10);
+    if (end == text || *end != ':') {
+        return false;
+    }
+    const char *length_text = end + 1;
+    unsigned long long base_length = strtoull(length_text, &end, 10);
+    if (end == length_text || *end != '\0' || block_size > DELTA_MAX_BLOCK_BYTES ||
+            (block_size == 0 && base_length != 0)) {
+        return false;
+    }
+    if (block_size != 0 && (base_length + block_size - 1) / block_size > UINT32_MAX) {
+        return false;
+    }
+
+    base->block_size = block_size;
+    base->base_length = base_length;
+    base->count = base_length == 0 ? 0 : (base_length + block_size - 1) / block_size;
+    base->tail_length = base_length == 0 ? 0 : base_length % block_size;
+    if (base->count != 0) {
+        base->blocks = malloc(base->count * sizeof(DeltaSignature));
+        if (base->blocks == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Take the signatures of one `#G:` line, without its prefix.
+ *
+ * @return false if they are malformed, or there are more than the header said.
+ */
+bool delta_base_take_signatures(DeltaBase *base, const char *hex, size_t length) {
+    if (length % DELTA_SIGNATURE_HEX_LENGTH != 0 ||
+            length / DELTA_SIGNATURE_HEX_LENGTH > base->count - base->received) {
+        return false;
+    }
+    for (; length != 0; hex += DELTA_SIGNATURE_HEX_LENGTH, length -= DELTA_SIGNATURE_HEX_LENGTH) {
+        DeltaSignature *signature = &base->blocks[base->received];
+        unsigned char weak[4];
+        if (!hex_to_bytes(hex, 4, weak) || !hex_to_bytes(hex + 8, DELTA_STRONG_BYTES, signature->strong)) {
+            return false;
+        }
+        signature->weak = (uint32_t) weak[0] << 24 | weak[1] << 16 | weak[2] << 8 | weak[3];
+        base->received++;
+    }
+    return true;
+}
+
+/**
+ * @return true once every signature has arrived.
+ */
+bool delta_base_is_complete(const DeltaBase *base) {
+    return base->received == base->count;
+}
+
+static uint32_t delta_weak_hash(const DeltaBase *base, uint32_t weak) {
+    return (weak * 2654435761u) >> (32 - base->table_bits);
+}
+
+/**
+ * Index the whole blocks by their weak checksum, once every signature has arrived.
+ *
+ * @return false if out of memory.
+ */
+bool delta_base_index(DeltaBase *base) {
+    /* Sparse, so that most places in a file which has changed are passed over after one look. */
+    base->table_bits = 4;
+    while (base->table_bits < 30 && ((size_t) 1 << base->table_bits) < base->count * 8) {
+        base->table_bits++;
+    }
+    base->heads = calloc((size_t) 1 << base->table_bits, sizeof(uint32_t));
+    base->next = malloc((base->count + 1) * sizeof(uint32_t));
+    if (base->heads == NULL || base->next == NULL) {
+        return false;
+    }
+    size_t whole_count = base->tail_length != 0 ? base->count - 1 : base->count;
+    /* Backwards, so that each chain starts at its earliest block. */
+    for (size_t i=whole_count; i>0; i--) {
+        uint32_t slot = delta_weak_hash(base, base->blocks[i - 1].weak);
+        base->next[i - 1] = base->heads[slot];
+        base->heads[slot] = i;
+    }
+    return true;
+}
+
+/**
+ * @return false if no whole block of the base can have this weak checksum.
+ */
+static inline bool delta_base_may_match(const DeltaBase *base, uint32_t weak) {
+    return base->heads[delta_weak_hash(base, weak)] != 0;
+}
+
+static bool delta_strong_matches(const DeltaSignature *signature, const unsigned char *digest) {
+    return memcmp(signature->strong, digest, DELTA_STRONG_BYTES) == 0;
+}
+
+/**
+ * Find a whole block of the base with the same contents as `data`.
+ *
+ * @param preferred The block to pick when several match, as it would extend the last copy.
+ * @return the index of the block, or -1.
+ */
+long delta_base_find(const DeltaBase *base, uint32_t weak, const unsigned char *data, uint32_t preferred) {
+    bool is_digest_ready = false;
+    unsigned char digest[SHA256_SIZE_BYTES];
+    long found = -1;
+    for (uint32_t i=base->heads[delta_weak_hash(base, weak)]; i!=0; i=base->next[i - 1]) {
+        if (base->blocks[i - 1].weak != weak) {
+            continue;
+        }
+        /* The SHA-256 is only worth working out once the weak checksum matches. */
+        if (!is_digest_ready) {
+            sha256(data, base->block_size, digest);
+            is_digest_ready = true;
+        }
+        if (delta_strong_matches(&base->blocks[i - 1], digest)) {
+            if (i - 1 == preferred) {
+                return i - 1;
+            }
+            if (found == -1) {
+                found = i - 1;
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * Writes the instructions of a delta, joining copies of blocks next to each other.
+ */
+typedef struct {
+    FILE *out;
+    uint32_t copy_first;
+    uint32_t copy_count;
+} DeltaWriter;
+
+static void delta_put_u32(DeltaWriter *writer, uint32_t value) {
+    unsigned char bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    fwrite(bytes, 1, sizeof(bytes), writer->out);
+}
+
+static void delta_flush_copy(DeltaWriter *writer) {
+    if (writer->copy_count != 0) {
+        fputc(DELTA_RECORD_COPY, writer->out);
+        delta_put_u32(writer, writer->copy_first);
+        delta_put_u32(writer, writer->copy_count);
+        writer->copy_count = 0;
+    }
+}
+
+static void delta_put_copy(DeltaWriter *writer, uint32_t block) {
+    if (writer->copy_count != 0 && writer->copy_first + writer->copy_count == block) {
+        writer->copy_count++;
+        return;
+    }
+    delta_flush_copy(writer);
+    writer->copy_first = block;
+    writer->copy_count = 1;
+}
+
+static void delta_put_literal(DeltaWriter *writer, const unsigned char *data, size_t length) {
+    if (length != 0) {
+        delta_flush_copy(writer);
+    }
+    while (length != 0) {
+        size_t piece = length < DELTA_MAX_LITERAL_BYTES ? length : DELTA_MAX_LITERAL_BYTES;
+        fputc(DELTA_RECORD_LITERAL, writer->out);
+        delta_put_u32(writer, piece);
+        fwrite(data, 1, piece, writer->out);
+        data += piece;
+        length -= piece;
+    }
+}
+
+/**
+ * Work out the delta of a whole regular file against the base.
+ *
+ * The file is read with pread(), which leaves its offset where it was.
+ *
+ * @param base Indexed base with at least one block.
+ * @param out Receives the instructions.
+ * @return false if the file couldn't be read or was shorter than `size`, or `out` couldn't be written.
+ */
+bool delta_encode(const DeltaBase *base, int fd, off_t size, FILE *out) {
+    const size_t block_size = base->block_size;
+    const size_t read_bytes = 1024 * 1024;
+    /* Room for the longest literal which is held back, a block after it, and a read. */
+    const size_t capacity = DELTA_MAX_LITERAL_BYTES + block_size + read_bytes;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return false;
+    }
+
+    sha256_context file_hash;
+    sha256_init(&file_hash);
+    DeltaWriter writer = { .out = out };
+    off_t read_offset = 0;
+    size_t end = 0;
+    size_t pos = 0;
+    size_t literal_start = 0;
+    uint32_t weak = 0;
+    bool is_weak_valid = false;
+    bool ok = true;
+
+    while (ok) {
+        /* Keep more than a whole block ahead, so that the checksum can roll on. */
+        if (end - pos <= block_size && read_offset < size) {
+            memmove(buffer, buffer + literal_start, end - literal_start);
+            end -= literal_start;
+            pos -= literal_start;
+            literal_start = 0;
+            while (end < capacity && read_offset < size) {
+                size_t wanted = capacity - end < (uint64_t) (size - read_offset) ? capacity - end : (size_t) (size - read_offset);
+                ssize_t count = pread(fd, buffer + end, wanted, read_offset);
+                if (count <= 0) {
+                    ok = false;
+                    break;
+                }
+                sha256_hash(&file_hash, buffer + end, count);
+                end += count;
+                read_offset += count;
+            }
+            continue;
+        }
+
+        size_t ahead = end - pos;
+        if (ahead >= block_size) {
+            if (!is_weak_valid) {
+                weak = delta_weak_checksum(buffer + pos, block_size);
+                is_weak_valid = true;
+            }
+            /* Most places can't start a match, and are rolled past in a tight loop. The
+               checksum can roll on while the buffer holds the byte after the block. */
+            size_t stop = end - block_size;
+            if (stop > literal_start + DELTA_MAX_LITERAL_BYTES) {
+                stop = literal_start + DELTA_MAX_LITERAL_BYTES;
+            }
+            while (pos < stop && !delta_base_may_match(base, weak)) {
+                weak = delta_weak_roll(weak, buffer[pos], buffer[pos + block_size], block_size);
+                pos++;
+            }
+            if (pos - literal_start == DELTA_MAX_LITERAL_BYTES) {
+                delta_put_literal(&writer, buffer + literal_start, pos - literal_start);
+                literal_start = pos;
+                continue;
+            }
+
+            uint32_t preferred = writer.copy_count != 0 ? writer.copy_first + writer.copy_count : 0;
+            long block = delta_base_find(base, weak, buffer + pos, preferred);
+            if (block >= 0) {
+                delta_put_literal(&writer, buffer + literal_start, pos - literal_start);
+                delta_put_copy(&writer, block);
+                pos += block_size;
+                literal_start = pos;
+                is_weak_valid = false;
+                continue;
+            }
+            /* The tight loop may have moved pos, so look at what is left ahead now. */
+            if (end - pos > block_size) {
+                weak = delta_weak_roll(weak, buffer[pos], buffer[pos + block_size], block_size);
+            } else {
+                is_weak_valid = false;
+            }
+            pos++;
+            if (pos - literal_start == DELTA_MAX_LITERAL_BYTES) {
+                delta_put_literal(&writer, buffer + literal_start, pos - literal_start);
+                literal_start = pos;
+            }
+            continue;
+        }
+
+        /* Less than a block is left, which only a short last block of the base can match. */
+        if (ahead != 0 && ahead == base->tail_length) {
+            DeltaSignature signature;
+            delta_block_signature(buffer + pos, ahead, &signature);
+            const DeltaSignature *tail = &base->blocks[base->count - 1];
+            if (signature.weak == tail->weak && memcmp(signature.strong, tail->strong, DELTA_STRONG_BYTES) == 0) {
+                delta_put_literal(&writer, buffer + literal_start, pos - literal_start);
+                delta_put_copy(&writer, base->count - 1);
+                literal_start = end;
+            }
+        }
+        delta_put_literal(&writer, buffer + literal_start, end - literal_start);
+        delta_flush_copy(&writer);
+        break;
+    }
+    free(buffer);
+
+    if (ok) {
+        unsigned char digest[SHA256_SIZE_BYTES];
+        sha256_done(&file_hash, digest);
+        fputc(DELTA_RECORD_END, out);
+        fwrite(digest, 1, SHA256_SIZE_BYTES, out);
+    }
+    return ok && !ferror(out);
+}
+
+static uint32_t delta_read_u32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * Parse the next instruction of a delta.
+ *
+ * @param record Receives the instruction, which points into `data`.
+ * @return the length of the instruction, 0 if more data is needed, or -1 if it is malformed.
+ */
+long delta_parse_record(const unsigned char *data, size_t length, DeltaRecord *record) {
+    if (length == 0) {
+        return 0;
+    }
+    record->type = data[0];
+    switch (data[0]) {
+        case DELTA_RECORD_COPY:
+            if (length < 9) {
+                return 0;
+            }
+            record->first_block = delta_read_u32(data + 1);
+            record->block_count = delta_read_u32(data + 5);
+            return record->block_count != 0 ? 9 : -1;
+
+        case DELTA_RECORD_LITERAL:
+            if (length < 5) {
+                return 0;
+            }
+            record->literal_length = delta_read_u32(data + 1);
+            if (record->literal_length == 0 || record->literal_length > DELTA_MAX_LITERAL_BYTES) {
+                return -1;
+            }
+            if (length < 5 + record->literal_length) {
+                return 0;
+            }
+            record->literal = data + 5;
+            return 5 + record->literal_length;
+
+        case DELTA_RECORD_END:
+            if (length < 1 + SHA256_SIZE_BYTES) {
+                return 0;
+            }
+            record->file_hash = data + 1;
+            return 1 + SHA256_SIZE_BYTES;
+
+        default:
+            return -1;
+    }
+}
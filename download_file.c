@@ -0,0 +1,142 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * A file being downloaded into, which only gets a name once it is complete.
+ *
+ * Where the file system supports it the file is created with O_TMPFILE and
+ * has no name at all until it is published with linkat(2), so a failed
+ * transfer leaves nothing behind. Elsewhere it is a mkstemp(3) file which
+ * is hard linked into place and then removed.
+ */
+typedef struct {
+    int fd;
+    char *tmp_filename;     /* NULL if the file is anonymous. */
+} DownloadFile;
+
+#define DOWNLOAD_FILE_TEMPLATE "extraterm_from_XXXXXX"
+
+/**
+ * Create the unnamed file in the current directory.
+ */
+bool download_file_create(DownloadFile *file) {
+    file->tmp_filename = NULL;
+
+#ifdef O_TMPFILE
+    file->fd = open(".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (file->fd != -1) {
+        return true;
+    }
+    /* EISDIR or EOPNOTSUPP mean the kernel or file system can't do it. */
+#endif
+
+    file->tmp_filename = strdup(DOWNLOAD_FILE_TEMPLATE);
+    file->fd = mkstemp(file->tmp_filename);
+    if (file->fd == -1) {
+        free(file->tmp_filename);
+        file->tmp_filename = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Convert a file size from JSON metadata, which the terminal supplies, to an off_t.
+ *
+ * @return false if the size is negative, not a number, or too big for an off_t.
+ */
+bool file_size_from_double(double value, off_t *size) {
+    const double limit = (double) ((uint64_t) 1 << (sizeof(off_t) * CHAR_BIT - 1));
+    if (!(value >= 0 && value < limit)) {
+        return false;
+    }
+    *size = (off_t) value;
+    return true;
+}
+
+/**
+ * Reserve disk space for the expected size of a file being written from the start.
+ *
+ * This is only a hint for the file system to lay the file out in one
+ * piece. The file size itself isn't changed, and failure is harmless as the
+ * space is then allocated as it is written.
+ */
+void preallocate_file_space(int fd, off_t size) {
+    if (size <= 0) {
+        return;
+    }
+#if defined(__linux__)
+    /* Not posix_fallocate(), which falls back to writing zeros. */
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(__APPLE__)
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0 };
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &store);
+    }
+#endif
+}
+
+/**
+ * Give the finished file its name.
+ *
+ * An existing file is never replaced.
+ *
+ * @return false on failure, with errno set to EEXIST if the name is taken.
+ */
+bool download_file_publish(DownloadFile *file, const char *filename) {
+    if (file->tmp_filename != NULL) {
+        if (link(file->tmp_filename, filename) == -1) {
+            return false;
+        }
+        unlink(file->tmp_filename);
+        free(file->tmp_filename);
+        file->tmp_filename = NULL;
+        return true;
+    }
+
+#ifdef O_TMPFILE
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", file->fd);
+    if (linkat(AT_FDCWD, fd_path, AT_FDCWD, filename, AT_SYMLINK_FOLLOW) == 0) {
+        return true;
+    }
+    if (errno != ENOENT) {
+        return false;
+    }
+    /* No /proc. This needs CAP_DAC_READ_SEARCH, but is worth a try. */
+    return linkat(file->fd, "", AT_FDCWD, filename, AT_EMPTY_PATH) == 0;
+#else
+    errno = EINVAL;
+    return false;
+#endif
+}
+
+/**
+ * Close the file and remove it if it was never published.
+ */
+void download_file_close(DownloadFile *file) {
+    if (file->fd != -1) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if (file->tmp_filename != NULL) {
+        unlink(file->tmp_filename);
+        free(file->tmp_filename);
+        file->tmp_filename = NULL;
+    }
+}
@@ -4,9 +4,7 @@
  * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
  */
 #include <stdlib.h>
-
-const char *EXTRATERM_INTRO = "\x1b&";
-/* const char *EXTRATERM_INTRO = ""; */
+#include <string.h>
 
 char *get_extratern_cookie() {
     return getenv("LC_EXTRATERM_COOKIE");
@@ -16,51 +14,108 @@ bool is_extraterm() {
     return get_extratern_cookie() != NULL;
 }
 
-void extraterm_start_file_transfer(const char* mimetype, const char* charset, const char* filename, size_t filesize,
-        bool downloadFlag) {
-
-    JSON_Value *root_value = json_value_init_object();
-    JSON_Object *root_object = json_value_get_object(root_value);
-    char *serialized_string = NULL;
-    if (mimetype != NULL) {
-        json_object_set_string(root_object, "mimeType", mimetype);
-    }
-    if (filename != NULL) {
-        json_object_set_string(root_object, "filename", filename);
-    }
-    if (charset != NULL) {
-        json_object_set_string(root_object, "charset", charset);
+/**
+ * Largest data chunk the terminal accepts in a file transfer line.
+ *
+ * Terminals which take more than the default say so in
+ * LC_EXTRATERM_MAX_CHUNK, which like the cookie gets through ssh.
+ */
+size_t extraterm_max_chunk_bytes(size_t default_bytes) {
+    const char *value = getenv("LC_EXTRATERM_MAX_CHUNK");
+    if (value == NULL) {
+        return default_bytes;
     }
-    if (filesize != -1) {
-        json_object_set_number(root_object, "filesize", filesize);
+    char *end;
+    unsigned long long bytes = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || bytes < default_bytes) {
+        return default_bytes;
     }
+    return bytes;
+}
 
-    if (downloadFlag) {
-        json_object_set_string(root_object, "download", "true");
-    }
+/**
+ * Check whether the terminal can unpack data lines in a content encoding.
+ *
+ * The encodings it accepts are listed in LC_EXTRATERM_CONTENT_ENCODINGS,
+ * separated by commas.
+ */
+bool extraterm_accepts_content_encoding(const char *encoding) {
+    return list_contains(getenv("LC_EXTRATERM_CONTENT_ENCODINGS"), encoding);
+}
 
-    serialized_string = json_serialize_to_string(root_value);
+/**
+ * Check whether the terminal can check data lines in an integrity mode
+ * other than the chained hash, which every terminal supports.
+ *
+ * The modes it supports are listed in LC_EXTRATERM_INTEGRITY, separated by commas.
+ */
+bool extraterm_accepts_integrity(const char *integrity) {
+    return list_contains(getenv("LC_EXTRATERM_INTEGRITY"), integrity);
+}
 
-    fputs(EXTRATERM_INTRO, stdout);
-    fputs(get_extratern_cookie(), stdout);
-    fputs(";5;", stdout);
-    printf("%li", strlen(serialized_string));
-    fputs("\x07", stdout);
-    fputs(serialized_string, stdout);
+/**
+ * Check whether the terminal can read data lines in a line encoding other
+ * than base64, which every terminal reads.
+ *
+ * The line encodings it reads are listed in LC_EXTRATERM_LINE_ENCODINGS, separated by commas.
+ */
+bool extraterm_accepts_line_encoding(const char *line_encoding) {
+    return list_contains(getenv("LC_EXTRATERM_LINE_ENCODINGS"), line_encoding);
+}
 
-    json_free_serialized_string(serialized_string);
-    json_value_free(root_value);
+/**
+ * Check whether the terminal supports a transfer mode, in which it takes
+ * part in more than receiving the data lines.
+ *
+ * The modes it supports are listed in LC_EXTRATERM_TRANSFER_MODES, separated by commas.
+ */
+bool extraterm_accepts_transfer_mode(const char *transfer_mode) {
+    return list_contains(getenv("LC_EXTRATERM_TRANSFER_MODES"), transfer_mode);
 }
 
-void extraterm_end_file_transfer() {
-    fputc(0, stdout);
+/**
+ * @param content_encoding How the data lines will be packed, or NULL for plain data.
+ * @param integrity How the data lines will be hashed, or NULL for the chained hash.
+ * @param line_encoding How the data lines will be spelt out, or NULL for base64.
+ * @param transfer_mode How the transfer will go, or NULL for the data lines alone.
+ */
+void extraterm_start_file_transfer(OutputBuffer *out, const char* mimetype, const char* charset, const char* filename,
+        size_t filesize, bool downloadFlag, const char *content_encoding, const char *integrity,
+        const char *line_encoding, const char *transfer_mode) {
+
+    const char *cookie = get_extratern_cookie();
+    ProtocolEncoder enc;
+    protocol_encoder_init_counting(&enc);
+    protocol_encode_start_file_transfer(&enc, cookie, mimetype, charset, filename, filesize, downloadFlag,
+        content_encoding, integrity, line_encoding, transfer_mode);
+
+    size_t record_length = enc.length;
+    protocol_encoder_init(&enc, output_buffer_reserve(out, record_length), record_length);
+    protocol_encode_start_file_transfer(&enc, cookie, mimetype, charset, filename, filesize, downloadFlag,
+        content_encoding, integrity, line_encoding, transfer_mode);
+    output_buffer_commit(out, record_length);
+}
+
+void extraterm_end_file_transfer(OutputBuffer *out) {
+    ProtocolEncoder enc;
+    protocol_encoder_init(&enc, output_buffer_reserve(out, 1), 1);
+    protocol_encode_end_file_transfer(&enc);
+    output_buffer_commit(out, enc.length);
 }
 
-void extraterm_client_request_frame(const char *frame_name) {
-    fputs(EXTRATERM_INTRO, stderr);
-    fputs(get_extratern_cookie(), stderr);
-    fputs(";4\x07", stderr);
-    fputs(frame_name, stderr);
-    fputc(0, stderr);
+/**
+ * @param accepted Content encodings, integrity modes and line encodings
+ *          which the terminal may use for the frame, comma separated, or NULL.
+ */
+bool extraterm_client_request_frame(const char *frame_name, const char *accepted) {
+    char buffer[4096];
+    ProtocolEncoder enc;
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    if (!protocol_encode_request_frame(&enc, get_extratern_cookie(), frame_name, accepted)) {
+        fputs("[Error] Frame name is too long.\n", stderr);
+        return false;
+    }
+
     fflush(stderr);
-}
\ No newline at end of file
+    return write_fully(STDERR_FILENO, buffer, enc.length);
+}
@@ -3,9 +3,11 @@
  *
  * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #include "arena.h"
 
@@ -13,11 +15,22 @@
 #include "libs/adopt.c"
 #include "libs/parson.c"
 #include "libs/base64.c"
+#include "libs/base85.c"
 #include "libs/sha256.c"
 
 #include "tty_utils.c"
 #include "utils.c"
+#include "output_buffer.c"
+#include "protocol_encoder.c"
 #include "extraterm_client.c"
+#include "line_encoding.c"
+#include "chained_hash.c"
+#include "tree_hash.c"
+#include "lz_block.c"
+#include "line_reader.c"
+#include "ring_buffer.c"
+#include "download_file.c"
+#include "json_scan.c"
 
 #ifndef APP_VERSION
 #define APP_VERSION git
@@ -26,12 +39,88 @@
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
 #define QUOTED_APP_VERSION EXPAND_AND_QUOTE(APP_VERSION)
 
-bool read_stdin_line(char *buffer, size_t buffer_size) {
-    bool ok = fgets(buffer, buffer_size, stdin) != NULL;
-    string_strip(buffer);
-    return ok;
+#define COMMAND_PREFIX_LENGTH 3
+#define LINE_HASH_LENGTH 20
+
+/**
+ * Growable buffer receiving the decoded payload of one protocol line.
+ */
+typedef struct {
+    unsigned char *data;
+    size_t capacity;
+    unsigned int length;
+} DecodedLine;
+
+/**
+ * Split a protocol line of the form `#X:<base64>:<hash>` and decode its payload.
+ *
+ * @param line The whole line, starting with the command prefix.
+ * @param is_base85 The payload is in base85 rather than base64.
+ * @param decoded Receives the NUL terminated payload.
+ * @param line_hash Receives a pointer to the LINE_HASH_LENGTH hash chars at the end of the line.
+ *
+ * @return false if the line is too short or the payload isn't valid in its line encoding.
+ */
+bool decode_line_data(Slice line, bool is_base85, DecodedLine *decoded, const char **line_hash) {
+    if (line.length < COMMAND_PREFIX_LENGTH + 1 + LINE_HASH_LENGTH) {
+        fputs("[Error] When reading frame data a line was too short.\n", stderr);
+        fflush(stderr);
+        return false;
+    }
+
+    const char *text = line.data + COMMAND_PREFIX_LENGTH;
+    size_t text_length = line.length - COMMAND_PREFIX_LENGTH - LINE_HASH_LENGTH - 1;
+    *line_hash = line.data + line.length - LINE_HASH_LENGTH;
+
+    size_t required = line_decoded_size(is_base85, text_length) + 1;
+    if (decoded->capacity < required) {
+        unsigned char *data = realloc(decoded->data, required);
+        if (data == NULL) {
+            fputs("[Error] Out of memory while decoding frame data.\n", stderr);
+            fflush(stderr);
+            return false;
+        }
+        decoded->data = data;
+        decoded->capacity = required;
+    }
+
+    long bad_offset = line_decode_validate(is_base85, (const unsigned char *) text, text_length, decoded->data,
+        &decoded->length);
+    decoded->data[decoded->length] = '\0';
+    if (bad_offset != -1) {
+        fprintf(stderr, "[Error] Invalid %s data in line at column %ld.\n", line_encoding_name(is_base85),
+            bad_offset + COMMAND_PREFIX_LENGTH);
+        fflush(stderr);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Compare the hash at the end of a line with the hash it should have.
+ *
+ * @param hash_hex Receives the start of `hash` in hex, as it appears in lines.
+ */
+bool line_hash_matches(const char *line_hash, const unsigned char *hash, char *hash_hex) {
+    bytes_to_hex(hash, LINE_HASH_LENGTH / 2, hash_hex);
+    hash_hex[LINE_HASH_LENGTH] = '\0';
+    return strncasecmp(line_hash, hash_hex, LINE_HASH_LENGTH) == 0;
 }
 
+#include "from_pipeline.c"
+
+/**
+ * The parts of a frame's metadata which we use.
+ */
+typedef struct {
+    char *filename;
+    char *mimetype;
+    char *content_encoding;
+    char *integrity;
+    char *line_encoding;
+    double filesize;
+} FrameMetadata;
+
 Arena *request_frame_arena = NULL;
 
 void *request_frame_alloc(size_t size) {
@@ -41,190 +130,216 @@ void *request_frame_alloc(size_t size) {
 void request_frame_free(void *) {
 }
 
-bool request_frame(Arena *arena, const char *frame_name, FILE *fhandle, JSON_Value **metadata) {
-    const size_t HASH_LENGTH = 20;
+/**
+ * Parse the metadata completely with parson. Used when the scanner can't cope.
+ */
+static void parse_frame_metadata(Arena *arena, const char *json, FrameMetadata *metadata) {
     request_frame_arena = arena;
+    json_set_allocation_functions(request_frame_alloc, request_frame_free);
+    JSON_Object *metadata_object = json_value_get_object(json_parse_string(json));
+
+    const char *filename = json_object_get_string(metadata_object, "filename");
+    metadata->filename = filename != NULL ? arena_strdup(arena, filename) : NULL;
+    const char *mimetype = json_object_get_string(metadata_object, "mimeType");
+    metadata->mimetype = mimetype != NULL ? arena_strdup(arena, mimetype) : NULL;
+    const char *content_encoding = json_object_get_string(metadata_object, "contentEncoding");
+    metadata->content_encoding = content_encoding != NULL ? arena_strdup(arena, content_encoding) : NULL;
+    const char *integrity = json_object_get_string(metadata_object, "integrity");
+    metadata->integrity = integrity != NULL ? arena_strdup(arena, integrity) : NULL;
+    const char *line_encoding = json_object_get_string(metadata_object, "lineEncoding");
+    metadata->line_encoding = line_encoding != NULL ? arena_strdup(arena, line_encoding) : NULL;
+    metadata->filesize = json_object_get_number(metadata_object, "filesize");
+}
 
-    turn_off_echo();
-
-    extraterm_client_request_frame(frame_name);
+/**
+ * Pull the fields we need out of the metadata JSON.
+ *
+ * The metadata can be large, holding things like thumbnails, so the fields
+ * are scanned for instead of parsing the whole lot.
+ *
+ * @param json NUL terminated metadata.
+ */
+void read_frame_metadata(Arena *arena, const char *json, size_t length, FrameMetadata *metadata) {
+    metadata->filename = NULL;
+    metadata->mimetype = NULL;
+    metadata->content_encoding = NULL;
+    metadata->integrity = NULL;
+    metadata->line_encoding = NULL;
+    metadata->filesize = 0;
+
+    Arena_Mark mark = arena_snapshot(arena);
+    Slice filesize;
+    JsonScanResult filesize_result = json_scan_field(json, length, "filesize", &filesize);
+    if (json_scan_string_field(arena, json, length, "filename", &metadata->filename) == JSON_SCAN_UNSUPPORTED ||
+            json_scan_string_field(arena, json, length, "mimeType", &metadata->mimetype) == JSON_SCAN_UNSUPPORTED ||
+            json_scan_string_field(arena, json, length, "contentEncoding", &metadata->content_encoding) == JSON_SCAN_UNSUPPORTED ||
+            json_scan_string_field(arena, json, length, "integrity", &metadata->integrity) == JSON_SCAN_UNSUPPORTED ||
+            json_scan_string_field(arena, json, length, "lineEncoding", &metadata->line_encoding) == JSON_SCAN_UNSUPPORTED ||
+            filesize_result == JSON_SCAN_UNSUPPORTED) {
+
+        arena_rewind(arena, mark);
+        parse_frame_metadata(arena, json, metadata);
+        return;
+    }
 
-    const int LINE_LENGTH = 1024;
-    const int COMMAND_PREFIX_LENGTH = 3;
+    if (filesize_result == JSON_SCAN_FOUND) {
+        /* The JSON is NUL terminated and strtod() stops at the end of the number. */
+        char *number_end;
+        double value = strtod(filesize.data, &number_end);
+        if (number_end == filesize.data + filesize.length) {
+            metadata->filesize = value;
+        }
+    }
+}
 
-    char line[LINE_LENGTH];
-    char contents[LINE_LENGTH];
+/**
+ * Fetch a frame's contents from the terminal.
+ *
+ * @param output_fd Receives the frame data.
+ * @param preallocate Reserve space in `output_fd` for the size given in the metadata.
+ * @param metadata Receives the frame's metadata.
+ */
+bool request_frame(Arena *arena, const char *frame_name, int output_fd, bool preallocate, FrameMetadata *metadata) {
+    bool success = false;
 
-    read_stdin_line(line, LINE_LENGTH);
+    turn_on_raw_mode();
 
-    if (!string_starts_with(line, "#M:")) {
-        fputs("[Error] When reading in frame data, expected '#M:...', but didn't receive it.\n", stderr);
-        fflush(stderr);
+    LineReader reader;
+    if (!line_reader_init(&reader, STDIN_FILENO, LINE_READER_DEFAULT_CAPACITY)) {
+        fputs("[Error] Unable to allocate the input buffer.\n", stderr);
         return false;
     }
-
-    if (strlen(line) < COMMAND_PREFIX_LENGTH + 1 + HASH_LENGTH) {
-        fputs("[Error] When reading in metadata line was too short.\n", stderr);
-        fflush(stderr);
-        return false;
+    DecodedLine contents = { NULL, 0, 0 };
+
+    /* The terminal may pack the data, hash it as a tree and spell it in base85 if it knows that we can cope. */
+    bool accepts_packing = extraterm_accepts_content_encoding(CONTENT_ENCODING_LZ4_BLOCK);
+    bool accepts_tree = extraterm_accepts_integrity(INTEGRITY_TREE_SHA256);
+    bool accepts_base85 = extraterm_accepts_line_encoding(LINE_ENCODING_BASE85);
+    char accepted[64] = "";
+    if (accepts_packing) {
+        list_append(accepted, sizeof(accepted), CONTENT_ENCODING_LZ4_BLOCK);
+    }
+    if (accepts_tree) {
+        list_append(accepted, sizeof(accepted), INTEGRITY_TREE_SHA256);
+    }
+    if (accepts_base85) {
+        list_append(accepted, sizeof(accepted), LINE_ENCODING_BASE85);
+    }
+    if (!extraterm_client_request_frame(frame_name, accepted[0] != '\0' ? accepted : NULL)) {
+        goto clean_up;
     }
 
-    char line_hash[HASH_LENGTH + 1];
-    line_hash[HASH_LENGTH] = '\0';
-    strncpy(line_hash, line + (strlen(line) - HASH_LENGTH), HASH_LENGTH);
-
-    size_t b64data_length = strlen(line) - COMMAND_PREFIX_LENGTH - HASH_LENGTH -1;
-    size_t contents_length = b64_decode(line + COMMAND_PREFIX_LENGTH, b64data_length, contents);
+    Slice line;
+    const char *line_hash;
+    char hash_hex[LINE_HASH_LENGTH + 1];
 
-    sha256_context hash;
-    sha256_init(&hash);
-    sha256_hash(&hash, contents, contents_length);
+    if (!line_reader_next(&reader, &line) || !slice_starts_with(line, "#M:")) {
+        fputs("[Error] When reading in frame data, expected '#M:...', but didn't receive it.\n", stderr);
+        fflush(stderr);
+        goto clean_up;
+    }
 
-    unsigned char previous_hash[SHA256_SIZE_BYTES];
-    sha256_done(&hash, previous_hash);
+    /* The metadata line is always base64. */
+    if (!decode_line_data(line, false, &contents, &line_hash)) {
+        goto clean_up;
+    }
 
-    char hash_hex[SHA256_SIZE_BYTES * 2 + 1];
-    sha256_hash_to_hex(previous_hash, hash_hex);
-    hash_hex[HASH_LENGTH] = '\0';
+    ChainedHash chain;
+    chained_hash_init(&chain);
+    chained_hash_update(&chain, contents.data, contents.length);
 
     // Check the hash
-    convert_to_lowercase(line_hash);
-    if (strcmp(line_hash, hash_hex) != 0) {
-        fputs("[Error] Hash didn't match for metadata line. Expected '", stderr);
-        fputs(line_hash, stderr);
-        fputs("' got '", stderr);
-        fputs(hash_hex, stderr);
-        fputs("'\n", stderr);
+    if (!line_hash_matches(line_hash, chain.previous_hash, hash_hex)) {
+        fprintf(stderr, "[Error] Hash didn't match for metadata line. Expected '%.*s' got '%s'\n",
+            LINE_HASH_LENGTH, line_hash, hash_hex);
         fflush(stderr);
-        return false;
+        goto clean_up;
     }
 
-    json_set_allocation_functions(request_frame_alloc, request_frame_free);
-    *metadata = json_parse_string(contents);
+    read_frame_metadata(arena, (const char *) contents.data, contents.length, metadata);
 
-    while (true) {
-        read_stdin_line(line, LINE_LENGTH);
-        if (strlen(line) < COMMAND_PREFIX_LENGTH + 1 + HASH_LENGTH) {
-            fputs("[Error] When reading frame body data a line is too short.", stderr);
-            fflush(stderr);
-            return false;
-        }
-
-        if (string_starts_with(line, "#D:") || string_starts_with(line, "#E:") || string_starts_with(line, "#A:")) {
-            size_t b64data_length = strlen(line) - COMMAND_PREFIX_LENGTH - HASH_LENGTH -1;
-            size_t contents_length = b64_decode(line + COMMAND_PREFIX_LENGTH, b64data_length, contents);
-
-            strncpy(line_hash, line + (strlen(line) - HASH_LENGTH), HASH_LENGTH);
-            convert_to_lowercase(line_hash);
-
-            sha256_init(&hash);
-            sha256_hash(&hash, previous_hash, SHA256_SIZE_BYTES);
-            sha256_hash(&hash, contents, contents_length);
-            sha256_done(&hash, previous_hash);
-
-            // Check the hash
-            sha256_hash_to_hex(previous_hash, hash_hex);
-            hash_hex[HASH_LENGTH] = '\0';
-            if (strcmp(line_hash, hash_hex) != 0) {
-                fputs("[Error] Upload failed. (Hash didn't match for data line. Expected ", stderr);
-                fputs(hash_hex, stderr);
-                fputs(" got ", stderr);
-                fputs(line_hash, stderr);
-                fputs(")\n", stderr);
-                fflush(stderr);
-                return false;
-            }
-
-            if (string_starts_with(line, "#E:")) {
-                // EOF
-                break;
-            }
-
-            if (string_starts_with(line, "#A:")) {
-                fputs("Upload aborted\n", stderr);
-                fflush(stderr);
-                return false;
-            }
-
-            // Send the input to stdout.
-            fwrite(contents, sizeof(char), contents_length, fhandle);
-
-        } else {
-            fputs("[Error] When reading frame body data, line didn't start with '#D:' or '#E:'.", stderr);
-            fflush(stderr);
-        }
+    bool is_packed = metadata->content_encoding != NULL;
+    if (is_packed && (!accepts_packing || strcmp(metadata->content_encoding, CONTENT_ENCODING_LZ4_BLOCK) != 0)) {
+        fprintf(stderr, "[Error] The frame data has an unsupported content encoding '%s'.\n",
+            metadata->content_encoding);
+        fflush(stderr);
+        goto clean_up;
     }
-    return true;
-}
-
-char *write_frame_to_disk(Arena *arena, const char *frame_name) {
-    JSON_Value *metadata = NULL;
-    char *tmp_filename = NULL;
-    char *final_filename = NULL;
-    FILE *tmp_fhandle = NULL;
-    char *filename = NULL;
-    int tmp_fd = -1;
-
-    tmp_filename = arena_strdup(arena, "extraterm_from_XXXXXX");
-    tmp_fd = mkstemp(tmp_filename);
-    if (tmp_fd == -1) {
-        fputs("[Error] Unable to open temp file.\n", stderr);
+    bool is_tree = metadata->integrity != NULL;
+    if (is_tree && (!accepts_tree || strcmp(metadata->integrity, INTEGRITY_TREE_SHA256) != 0)) {
+        fprintf(stderr, "[Error] The frame data has an unsupported integrity mode '%s'.\n", metadata->integrity);
+        fflush(stderr);
         goto clean_up;
     }
-
-    tmp_fhandle = fdopen(tmp_fd, "wb");
-    if (!tmp_fhandle) {
-        perror("[Error] Unable to open temp file.");
+    bool is_base85 = metadata->line_encoding != NULL;
+    if (is_base85 && (!accepts_base85 || strcmp(metadata->line_encoding, LINE_ENCODING_BASE85) != 0)) {
+        fprintf(stderr, "[Error] The frame data has an unsupported line encoding '%s'.\n", metadata->line_encoding);
+        fflush(stderr);
         goto clean_up;
     }
 
+    off_t filesize;
+    if (preallocate && file_size_from_double(metadata->filesize, &filesize)) {
+        preallocate_file_space(output_fd, filesize);
+    }
 
-    if (!request_frame(arena, frame_name, tmp_fhandle, &metadata)) {
+    if (!receive_data_lines(&reader, &chain, output_fd, is_packed, is_tree, is_base85)) {
         goto clean_up;
     }
+    success = true;
 
-    if (json_type(metadata) != JSONObject) {
+clean_up:
+    free(contents.data);
+    line_reader_free(&reader);
+    return success;
+}
 
+static bool publish_download_file(const char *filename, void *context) {
+    return download_file_publish(context, filename);
+}
+
+char *write_frame_to_disk(Arena *arena, const char *frame_name) {
+    FrameMetadata metadata;
+    DownloadFile file;
+    char *filename = NULL;
+    char *result = NULL;
+
+    if (!download_file_create(&file)) {
+        perror("[Error] Unable to open temp file");
+        return NULL;
     }
 
-    JSON_Object *metadata_object = json_value_get_object(metadata);
-    const char *json_filename = json_object_get_string(metadata_object, "filename");
-    if (json_filename != NULL) {
-        filename = arena_strdup(arena, json_filename);
+    if (!request_frame(arena, frame_name, file.fd, true, &metadata)) {
+        goto clean_up;
     }
+
+    filename = metadata.filename;
     if (filename == NULL) {
-        const char *mimetype = json_object_get_string(metadata_object, "mimeType");
-        if (mimetype != NULL) {
-            filename = arena_strdup(arena, mimetype);
+        if (metadata.mimetype != NULL) {
+            filename = metadata.mimetype;
             replace_char(filename, '/', '-');
         } else {
+            fputs("[Error] Frame metadata has neither a filename nor a mime type.\n", stderr);
             goto clean_up;
         }
     }
 
-    if (access(filename, F_OK) == 0) {
-        rename(tmp_filename, filename);
-    } else {
-        filename = find_suitable_filename(filename);
-        if (filename != NULL) {
-            rename(tmp_filename, filename);
-        }
+    char *published_filename = claim_suitable_filename(filename, publish_download_file, &file);
+    if (published_filename == NULL) {
+        fprintf(stderr, "[Error] Unable to write '%s'. %s\n", filename, strerror(errno));
+        goto clean_up;
     }
+    result = arena_strdup(arena, published_filename);
+    free(published_filename);
 
 clean_up:
-    if (tmp_fhandle) {
-        fclose(tmp_fhandle);
-    }
-    if (tmp_fd != -1) {
-        close(tmp_fd);
-    }
-    unlink(tmp_filename);
-    return filename;
+    download_file_close(&file);
+    return result;
 }
 
 bool output_frame(Arena *arena, const char *frame_name) {
-    JSON_Value *metadata = NULL;
-    return request_frame(arena, frame_name, stdout, &metadata);
+    FrameMetadata metadata;
+    return request_frame(arena, frame_name, STDOUT_FILENO, false, &metadata);
 }
 
 void show_version() {
@@ -276,28 +391,29 @@ int main(int argc, char *argv[]) {
 
     if (frames_array != NULL) {
         // Normal execution. Output the frames
-        for (int i=0; i<result.args_len; i++) {
-            int rc;
+        /* One arena serves all of the frames. Each frame's allocations are
+           dropped by rewinding, which keeps the memory for the next frame. */
+        Arena arena = {0};
+        Arena_Mark frame_start = arena_snapshot(&arena);
+        int rc = EXIT_SUCCESS;
+        for (int i=0; i<result.args_len && rc == EXIT_SUCCESS; i++) {
             const char *frame_name = frames_array[i];
             if (save_flag) {
-                Arena arena = {0};
                 char *filename = write_frame_to_disk(&arena, frame_name);
                 if (filename != NULL) {
                     printf("Wrote %s\n", filename);
                 } else {
                     rc = EXIT_FAILURE;
                 }
-                arena_free(&arena);
-
             } else {
-                Arena arena = {0};
                 rc = output_frame(&arena, frame_name) ? EXIT_SUCCESS : EXIT_FAILURE;
-                arena_free(&arena);
             }
+            arena_rewind(&arena, frame_start);
+        }
+        arena_free(&arena);
 
-            if (rc != 0) {
-                return rc;
-            }
+        if (rc != EXIT_SUCCESS) {
+            return rc;
         }
     }
     return EXIT_SUCCESS;
@@ -0,0 +1,439 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Receive pipeline for the data lines of a frame.
+ *
+ *   reader --(read_slots)--> verifier --(verified_slots)--> writer
+ *      ^                                                       |
+ *      +---------------------(free_slots)----------------------+
+ *
+ * The reader pulls lines off the tty and decodes them, the verifier runs
+ * the chained SHA-256 check and the writer streams the verified bytes to
+ * the output with writev(2). Data only reaches the writer after its hash
+ * has been checked. A slow disk or pipe no longer stalls reading from the
+ * tty until the bounded buffers fill up, and decoding overlaps with hashing.
+ *
+ * Packed data lines are unpacked by the verifier, once their hash has been
+ * checked.
+ *
+ * When the frame is hashed as a tree, each data line's hash covers only its
+ * own payload. The reader then also hands the data lines to a pool of
+ * checker threads, one per core, through `check_slots`, which hash and
+ * unpack them in parallel. The verifier still takes the lines in order, and
+ * only has to add each leaf to the tree and compare the root in the end line.
+ */
+
+#define RECEIVE_SLOT_COUNT 16
+#define RECEIVE_MAX_CHECKERS 8
+
+typedef enum {
+    RECEIVE_DATA,
+    RECEIVE_END,
+    RECEIVE_ABORT,
+} ReceiveLineType;
+
+typedef struct {
+    ReceiveLineType type;
+    DecodedLine contents;
+    DecodedLine unpacked;
+    char line_hash[LINE_HASH_LENGTH];
+    unsigned char leaf[SHA256_SIZE_BYTES];
+    bool is_checked;            /* Guarded by `check_mutex`. */
+    bool is_intact;             /* The leaf matched and the payload unpacked, once checked. */
+} ReceiveSlot;
+
+typedef struct {
+    LineReader *reader;
+    ChainedHash *chain;
+    int output_fd;
+    bool is_packed;             /* Data lines are packed with lz_block_pack(). */
+    bool is_tree;               /* Data lines are hashed as a tree, INTEGRITY_TREE_SHA256. */
+    bool is_base85;             /* Data lines are in the base85 line encoding. */
+    TreeHash tree;
+
+    RingBuffer free_slots;
+    RingBuffer read_slots;
+    RingBuffer check_slots;
+    RingBuffer verified_slots;
+
+    pthread_mutex_t check_mutex;
+    pthread_cond_t checked;
+    bool aborted;               /* Guarded by `check_mutex`. */
+
+    bool read_failed;
+    bool verify_failed;
+    bool write_failed;
+    bool end_received;
+} ReceivePipeline;
+
+static void receive_pipeline_abort(ReceivePipeline *pipeline) {
+    ring_buffer_close(&pipeline->free_slots);
+    ring_buffer_close(&pipeline->read_slots);
+    ring_buffer_close(&pipeline->check_slots);
+    ring_buffer_close(&pipeline->verified_slots);
+
+    pthread_mutex_lock(&pipeline->check_mutex);
+    pipeline->aborted = true;
+    pthread_cond_broadcast(&pipeline->checked);
+    pthread_mutex_unlock(&pipeline->check_mutex);
+}
+
+static void *receive_pipeline_reader(void *arg) {
+    ReceivePipeline *pipeline = arg;
+    ReceiveSlot *slot;
+    Slice line;
+    const char *line_hash;
+
+    /* Only the blocking read may be cancelled, see receive_data_lines(). */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (ring_buffer_pop(&pipeline->free_slots, (void **) &slot)) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        bool have_line = line_reader_next(pipeline->reader, &line);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (!have_line) {
+            fputs("[Error] Input ended before the end of the frame data.\n", stderr);
+            fflush(stderr);
+            pipeline->read_failed = true;
+            break;
+        }
+
+        if (slice_starts_with(line, "#D:")) {
+            slot->type = RECEIVE_DATA;
+        } else if (slice_starts_with(line, "#E:")) {
+            slot->type = RECEIVE_END;
+        } else if (slice_starts_with(line, "#A:")) {
+            slot->type = RECEIVE_ABORT;
+        } else {
+            fputs("[Error] When reading frame body data, line didn't start with '#D:' or '#E:'.\n", stderr);
+            fflush(stderr);
+            ring_buffer_push(&pipeline->free_slots, slot);
+            continue;
+        }
+
+        if (!decode_line_data(line, pipeline->is_base85, &slot->contents, &line_hash)) {
+            pipeline->read_failed = true;
+            break;
+        }
+        memcpy(slot->line_hash, line_hash, LINE_HASH_LENGTH);
+
+        if (pipeline->is_tree && slot->type == RECEIVE_DATA) {
+            slot->is_checked = false;
+            if (!ring_buffer_push(&pipeline->check_slots, slot)) {
+                break;
+            }
+        }
+        if (!ring_buffer_push(&pipeline->read_slots, slot)) {
+            break;
+        }
+        /* Anything after the end of the frame isn't ours to read. */
+        if (slot->type != RECEIVE_DATA) {
+            break;
+        }
+    }
+
+    ring_buffer_close(&pipeline->check_slots);
+    ring_buffer_close(&pipeline->read_slots);
+    return NULL;
+}
+
+/**
+ * Unpack a data line's payload into the slot's `unpacked` buffer.
+ */
+static bool unpack_line_data(ReceiveSlot *slot) {
+    long long length = lz_block_unpacked_length(slot->contents.data, slot->contents.length);
+    if (length < 0) {
+        fputs("[Error] A packed data line is corrupt.\n", stderr);
+        fflush(stderr);
+        return false;
+    }
+
+    DecodedLine *unpacked = &slot->unpacked;
+    if (unpacked->capacity < (size_t) length + 1) {
+        unsigned char *data = realloc(unpacked->data, length + 1);
+        if (data == NULL) {
+            fputs("[Error] Out of memory while unpacking frame data.\n", stderr);
+            fflush(stderr);
+            return false;
+        }
+        unpacked->data = data;
+        unpacked->capacity = length + 1;
+    }
+
+    if (!lz_block_unpack(slot->contents.data, slot->contents.length, unpacked->data)) {
+        fputs("[Error] A packed data line is corrupt.\n", stderr);
+        fflush(stderr);
+        return false;
+    }
+    unpacked->length = length;
+    return true;
+}
+
+static void *receive_pipeline_checker(void *arg) {
+    ReceivePipeline *pipeline = arg;
+    ReceiveSlot *slot;
+    char hash_hex[LINE_HASH_LENGTH + 1];
+
+    while (ring_buffer_pop(&pipeline->check_slots, (void **) &slot)) {
+        tree_hash_leaf(slot->contents.data, slot->contents.length, slot->leaf);
+        bool is_intact = line_hash_matches(slot->line_hash, slot->leaf, hash_hex) &&
+            (!pipeline->is_packed || unpack_line_data(slot));
+
+        pthread_mutex_lock(&pipeline->check_mutex);
+        slot->is_intact = is_intact;
+        slot->is_checked = true;
+        pthread_cond_broadcast(&pipeline->checked);
+        pthread_mutex_unlock(&pipeline->check_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Wait for a checker to finish with a slot.
+ *
+ * @return false if the pipeline was aborted first.
+ */
+static bool receive_pipeline_wait_checked(ReceivePipeline *pipeline, ReceiveSlot *slot) {
+    pthread_mutex_lock(&pipeline->check_mutex);
+    while (!slot->is_checked && !pipeline->aborted) {
+        pthread_cond_wait(&pipeline->checked, &pipeline->check_mutex);
+    }
+    bool is_checked = slot->is_checked;
+    pthread_mutex_unlock(&pipeline->check_mutex);
+    return is_checked;
+}
+
+/**
+ * Get the hash which a line should carry, and with a hash tree, wait for its data to be checked.
+ *
+ * @param hash Receives the hash.
+ * @return false if a data line's hash tree check failed.
+ */
+static bool receive_pipeline_line_hash(ReceivePipeline *pipeline, ReceiveSlot *slot, unsigned char *hash) {
+    if (!pipeline->is_tree) {
+        chained_hash_update(pipeline->chain, slot->contents.data, slot->contents.length);
+        memcpy(hash, pipeline->chain->previous_hash, SHA256_SIZE_BYTES);
+        return true;
+    }
+
+    if (slot->type != RECEIVE_DATA) {
+        /* Only the end line has something to check, the root. */
+        tree_hash_root(&pipeline->tree, hash);
+        return true;
+    }
+    if (!receive_pipeline_wait_checked(pipeline, slot)) {
+        return false;
+    }
+    memcpy(hash, slot->leaf, SHA256_SIZE_BYTES);
+    tree_hash_push(&pipeline->tree, slot->leaf);
+    return true;
+}
+
+static void *receive_pipeline_verifier(void *arg) {
+    ReceivePipeline *pipeline = arg;
+    ReceiveSlot *slot;
+    unsigned char hash[SHA256_SIZE_BYTES];
+    char hash_hex[LINE_HASH_LENGTH + 1];
+
+    while (ring_buffer_pop(&pipeline->read_slots, (void **) &slot)) {
+        if (!receive_pipeline_line_hash(pipeline, slot, hash)) {
+            pipeline->verify_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        // Check the hash. An abort line has no data worth checking in a tree.
+        bool is_unchecked_abort = pipeline->is_tree && slot->type == RECEIVE_ABORT;
+        if (!is_unchecked_abort && !line_hash_matches(slot->line_hash, hash, hash_hex)) {
+            fprintf(stderr, "[Error] Upload failed. (Hash didn't match for data line. Expected %s got %.*s)\n",
+                hash_hex, LINE_HASH_LENGTH, slot->line_hash);
+            fflush(stderr);
+            pipeline->verify_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        if (pipeline->is_tree && slot->type == RECEIVE_DATA && !slot->is_intact) {
+            /* The checker already reported a payload that didn't unpack. */
+            pipeline->verify_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        if (slot->type == RECEIVE_ABORT) {
+            fputs("Upload aborted\n", stderr);
+            fflush(stderr);
+            pipeline->verify_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        if (slot->type == RECEIVE_END) {
+            // EOF
+            pipeline->end_received = true;
+            ring_buffer_push(&pipeline->free_slots, slot);
+            break;
+        }
+
+        if (pipeline->is_packed && !pipeline->is_tree && !unpack_line_data(slot)) {
+            pipeline->verify_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        if (!ring_buffer_push(&pipeline->verified_slots, slot)) {
+            break;
+        }
+    }
+
+    ring_buffer_close(&pipeline->verified_slots);
+    return NULL;
+}
+
+static void *receive_pipeline_writer(void *arg) {
+    ReceivePipeline *pipeline = arg;
+    ReceiveSlot *batch[RECEIVE_SLOT_COUNT];
+    struct iovec iov[RECEIVE_SLOT_COUNT];
+
+    /* Gather every verified line that is ready and write them in one go. */
+    while (ring_buffer_pop(&pipeline->verified_slots, (void **) &batch[0])) {
+        int batch_count = 1;
+        while (batch_count < RECEIVE_SLOT_COUNT &&
+                ring_buffer_try_pop(&pipeline->verified_slots, (void **) &batch[batch_count])) {
+            batch_count++;
+        }
+
+        for (int i=0; i<batch_count; i++) {
+            DecodedLine *data = pipeline->is_packed ? &batch[i]->unpacked : &batch[i]->contents;
+            iov[i].iov_base = data->data;
+            iov[i].iov_len = data->length;
+        }
+        if (!writev_fully(pipeline->output_fd, iov, batch_count)) {
+            perror("[Error] Unable to write the frame data");
+            pipeline->write_failed = true;
+            receive_pipeline_abort(pipeline);
+            break;
+        }
+
+        for (int i=0; i<batch_count; i++) {
+            ring_buffer_push(&pipeline->free_slots, batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Receive, verify and write out the data lines of a frame up to its end line.
+ *
+ * @param reader Line reader positioned just after the metadata line.
+ * @param chain Hash chain continuing from the metadata line.
+ * @param output_fd Where the data goes.
+ * @param is_packed The data lines are packed in the lz4-block content encoding.
+ * @param is_tree The data lines are hashed as a tree instead of continuing `chain`.
+ * @param is_base85 The data lines are in base85 instead of base64.
+ * @return true if the whole frame arrived intact and was written.
+ */
+bool receive_data_lines(LineReader *reader, ChainedHash *chain, int output_fd, bool is_packed, bool is_tree,
+        bool is_base85) {
+    ReceivePipeline pipeline = {
+        .reader = reader,
+        .chain = chain,
+        .output_fd = output_fd,
+        .is_packed = is_packed,
+        .is_tree = is_tree,
+        .is_base85 = is_base85,
+        .aborted = false,
+        .read_failed = false,
+        .verify_failed = false,
+        .write_failed = false,
+        .end_received = false,
+    };
+
+    ReceiveSlot slots[RECEIVE_SLOT_COUNT];
+    RingBuffer *buffers[] = { &pipeline.free_slots, &pipeline.read_slots, &pipeline.check_slots,
+        &pipeline.verified_slots };
+    const int buffer_count = sizeof(buffers) / sizeof(buffers[0]);
+    int ready_count = 0;
+    while (ready_count < buffer_count && ring_buffer_init(buffers[ready_count], RECEIVE_SLOT_COUNT)) {
+        ready_count++;
+    }
+    if (ready_count < buffer_count) {
+        fputs("[Error] Out of memory setting up the receive pipeline.\n", stderr);
+        while (ready_count > 0) {
+            ring_buffer_destroy(buffers[--ready_count]);
+        }
+        return false;
+    }
+    pthread_mutex_init(&pipeline.check_mutex, NULL);
+    pthread_cond_init(&pipeline.checked, NULL);
+    tree_hash_init(&pipeline.tree);
+    for (int i=0; i<RECEIVE_SLOT_COUNT; i++) {
+        slots[i].contents = (DecodedLine) { NULL, 0, 0 };
+        slots[i].unpacked = (DecodedLine) { NULL, 0, 0 };
+        ring_buffer_push(&pipeline.free_slots, &slots[i]);
+    }
+
+    int checker_count = 0;
+    if (is_tree) {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        checker_count = cpu_count < 1 ? 1 : cpu_count > RECEIVE_MAX_CHECKERS ? RECEIVE_MAX_CHECKERS : cpu_count;
+    }
+
+    /* The writer starts last, so nothing is written out unless every stage is running. */
+    pthread_t reader_thread, verifier_thread, writer_thread;
+    pthread_t checker_threads[RECEIVE_MAX_CHECKERS];
+    bool is_reader_started = pthread_create(&reader_thread, NULL, receive_pipeline_reader, &pipeline) == 0;
+    int started_checker_count = 0;
+    while (is_reader_started && started_checker_count < checker_count &&
+            pthread_create(&checker_threads[started_checker_count], NULL, receive_pipeline_checker, &pipeline) == 0) {
+        started_checker_count++;
+    }
+    bool is_verifier_started = is_reader_started && started_checker_count == checker_count &&
+        pthread_create(&verifier_thread, NULL, receive_pipeline_verifier, &pipeline) == 0;
+    bool is_writer_started = is_verifier_started &&
+        pthread_create(&writer_thread, NULL, receive_pipeline_writer, &pipeline) == 0;
+
+    if (is_writer_started) {
+        pthread_join(verifier_thread, NULL);
+        pthread_join(writer_thread, NULL);
+    } else {
+        fputs("[Error] Unable to start the receive pipeline threads.\n", stderr);
+    }
+
+    /* On a mismatch or a write error the reader may be sitting in read(2)
+       waiting for lines that will never come. */
+    receive_pipeline_abort(&pipeline);
+    if (is_verifier_started && !is_writer_started) {
+        pthread_join(verifier_thread, NULL);
+    }
+    if (is_reader_started) {
+        pthread_cancel(reader_thread);
+        pthread_join(reader_thread, NULL);
+    }
+    for (int i=0; i<started_checker_count; i++) {
+        pthread_join(checker_threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pipeline.checked);
+    pthread_mutex_destroy(&pipeline.check_mutex);
+    ring_buffer_destroy(&pipeline.verified_slots);
+    ring_buffer_destroy(&pipeline.check_slots);
+    ring_buffer_destroy(&pipeline.read_slots);
+    ring_buffer_destroy(&pipeline.free_slots);
+    for (int i=0; i<RECEIVE_SLOT_COUNT; i++) {
+        free(slots[i].contents.data);
+        free(slots[i].unpacked.data);
+    }
+
+    return is_writer_started && pipeline.end_received && !pipeline.read_failed && !pipeline.verify_failed && !pipeline.write_failed;
+}
@@ -0,0 +1,310 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Lazy lookup of top-level fields in a JSON object.
+ *
+ * Instead of building a value tree, the object is skimmed for the wanted
+ * key. Values of other keys are skipped over without being decoded, which
+ * for a long string is little more than a memchr(). Only the string which
+ * is asked for gets unescaped.
+ *
+ * The scanner is not a validator. Whenever it meets something it doesn't
+ * understand, it answers JSON_SCAN_UNSUPPORTED and the caller should fall
+ * back to a real parser.
+ */
+
+typedef enum {
+    JSON_SCAN_FOUND,
+    JSON_SCAN_MISSING,
+    JSON_SCAN_UNSUPPORTED,
+} JsonScanResult;
+
+static const char *json_skip_whitespace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Skip a string starting at its opening quote.
+ *
+ * @return the position after the closing quote, or NULL.
+ */
+static const char *json_skip_string(const char *p, const char *end) {
+    p++;
+    while (p < end) {
+        const char *quote = memchr(p, '"', end - p);
+        if (quote == NULL) {
+            return NULL;
+        }
+        /* An odd number of backslashes in front means the quote is escaped. */
+        const char *q = quote;
+        while (q > p && q[-1] == '\\') {
+            q--;
+        }
+        p = quote + 1;
+        if (((quote - q) & 1) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Skip any value.
+ *
+ * @return the position after the value, or NULL.
+ */
+static const char *json_skip_value(const char *p, const char *end) {
+    if (p == end) {
+        return NULL;
+    }
+    if (*p == '"') {
+        return json_skip_string(p, end);
+    }
+
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            switch (*p) {
+                case '"':
+                    p = json_skip_string(p, end);
+                    if (p == NULL) {
+                        return NULL;
+                    }
+                    continue;
+                case '{':
+                case '[':
+                    depth++;
+                    break;
+                case '}':
+                case ']':
+                    depth--;
+                    if (depth == 0) {
+                        return p + 1;
+                    }
+                    break;
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+    /* Numbers, true, false and null. */
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+        p++;
+    }
+    return p == start ? NULL : p;
+}
+
+/**
+ * Find the raw text of a top-level field in a JSON object.
+ *
+ * @param value Receives the value exactly as it appears in the JSON. A
+ *          string value includes its quotes.
+ */
+JsonScanResult json_scan_field(const char *json, size_t length, const char *key, Slice *value) {
+    const char *end = json + length;
+    size_t key_length = strlen(key);
+
+    const char *p = json_skip_whitespace(json, end);
+    if (p == end || *p != '{') {
+        return JSON_SCAN_UNSUPPORTED;
+    }
+    p = json_skip_whitespace(p + 1, end);
+    if (p < end && *p == '}') {
+        return JSON_SCAN_MISSING;
+    }
+
+    while (p < end) {
+        if (*p != '"') {
+            return JSON_SCAN_UNSUPPORTED;
+        }
+        const char *key_start = p + 1;
+        p = json_skip_string(p, end);
+        if (p == NULL) {
+            return JSON_SCAN_UNSUPPORTED;
+        }
+        size_t raw_key_length = p - 1 - key_start;
+        if (memchr(key_start, '\\', raw_key_length) != NULL) {
+            /* Keys with escapes are too rare to be worth comparing here. */
+            return JSON_SCAN_UNSUPPORTED;
+        }
+
+        p = json_skip_whitespace(p, end);
+        if (p == end || *p != ':') {
+            return JSON_SCAN_UNSUPPORTED;
+        }
+        p = json_skip_whitespace(p + 1, end);
+        const char *value_start = p;
+        p = json_skip_value(p, end);
+        if (p == NULL) {
+            return JSON_SCAN_UNSUPPORTED;
+        }
+
+        if (raw_key_length == key_length && memcmp(key_start, key, key_length) == 0) {
+            value->data = value_start;
+            value->length = p - value_start;
+            return JSON_SCAN_FOUND;
+        }
+
+        p = json_skip_whitespace(p, end);
+        if (p == end) {
+            break;
+        }
+        if (*p == '}') {
+            return JSON_SCAN_MISSING;
+        }
+        if (*p != ',') {
+            break;
+        }
+        p = json_skip_whitespace(p + 1, end);
+    }
+    return JSON_SCAN_UNSUPPORTED;
+}
+
+static int json_hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool json_read_hex4(const char *p, const char *end, uint32_t *value) {
+    if (end - p < 4) {
+        return false;
+    }
+    *value = 0;
+    for (int i=0; i<4; i++) {
+        int digit = json_hex_value(p[i]);
+        if (digit < 0) {
+            return false;
+        }
+        *value = (*value << 4) | digit;
+    }
+    return true;
+}
+
+static char *json_put_utf8(char *out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        *out++ = code_point;
+    } else if (code_point < 0x800) {
+        *out++ = 0xc0 | (code_point >> 6);
+        *out++ = 0x80 | (code_point & 0x3f);
+    } else if (code_point < 0x10000) {
+        *out++ = 0xe0 | (code_point >> 12);
+        *out++ = 0x80 | ((code_point >> 6) & 0x3f);
+        *out++ = 0x80 | (code_point & 0x3f);
+    } else {
+        *out++ = 0xf0 | (code_point >> 18);
+        *out++ = 0x80 | ((code_point >> 12) & 0x3f);
+        *out++ = 0x80 | ((code_point >> 6) & 0x3f);
+        *out++ = 0x80 | (code_point & 0x3f);
+    }
+    return out;
+}
+
+/**
+ * Unescape a quoted JSON string into a new NUL terminated string in the arena.
+ *
+ * @return false if the string is malformed or holds a NUL char.
+ */
+static bool json_unescape_string(Arena *arena, Slice quoted, char **value) {
+    const char *p = quoted.data + 1;
+    const char *end = quoted.data + quoted.length - 1;
+    /* Unescaping never makes a string longer. */
+    char *result = arena_alloc(arena, end - p + 1);
+    char *out = result;
+
+    while (p < end) {
+        const char *backslash = memchr(p, '\\', end - p);
+        const char *run_end = backslash != NULL ? backslash : end;
+        memcpy(out, p, run_end - p);
+        out += run_end - p;
+        p = run_end;
+        if (p == end) {
+            break;
+        }
+
+        p++;
+        if (p == end) {
+            return false;
+        }
+        char c = *p++;
+        switch (c) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                uint32_t code_point;
+                if (!json_read_hex4(p, end, &code_point)) {
+                    return false;
+                }
+                p += 4;
+                if (code_point >= 0xd800 && code_point < 0xdc00) {
+                    uint32_t low;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !json_read_hex4(p + 2, end, &low) ||
+                            low < 0xdc00 || low >= 0xe000) {
+                        return false;
+                    }
+                    p += 6;
+                    code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                } else if (code_point >= 0xdc00 && code_point < 0xe000) {
+                    return false;
+                }
+                if (code_point == 0) {
+                    return false;
+                }
+                out = json_put_utf8(out, code_point);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    *out = '\0';
+    *value = result;
+    return true;
+}
+
+/**
+ * Look up a top-level string field in a JSON object.
+ *
+ * @param value Receives the unescaped string, allocated in `arena`, or
+ *          NULL if the field is missing or isn't a string.
+ */
+JsonScanResult json_scan_string_field(Arena *arena, const char *json, size_t length, const char *key, char **value) {
+    *value = NULL;
+    Slice raw_value;
+    JsonScanResult result = json_scan_field(json, length, key, &raw_value);
+    if (result != JSON_SCAN_FOUND) {
+        return result;
+    }
+    if (raw_value.data[0] != '"') {
+        return JSON_SCAN_MISSING;
+    }
+    if (!json_unescape_string(arena, raw_value, value)) {
+        return JSON_SCAN_UNSUPPORTED;
+    }
+    return JSON_SCAN_FOUND;
+}
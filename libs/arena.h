@@ -57,13 +57,19 @@ typedef struct {
 Region *new_region(size_t capacity);
 void free_region(Region *r);
 
-// TODO: snapshot/rewind capability for the arena
-// - Snapshot should be combination of a->end and a->end->count.
-// - Rewinding should be restoring a->end and a->end->count from the snapshot and
-// setting count-s of all the Region-s after the remembered a->end to 0.
+// A position in the arena to rewind back to. Everything allocated after
+// the snapshot was taken is released by the rewind, but the regions stay
+// around for reuse.
+typedef struct {
+    Region *region;
+    size_t count;
+} Arena_Mark;
+
 void *arena_alloc(Arena *a, size_t size_bytes);
 void *arena_realloc(Arena *a, void *oldptr, size_t oldsz, size_t newsz);
 
+Arena_Mark arena_snapshot(Arena *a);
+void arena_rewind(Arena *a, Arena_Mark m);
 void arena_reset(Arena *a);
 void arena_free(Arena *a);
 
@@ -93,7 +99,45 @@ void free_region(Region *r)
     free(r);
 }
 #elif ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP
-#  error "TODO: Linux mmap backend is not implemented yet"
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Define ARENA_LINUX_MMAP_HUGE_PAGES to ask for transparent huge pages on
+// regions big enough to hold at least one.
+#ifndef ARENA_HUGE_PAGE_SIZE
+#define ARENA_HUGE_PAGE_SIZE (2*1024*1024)
+#endif
+
+static size_t region_mapping_size(size_t capacity)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size_bytes = sizeof(Region) + sizeof(uintptr_t)*capacity;
+    return (size_bytes + page_size - 1) / page_size * page_size;
+}
+
+Region *new_region(size_t capacity)
+{
+    size_t size_bytes = region_mapping_size(capacity);
+    Region *r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ARENA_ASSERT(r != MAP_FAILED);
+#if defined(ARENA_LINUX_MMAP_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    if (size_bytes >= ARENA_HUGE_PAGE_SIZE) {
+        madvise(r, size_bytes, MADV_HUGEPAGE);
+    }
+#endif
+    r->next = NULL;
+    r->count = 0;
+    // The rest of the last page is free, so use it.
+    r->capacity = (size_bytes - sizeof(Region)) / sizeof(uintptr_t);
+    return r;
+}
+
+void free_region(Region *r)
+{
+    int result = munmap(r, region_mapping_size(r->capacity));
+    ARENA_ASSERT(result == 0);
+    (void) result;
+}
 #elif ARENA_BACKEND == ARENA_BACKEND_WIN32_VIRTUALALLOC
 
 #if !defined(_WIN32)
@@ -193,6 +237,36 @@ void *arena_realloc(Arena *a, void *oldptr, size_t oldsz, size_t newsz)
     return newptr;
 }
 
+Arena_Mark arena_snapshot(Arena *a)
+{
+    Arena_Mark m;
+    if (a->end == NULL) {
+        // Snapshot of an arena which hasn't allocated anything yet
+        ARENA_ASSERT(a->begin == NULL);
+        m.region = NULL;
+        m.count = 0;
+    } else {
+        m.region = a->end;
+        m.count = a->end->count;
+    }
+    return m;
+}
+
+void arena_rewind(Arena *a, Arena_Mark m)
+{
+    if (m.region == NULL) {
+        // Back to the very beginning, but keep the regions
+        arena_reset(a);
+        return;
+    }
+
+    m.region->count = m.count;
+    for (Region *r = m.region->next; r != NULL; r = r->next) {
+        r->count = 0;
+    }
+    a->end = m.region;
+}
+
 void arena_reset(Arena *a)
 {
     for (Region *r = a->begin; r != NULL; r = r->next) {
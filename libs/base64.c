@@ -8,11 +8,34 @@
 	http://www.codeproject.com/Tips/813146/Fast-base-functions-for-encode-decode
 */
 
+#include <pthread.h>
+
 #include "base64.h"
+#include "cpu_features.h"
 
 //Base64 char table - used internally for encoding
 unsigned char b64_chr[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+//ASCII to base64 value table - used by the validating decoder, 0xff marks characters outside the alphabet
+static const unsigned char b64_dec_table[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
 unsigned int b64_int(unsigned int ch) {
 
 	// ASCII to base64_int
@@ -40,12 +63,7 @@ unsigned int b64_int(unsigned int ch) {
 unsigned int b64e_size(unsigned int in_size) {
 
 	// size equals 4*floor((1/3)*(in_size+2));
-	int i, j = 0;
-	for (i=0;i<in_size;i++) {
-		if (i % 3 == 0)
-		j += 1;
-	}
-	return (4*j);
+	return 4*((in_size+2)/3);
 }
 
 unsigned int b64d_size(unsigned int in_size) {
@@ -53,7 +71,7 @@ unsigned int b64d_size(unsigned int in_size) {
 	return ((3*in_size)/4);
 }
 
-unsigned int b64_encode(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+static unsigned int b64_encode_scalar(const unsigned char* in, unsigned int in_len, unsigned char* out) {
 
 	unsigned int i=0, j=0, k=0, s[3];
 	
@@ -86,6 +104,434 @@ unsigned int b64_encode(const unsigned char* in, unsigned int in_len, unsigned c
 	return k;
 }
 
+#if defined(CPU_FEATURES_X86)
+
+// SSE/AVX2 encoder after Wojciech Muła, "Base64 encoding with SIMD instructions".
+// 12 input bytes are spread over 16 lanes, split into 6 bit indices with a pair
+// of 16 bit multiplies and then mapped to ASCII with a small pshufb table.
+
+__attribute__((target("sse4.1")))
+static inline __m128i b64_enc_reshuffle_sse41(__m128i in) {
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i b64_enc_translate_sse41(__m128i indices) {
+	const __m128i shift_lut = _mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
+	__m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+	return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, result), indices);
+}
+
+__attribute__((target("sse4.1")))
+static unsigned int b64_encode_sse41(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+
+	unsigned int i=0, k=0;
+
+	// Each step loads 16 bytes but only consumes 12, so stop while 16 are still readable.
+	while (in_len - i >= 16) {
+		__m128i str = _mm_loadu_si128((const __m128i*)(in+i));
+		str = b64_enc_translate_sse41(b64_enc_reshuffle_sse41(str));
+		_mm_storeu_si128((__m128i*)(out+k), str);
+		i+=12; k+=16;
+	}
+
+	return k + b64_encode_scalar(in+i, in_len-i, out+k);
+}
+
+__attribute__((target("avx2")))
+static unsigned int b64_encode_avx2(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+
+	unsigned int i=0, k=0;
+	const __m256i shuffle = _mm256_setr_epi8(
+		1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10,
+		1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+	const __m256i shift_lut = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
+
+	// Two 12 byte groups per step, one in each 128 bit lane. The upper load reads up to in+i+28.
+	while (in_len - i >= 28) {
+		__m256i str = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in+i))),
+			_mm_loadu_si128((const __m128i*)(in+i+12)), 1);
+		str = _mm256_shuffle_epi8(str, shuffle);
+		const __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		const __m256i indices = _mm256_or_si256(t1, t3);
+
+		__m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		result = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, result), indices);
+
+		_mm256_storeu_si256((__m256i*)(out+k), result);
+		i+=24; k+=32;
+	}
+
+	return k + b64_encode_sse41(in+i, in_len-i, out+k);
+}
+
+#endif // CPU_FEATURES_X86
+
+#if defined(CPU_FEATURES_ARM64)
+
+static inline uint8x16x4_t b64_neon_table(const unsigned char* table) {
+	uint8x16x4_t lut;
+	lut.val[0] = vld1q_u8(table);
+	lut.val[1] = vld1q_u8(table+16);
+	lut.val[2] = vld1q_u8(table+32);
+	lut.val[3] = vld1q_u8(table+48);
+	return lut;
+}
+
+static unsigned int b64_encode_neon(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+
+	unsigned int i=0, k=0;
+	const uint8x16x4_t lut = b64_neon_table(b64_chr);
+	const uint8x16_t mask = vdupq_n_u8(0x3f);
+
+	// vld3 de-interleaves 16 groups of 3 bytes, vst4 interleaves the 4 output chars again.
+	while (in_len - i >= 48) {
+		const uint8x16x3_t src = vld3q_u8(in+i);
+		uint8x16x4_t str;
+		str.val[0] = vshrq_n_u8(src.val[0], 2);
+		str.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[0], 4), vshrq_n_u8(src.val[1], 4)), mask);
+		str.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[1], 2), vshrq_n_u8(src.val[2], 6)), mask);
+		str.val[3] = vandq_u8(src.val[2], mask);
+
+		str.val[0] = vqtbl4q_u8(lut, str.val[0]);
+		str.val[1] = vqtbl4q_u8(lut, str.val[1]);
+		str.val[2] = vqtbl4q_u8(lut, str.val[2]);
+		str.val[3] = vqtbl4q_u8(lut, str.val[3]);
+		vst4q_u8(out+k, str);
+		i+=48; k+=64;
+	}
+
+	return k + b64_encode_scalar(in+i, in_len-i, out+k);
+}
+
+#endif // CPU_FEATURES_ARM64
+
+// Decodes as many whole, valid quartets as it can from the front of the input.
+// Returns the number of bytes written and sets *consumed to the number of characters used.
+typedef unsigned int (*b64_decode_func)(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* consumed);
+
+#if defined(CPU_FEATURES_X86)
+
+// SSE/AVX2 decoder after Wojciech Muła and Alfred Klomp. The nibble lookup tables
+// flag any character outside the alphabet, so validation costs one extra test per block.
+
+__attribute__((target("sse4.1")))
+static unsigned int b64_decode_sse41(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* consumed) {
+
+	unsigned int i=0, k=0;
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2F = _mm_set1_epi8(0x2f);
+
+	// The store writes 16 bytes for every 12 decoded ones. Keeping 8 characters in reserve
+	// guarantees that the output buffer sized by b64d_size() has room for the overhang.
+	while (in_len - i >= 24) {
+		__m128i str = _mm_loadu_si128((const __m128i*)(in+i));
+
+		const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2F);
+		const __m128i lo_nibbles = _mm_and_si128(str, mask_2F);
+		const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm_testz_si128(lo, hi))
+			break;
+
+		const __m128i eq_2F = _mm_cmpeq_epi8(str, mask_2F);
+		const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2F, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+
+		_mm_storeu_si128((__m128i*)(out+k), str);
+		i+=16; k+=12;
+	}
+
+	*consumed = i;
+	return k;
+}
+
+__attribute__((target("avx2")))
+static unsigned int b64_decode_avx2(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* consumed) {
+
+	unsigned int i=0, k=0;
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2F = _mm256_set1_epi8(0x2f);
+
+	// 32 characters in, 24 bytes out but a 32 byte store, so keep 16 characters in reserve.
+	while (in_len - i >= 48) {
+		__m256i str = _mm256_loadu_si256((const __m256i*)(in+i));
+
+		const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2F);
+		const __m256i lo_nibbles = _mm256_and_si256(str, mask_2F);
+		const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		const __m256i eq_2F = _mm256_cmpeq_epi8(str, mask_2F);
+		const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+			2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+			2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0,1,2, 4,5,6, -1,-1));
+
+		_mm256_storeu_si256((__m256i*)(out+k), str);
+		i+=32; k+=24;
+	}
+
+	unsigned int sse_consumed = 0;
+	k += b64_decode_sse41(in+i, in_len-i, out+k, &sse_consumed);
+	*consumed = i + sse_consumed;
+	return k;
+}
+
+#endif // CPU_FEATURES_X86
+
+#if defined(CPU_FEATURES_ARM64)
+
+static unsigned int b64_decode_neon(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* consumed) {
+
+	unsigned int i=0, k=0;
+	const uint8x16x4_t lut_lo = b64_neon_table(b64_dec_table);
+	const uint8x16x4_t lut_hi = b64_neon_table(b64_dec_table + 64);
+	const uint8x16_t invalid = vdupq_n_u8(0xff);
+	const uint8x16_t offset = vdupq_n_u8(64);
+
+	// vld4 de-interleaves 16 quartets, vst3 writes exactly 48 bytes so no reserve is needed.
+	while (in_len - i >= 64) {
+		uint8x16x4_t str = vld4q_u8(in+i);
+		uint8x16_t error = vdupq_n_u8(0);
+		for (int j=0; j<4; j++) {
+			// Characters 0-63 come from the first table, 64-127 from the second, the rest stay 0xff.
+			uint8x16_t v = vqtbx4q_u8(invalid, lut_lo, str.val[j]);
+			v = vqtbx4q_u8(v, lut_hi, vsubq_u8(str.val[j], offset));
+			error = vorrq_u8(error, v);
+			str.val[j] = v;
+		}
+		if (vmaxvq_u8(error) > 63)
+			break;
+
+		uint8x16x3_t dec;
+		dec.val[0] = vorrq_u8(vshlq_n_u8(str.val[0], 2), vshrq_n_u8(str.val[1], 4));
+		dec.val[1] = vorrq_u8(vshlq_n_u8(str.val[1], 4), vshrq_n_u8(str.val[2], 2));
+		dec.val[2] = vorrq_u8(vshlq_n_u8(str.val[2], 6), str.val[3]);
+		vst3q_u8(out+k, dec);
+		i+=64; k+=48;
+	}
+
+	*consumed = i;
+	return k;
+}
+
+#endif // CPU_FEATURES_ARM64
+
+static long b64_decode_scalar(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* out_len) {
+
+	unsigned int i=0, k=0;
+	unsigned int s[4];
+
+	// A padded final quartet is left for the tail handling below.
+	unsigned int full = in_len & ~3u;
+	if (full != 0 && full == in_len && in[in_len-1] == '=')
+		full -= 4;
+
+	for (i=0;i<full;i+=4) {
+		s[0] = b64_dec_table[in[i+0]];
+		s[1] = b64_dec_table[in[i+1]];
+		s[2] = b64_dec_table[in[i+2]];
+		s[3] = b64_dec_table[in[i+3]];
+		if ((s[0]|s[1]|s[2]|s[3]) > 63) {
+			*out_len = k;
+			for (unsigned int j=0;j<4;j++) {
+				if (s[j] > 63)
+					return i + j;
+			}
+		}
+		out[k+0] = (s[0]<<2)+(s[1]>>4);
+		out[k+1] = ((s[1]&0x0F)<<4)+(s[2]>>2);
+		out[k+2] = ((s[2]&0x03)<<6)+s[3];
+		k+=3;
+	}
+
+	*out_len = k;
+	const unsigned int rem = in_len - i;
+	if (rem == 0)
+		return -1;
+
+	// A single leftover character can't carry a whole byte.
+	if (rem == 1)
+		return i;
+
+	s[0] = b64_dec_table[in[i+0]];
+	if (s[0] > 63)
+		return i;
+	s[1] = b64_dec_table[in[i+1]];
+	if (s[1] > 63)
+		return i + 1;
+	out[k++] = (s[0]<<2)+(s[1]>>4);
+
+	// Accept "xx==", "xxx=" and the unpadded "xx" and "xxx" forms.
+	if (rem >= 3 && !(rem == 4 && in[i+2] == '=')) {
+		s[2] = b64_dec_table[in[i+2]];
+		if (s[2] > 63) {
+			*out_len = k - 1;
+			return i + 2;
+		}
+		out[k++] = ((s[1]&0x0F)<<4)+(s[2]>>2);
+	}
+
+	*out_len = k;
+	return -1;
+}
+
+typedef unsigned int (*b64_encode_func)(const unsigned char* in, unsigned int in_len, unsigned char* out);
+
+static b64_encode_func b64_encode_impl = NULL;
+static b64_decode_func b64_decode_impl = NULL;
+
+//Picks the kernels the first time base64 is used. pthread_once() because the first use may be on a pipeline worker thread.
+static pthread_once_t b64_impl_once = PTHREAD_ONCE_INIT;
+
+static int b64_select_impl(b64_impl impl);
+
+static void b64_select_auto_impl(void) {
+	b64_select_impl(B64_IMPL_AUTO);
+}
+
+int b64_set_impl(b64_impl impl) {
+	pthread_once(&b64_impl_once, b64_select_auto_impl);
+	return b64_select_impl(impl);
+}
+
+static int b64_select_impl(b64_impl impl) {
+
+	const unsigned int features = cpu_features();
+	b64_encode_func encode = NULL;
+	b64_decode_func decode = NULL;
+
+	switch (impl) {
+		case B64_IMPL_AUTO:
+#if defined(CPU_FEATURES_X86)
+			if (features & CPU_FEATURE_AVX2)
+				return b64_select_impl(B64_IMPL_AVX2);
+			if (features & CPU_FEATURE_SSE41)
+				return b64_select_impl(B64_IMPL_SSE41);
+#elif defined(CPU_FEATURES_ARM64)
+			if (features & CPU_FEATURE_NEON)
+				return b64_select_impl(B64_IMPL_NEON);
+#endif
+			return b64_select_impl(B64_IMPL_SCALAR);
+
+		case B64_IMPL_SCALAR:
+			encode = b64_encode_scalar;
+			break;
+
+#if defined(CPU_FEATURES_X86)
+		case B64_IMPL_SSE41:
+			if (features & CPU_FEATURE_SSE41) {
+				encode = b64_encode_sse41;
+				decode = b64_decode_sse41;
+			}
+			break;
+
+		case B64_IMPL_AVX2:
+			if ((features & CPU_FEATURE_AVX2) && (features & CPU_FEATURE_SSE41)) {
+				encode = b64_encode_avx2;
+				decode = b64_decode_avx2;
+			}
+			break;
+#endif
+
+#if defined(CPU_FEATURES_ARM64)
+		case B64_IMPL_NEON:
+			if (features & CPU_FEATURE_NEON) {
+				encode = b64_encode_neon;
+				decode = b64_decode_neon;
+			}
+			break;
+#endif
+
+		default:
+			break;
+	}
+
+	if (encode == NULL)
+		return 0;
+
+	b64_encode_impl = encode;
+	b64_decode_impl = decode;
+	return 1;
+}
+
+long b64_decode_validate(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* out_len) {
+
+	pthread_once(&b64_impl_once, b64_select_auto_impl);
+
+	unsigned int consumed = 0;
+	unsigned int k = 0;
+	if (b64_decode_impl != NULL)
+		k = b64_decode_impl(in, in_len, out, &consumed);
+
+	unsigned int tail_len = 0;
+	long result = b64_decode_scalar(in+consumed, in_len-consumed, out+k, &tail_len);
+	*out_len = k + tail_len;
+	return result == -1 ? -1 : result + consumed;
+}
+
+unsigned int b64_encode(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+
+	pthread_once(&b64_impl_once, b64_select_auto_impl);
+	return b64_encode_impl(in, in_len, out);
+}
+
 unsigned int b64_decode(const unsigned char* in, unsigned int in_len, unsigned char* out) {
 
 	unsigned int i=0, j=0, k=0, s[4];
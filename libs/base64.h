@@ -21,6 +21,19 @@ unsigned int b64e_size(unsigned int in_size);
 // Returns the recommended memory size to be allocated for the output buffer
 unsigned int b64d_size(unsigned int in_size);
 
+// Encoder kernels. B64_IMPL_AUTO picks the fastest one the CPU supports.
+typedef enum {
+	B64_IMPL_AUTO = 0,
+	B64_IMPL_SCALAR,
+	B64_IMPL_SSE41,
+	B64_IMPL_AVX2,
+	B64_IMPL_NEON
+} b64_impl;
+
+// impl : kernel to use for all following b64_encode() and b64_decode_validate() calls.
+// returns 1 on success or 0 if the kernel isn't available on this CPU/build (the current one stays selected)
+int b64_set_impl(b64_impl impl);
+
 // in : buffer of "raw" binary to be encoded.
 // in_len : number of bytes to be encoded.
 // out : pointer to buffer with enough memory, user is responsible for memory allocation, receives null-terminated string
@@ -33,6 +46,13 @@ unsigned int b64_encode(const unsigned char* in, unsigned int in_len, unsigned c
 // returns size of output excluding null byte
 unsigned int b64_decode(const unsigned char* in, unsigned int in_len, unsigned char* out);
 
+// in : buffer of base64 string to be decoded and validated, padding is optional.
+// in_len : number of bytes to be decoded.
+// out : pointer to buffer of at least b64d_size(in_len) bytes, receives "raw" binary
+// out_len : receives the number of bytes decoded before the end or the first invalid character
+// returns -1 if the input was valid, otherwise the offset of the first invalid character
+long b64_decode_validate(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* out_len);
+
 // file-version b64_encode
 // Input : filenames
 // returns size of output
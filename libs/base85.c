@@ -0,0 +1,156 @@
+/*
+	base85.c - Copyright 2024 Simon Edwards <simon@simonzone.com>
+	Released under the MIT License
+
+	See "base85.h", for more information.
+*/
+
+#include <stdint.h>
+
+#include "base85.h"
+
+//Base85 char table - used internally for encoding
+static const unsigned char b85_chr[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~";
+
+//ASCII to base85 value table - 0xff marks characters outside the alphabet
+static const unsigned char b85_dec_table[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x3e, 0xff, 0x3f, 0x40, 0x41, 0x42, 0xff, 0x43, 0x44, 0x45, 0x46, 0xff, 0x47, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0x48, 0x49, 0x4a, 0x4b, 0x4c,
+	0x4d, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0xff, 0xff, 0xff, 0x4e, 0x4f,
+	0x50, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32,
+	0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x51, 0x52, 0x53, 0x54, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+unsigned int b85e_size(unsigned int in_size) {
+
+	unsigned int rem = in_size % 4;
+	return in_size / 4 * 5 + (rem != 0 ? rem + 1 : 0);
+}
+
+unsigned int b85d_size(unsigned int in_size) {
+
+	unsigned int rem = in_size % 5;
+	return in_size / 5 * 4 + (rem > 1 ? rem - 1 : 0);
+}
+
+// Spell out a group, most significant digit first. The divisions by a
+// constant come out as multiplications.
+static inline void b85_put_group(uint32_t value, unsigned char* out) {
+
+	uint32_t q = value / 85;
+	out[4] = b85_chr[value - q * 85];
+	value = q; q = value / 85;
+	out[3] = b85_chr[value - q * 85];
+	value = q; q = value / 85;
+	out[2] = b85_chr[value - q * 85];
+	value = q; q = value / 85;
+	out[1] = b85_chr[value - q * 85];
+	out[0] = b85_chr[q];
+}
+
+unsigned int b85_encode(const unsigned char* in, unsigned int in_len, unsigned char* out) {
+
+	unsigned int i=0, k=0;
+
+	for (;i+4<=in_len;i+=4) {
+		uint32_t value = (uint32_t) in[i] << 24 | (uint32_t) in[i+1] << 16 | (uint32_t) in[i+2] << 8 | in[i+3];
+		b85_put_group(value, out+k);
+		k+=5;
+	}
+
+	unsigned int rem = in_len - i;
+	if (rem != 0) {
+		unsigned char group[5];
+		uint32_t value = 0;
+		for (unsigned int j=0;j<4;j++)
+			value = value << 8 | (j < rem ? in[i+j] : 0);
+		b85_put_group(value, group);
+		for (unsigned int j=0;j<=rem;j++)
+			out[k++] = group[j];
+	}
+
+	out[k] = '\0';
+	return k;
+}
+
+// Decode one group of 5 values. Returns -1 if a value is outside the
+// alphabet, -2 if the group is bigger than 32 bits, and 0 otherwise.
+static inline int b85_get_group(const unsigned char* d, uint32_t* value) {
+
+	// Values outside the alphabet are 0xff, and only they have the top bit set.
+	if ((d[0] | d[1] | d[2] | d[3] | d[4]) & 0x80)
+		return -1;
+	uint64_t v = (((((uint64_t) d[0] * 85 + d[1]) * 85 + d[2]) * 85 + d[3]) * 85) + d[4];
+	if (v >> 32)
+		return -2;
+	*value = (uint32_t) v;
+	return 0;
+}
+
+static long b85_bad_offset(const unsigned char* d, unsigned int count, long group_start, int error) {
+
+	if (error == -1) {
+		for (unsigned int j=0;j<count;j++) {
+			if (d[j] > 84)
+				return group_start + j;
+		}
+	}
+	return group_start;
+}
+
+long b85_decode_validate(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* out_len) {
+
+	unsigned int i=0, k=0;
+	unsigned char d[5];
+	uint32_t value;
+
+	for (;i+5<=in_len;i+=5) {
+		d[0] = b85_dec_table[in[i+0]];
+		d[1] = b85_dec_table[in[i+1]];
+		d[2] = b85_dec_table[in[i+2]];
+		d[3] = b85_dec_table[in[i+3]];
+		d[4] = b85_dec_table[in[i+4]];
+		int error = b85_get_group(d, &value);
+		if (error != 0) {
+			*out_len = k;
+			return b85_bad_offset(d, 5, i, error);
+		}
+		out[k+0] = value >> 24;
+		out[k+1] = value >> 16;
+		out[k+2] = value >> 8;
+		out[k+3] = value;
+		k+=4;
+	}
+
+	*out_len = k;
+	unsigned int rem = in_len - i;
+	if (rem == 0)
+		return -1;
+
+	// A single leftover character can't carry a whole byte.
+	if (rem == 1)
+		return i;
+
+	// The missing characters count as the highest digit, which makes up for the cut off bits.
+	for (unsigned int j=0;j<5;j++)
+		d[j] = j < rem ? b85_dec_table[in[i+j]] : 84;
+	int error = b85_get_group(d, &value);
+	if (error != 0)
+		return b85_bad_offset(d, rem, i, error);
+	for (unsigned int j=0;j<rem-1;j++)
+		out[k++] = value >> (24 - 8 * j);
+
+	*out_len = k;
+	return -1;
+}
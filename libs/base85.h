@@ -0,0 +1,32 @@
+/*
+	base85.h - Copyright 2024 Simon Edwards <simon@simonzone.com>
+	Released under the MIT License
+
+	Base85 with the alphabet of RFC 1924, the same as git's binary patches and
+	Python's base64.b85encode(). Every 4 bytes become 5 characters, big endian.
+	A final group of 1 to 3 bytes is encoded as if padded with zero bytes and
+	cut short to one character more than it has bytes. The alphabet holds no
+	':', '"', '\'', '\\' or control characters.
+*/
+
+// in_size : the number bytes to be encoded.
+// Returns the size of the encoded string excluding the null byte
+unsigned int b85e_size(unsigned int in_size);
+
+// in_size : the number characters to be decoded.
+// Returns the most bytes which they can decode to
+unsigned int b85d_size(unsigned int in_size);
+
+// in : buffer of "raw" binary to be encoded.
+// in_len : number of bytes to be encoded.
+// out : pointer to buffer of at least b85e_size(in_len) + 1 bytes, receives null-terminated string
+// returns size of output excluding null byte
+unsigned int b85_encode(const unsigned char* in, unsigned int in_len, unsigned char* out);
+
+// in : buffer of base85 string to be decoded and validated.
+// in_len : number of characters to be decoded.
+// out : pointer to buffer of at least b85d_size(in_len) bytes, receives "raw" binary
+// out_len : receives the number of bytes decoded before the end or the first invalid group
+// returns -1 if the input was valid, otherwise the offset of the first invalid character,
+// or of the group which is out of range or a lone character at the end
+long b85_decode_validate(const unsigned char* in, unsigned int in_len, unsigned char* out, unsigned int* out_len);
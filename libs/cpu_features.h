@@ -0,0 +1,92 @@
+/*
+	cpu_features.h - runtime CPU feature detection for the SIMD code paths.
+
+	Header only so that it can be pulled into the jumbo builds from any of
+	the libs .c files without worrying about who owns the implementation.
+*/
+#ifndef CPU_FEATURES_H_
+#define CPU_FEATURES_H_
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_FEATURES_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CPU_FEATURES_ARM64 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
+#endif
+
+#define CPU_FEATURE_SSE41    (1u << 0)
+#define CPU_FEATURE_AVX2     (1u << 1)
+#define CPU_FEATURE_SHA      (1u << 2)
+#define CPU_FEATURE_NEON     (1u << 3)
+#define CPU_FEATURE_ARM_SHA2 (1u << 4)
+
+static inline unsigned int cpu_features_probe_(void) {
+	unsigned int features = 0;
+
+#if defined(CPU_FEATURES_X86)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	const int has_ssse3 = (ecx >> 9) & 1;
+	const int has_sse41 = (ecx >> 19) & 1;
+	const int has_osxsave = (ecx >> 27) & 1;
+	const int has_avx = (ecx >> 28) & 1;
+
+	if (has_ssse3 && has_sse41)
+		features |= CPU_FEATURE_SSE41;
+
+	/* AVX registers are only usable if the OS saves the YMM state on context switches. */
+	int os_saves_ymm = 0;
+	if (has_osxsave && has_avx) {
+		unsigned int xcr0_lo, xcr0_hi;
+		__asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		os_saves_ymm = (xcr0_lo & 6) == 6;
+	}
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (os_saves_ymm && ((ebx >> 5) & 1))
+			features |= CPU_FEATURE_AVX2;
+		if (((ebx >> 29) & 1) && (features & CPU_FEATURE_SSE41))
+			features |= CPU_FEATURE_SHA;
+	}
+
+#elif defined(CPU_FEATURES_ARM64)
+	/* Advanced SIMD is mandatory on AArch64. */
+	features |= CPU_FEATURE_NEON;
+#if defined(__linux__) && defined(AT_HWCAP)
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+	if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+		features |= CPU_FEATURE_ARM_SHA2;
+#elif defined(__APPLE__)
+	/* Every Apple Silicon core implements the SHA2 instructions. */
+	features |= CPU_FEATURE_ARM_SHA2;
+#endif
+#endif
+
+	return features;
+}
+
+static unsigned int cpu_features_cached_ = 0;
+static pthread_once_t cpu_features_once_ = PTHREAD_ONCE_INIT;
+
+static void cpu_features_init_(void) {
+	cpu_features_cached_ = cpu_features_probe_();
+}
+
+/* Returns the CPU_FEATURE_* bits supported by this machine. Safe to call from any thread. */
+static inline unsigned int cpu_features(void) {
+	pthread_once(&cpu_features_once_, cpu_features_init_);
+	return cpu_features_cached_;
+}
+
+#endif
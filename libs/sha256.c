@@ -18,7 +18,10 @@
 //  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 //
 
+#include <pthread.h>
+
 #include "sha256.h"
+#include "cpu_features.h"
 
 #ifndef _cbmc_
 #define __CPROVER_assume(...) do {} while(0)
@@ -133,50 +136,240 @@ static void _addbits(sha256_context *ctx, uint32_t n)
 
 
 // -----------------------------------------------------------------------------
-static void _hash(sha256_context *ctx)
+static void _hash_scalar(sha256_context *ctx, const uint8_t *data, size_t blocks)
 {
     __CPROVER_assume(__CPROVER_DYNAMIC_OBJECT(ctx));
 
     register uint32_t a, b, c, d, e, f, g, h;
     uint32_t t[2];
 
-    a = ctx->hash[0];
-    b = ctx->hash[1];
-    c = ctx->hash[2];
-    d = ctx->hash[3];
-    e = ctx->hash[4];
-    f = ctx->hash[5];
-    g = ctx->hash[6];
-    h = ctx->hash[7];
-
-    for (uint32_t i = 0; i < 64; i++) {
-        if (i < 16) {
-            ctx->W[i] = _word(&ctx->buf[_shw(i, 2)]);
-        } else {
-            ctx->W[i] = _G1(ctx->W[i - 2])  + ctx->W[i - 7] +
-                        _G0(ctx->W[i - 15]) + ctx->W[i - 16];
+    for (; blocks > 0; blocks--, data += 64) {
+        a = ctx->hash[0];
+        b = ctx->hash[1];
+        c = ctx->hash[2];
+        d = ctx->hash[3];
+        e = ctx->hash[4];
+        f = ctx->hash[5];
+        g = ctx->hash[6];
+        h = ctx->hash[7];
+
+        for (uint32_t i = 0; i < 64; i++) {
+            if (i < 16) {
+                ctx->W[i] = _word((uint8_t *)&data[_shw(i, 2)]);
+            } else {
+                ctx->W[i] = _G1(ctx->W[i - 2])  + ctx->W[i - 7] +
+                            _G0(ctx->W[i - 15]) + ctx->W[i - 16];
+            }
+
+            t[0] = h + _S1(e) + _Ch(e, f, g) + K[i] + ctx->W[i];
+            t[1] = _S0(a) + _Ma(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t[0];
+            d = c;
+            c = b;
+            b = a;
+            a = t[0] + t[1];
+        }
+
+        ctx->hash[0] += a;
+        ctx->hash[1] += b;
+        ctx->hash[2] += c;
+        ctx->hash[3] += d;
+        ctx->hash[4] += e;
+        ctx->hash[5] += f;
+        ctx->hash[6] += g;
+        ctx->hash[7] += h;
+    }
+} // _hash_scalar
+
+
+#if defined(CPU_FEATURES_X86)
+// -----------------------------------------------------------------------------
+//  Intel SHA extensions. The round instructions want the state split into
+//  ABEF/CDGH halves, so it is shuffled on the way in and back on the way out.
+__attribute__((target("sha,sse4.1")))
+static void _hash_shani(sha256_context *ctx, const uint8_t *data, size_t blocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i STATE0, STATE1, MSG, TMP, ABEF_SAVE, CDGH_SAVE;
+    __m128i M[4];
+
+    TMP = _mm_loadu_si128((const __m128i *)&ctx->hash[0]);
+    STATE1 = _mm_loadu_si128((const __m128i *)&ctx->hash[4]);
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);             // CDAB
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);       // EFGH
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);       // ABEF
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);    // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        for (int i = 0; i < 4; i++) {
+            M[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), MASK);
         }
 
-        t[0] = h + _S1(e) + _Ch(e, f, g) + K[i] + ctx->W[i];
-        t[1] = _S0(a) + _Ma(a, b, c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t[0];
-        d = c;
-        c = b;
-        b = a;
-        a = t[0] + t[1];
+        // 16 groups of 4 rounds. Group g consumes M[g % 4] while the schedule
+        // for the following groups is extended with sha256msg1/sha256msg2.
+        #pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            MSG = _mm_add_epi32(M[g & 3], _mm_loadu_si128((const __m128i *)&K[4 * g]));
+            STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+
+            if (g >= 3 && g <= 14) {
+                TMP = _mm_alignr_epi8(M[g & 3], M[(g - 1) & 3], 4);
+                M[(g + 1) & 3] = _mm_add_epi32(M[(g + 1) & 3], TMP);
+                M[(g + 1) & 3] = _mm_sha256msg2_epu32(M[(g + 1) & 3], M[g & 3]);
+            }
+
+            MSG = _mm_shuffle_epi32(MSG, 0x0E);
+            STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+            if (g >= 1 && g <= 12) {
+                M[(g - 1) & 3] = _mm_sha256msg1_epu32(M[(g - 1) & 3], M[g & 3]);
+            }
+        }
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);          // FEBA
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);       // DCHG
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);    // DCBA
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);       // ABEF
+
+    _mm_storeu_si128((__m128i *)&ctx->hash[0], STATE0);
+    _mm_storeu_si128((__m128i *)&ctx->hash[4], STATE1);
+} // _hash_shani
+#endif // CPU_FEATURES_X86
+
+
+#if defined(CPU_FEATURES_ARM64)
+#if defined(__clang__)
+#define SHA256_ARM_TARGET_ __attribute__((target("crypto")))
+#else
+#define SHA256_ARM_TARGET_ __attribute__((target("+crypto")))
+#endif
+
+// -----------------------------------------------------------------------------
+//  ARMv8 Cryptography Extensions.
+SHA256_ARM_TARGET_
+static void _hash_armv8(sha256_context *ctx, const uint8_t *data, size_t blocks)
+{
+    uint32x4_t STATE0 = vld1q_u32(&ctx->hash[0]);
+    uint32x4_t STATE1 = vld1q_u32(&ctx->hash[4]);
+    uint32x4_t ABCD_SAVE, EFGH_SAVE, MSG, TMP;
+    uint32x4_t M[4];
+
+    for (; blocks > 0; blocks--, data += 64) {
+        ABCD_SAVE = STATE0;
+        EFGH_SAVE = STATE1;
+
+        for (int i = 0; i < 4; i++) {
+            M[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+
+        #pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            MSG = vaddq_u32(M[g & 3], vld1q_u32(&K[4 * g]));
+            if (g < 12) {
+                M[g & 3] = vsha256su0q_u32(M[g & 3], M[(g + 1) & 3]);
+            }
+            TMP = STATE0;
+            STATE0 = vsha256hq_u32(STATE0, STATE1, MSG);
+            STATE1 = vsha256h2q_u32(STATE1, TMP, MSG);
+            if (g < 12) {
+                M[g & 3] = vsha256su1q_u32(M[g & 3], M[(g + 2) & 3], M[(g + 3) & 3]);
+            }
+        }
+
+        STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+        STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+    }
+
+    vst1q_u32(&ctx->hash[0], STATE0);
+    vst1q_u32(&ctx->hash[4], STATE1);
+} // _hash_armv8
+#endif // CPU_FEATURES_ARM64
+
+
+typedef void (*sha256_blocks_func)(sha256_context *ctx, const uint8_t *data, size_t blocks);
+
+static sha256_blocks_func _hash_blocks = NULL;
+
+// The compression function is picked on first use, which may be on a
+// worker thread, so pthread_once() guards it.
+static pthread_once_t _hash_blocks_once = PTHREAD_ONCE_INIT;
+
+static int _select_impl(sha256_impl impl);
+
+static void _select_auto_impl(void)
+{
+    _select_impl(SHA256_IMPL_AUTO);
+} // _select_auto_impl
+
+
+// -----------------------------------------------------------------------------
+int sha256_set_impl(sha256_impl impl)
+{
+    pthread_once(&_hash_blocks_once, _select_auto_impl);
+    return _select_impl(impl);
+} // sha256_set_impl
+
+
+// -----------------------------------------------------------------------------
+static int _select_impl(sha256_impl impl)
+{
+    const unsigned int features = cpu_features();
+    sha256_blocks_func blocks = NULL;
+
+    switch (impl) {
+        case SHA256_IMPL_AUTO:
+            if (_select_impl(SHA256_IMPL_SHANI) || _select_impl(SHA256_IMPL_ARMV8)) {
+                return 1;
+            }
+            return _select_impl(SHA256_IMPL_SCALAR);
+
+        case SHA256_IMPL_SCALAR:
+            blocks = _hash_scalar;
+            break;
+
+#if defined(CPU_FEATURES_X86)
+        case SHA256_IMPL_SHANI:
+            if (features & CPU_FEATURE_SHA) {
+                blocks = _hash_shani;
+            }
+            break;
+#endif
+
+#if defined(CPU_FEATURES_ARM64)
+        case SHA256_IMPL_ARMV8:
+            if (features & CPU_FEATURE_ARM_SHA2) {
+                blocks = _hash_armv8;
+            }
+            break;
+#endif
+
+        default:
+            break;
     }
 
-    ctx->hash[0] += a;
-    ctx->hash[1] += b;
-    ctx->hash[2] += c;
-    ctx->hash[3] += d;
-    ctx->hash[4] += e;
-    ctx->hash[5] += f;
-    ctx->hash[6] += g;
-    ctx->hash[7] += h;
+    if (blocks == NULL) {
+        return 0;
+    }
+    _hash_blocks = blocks;
+    return 1;
+} // _select_impl
+
+
+// -----------------------------------------------------------------------------
+static void _hash(sha256_context *ctx, const uint8_t *data, size_t blocks)
+{
+    pthread_once(&_hash_blocks_once, _select_auto_impl);
+    _hash_blocks(ctx, data, blocks);
 } // _hash
 
 
@@ -205,13 +398,33 @@ void sha256_hash(sha256_context *ctx, const void *data, size_t len)
     if ((ctx != NULL) && (bytes != NULL) && (ctx->len < sizeof(ctx->buf))) {
         __CPROVER_assume(__CPROVER_DYNAMIC_OBJECT(bytes));
         __CPROVER_assume(__CPROVER_DYNAMIC_OBJECT(ctx));
-        for (size_t i = 0; i < len; i++) {
-            ctx->buf[ctx->len++] = bytes[i];
-            if (ctx->len == sizeof(ctx->buf)) {
-                _hash(ctx);
+        size_t i = 0;
+
+        // Top up a partially filled block first.
+        if (ctx->len > 0) {
+            for (; i < len && ctx->len < sizeof(ctx->buf); i++) {
+                ctx->buf[ctx->len++] = bytes[i];
+            }
+            if (ctx->len < sizeof(ctx->buf)) {
+                return;
+            }
+            _hash(ctx, ctx->buf, 1);
+            _addbits(ctx, sizeof(ctx->buf) * 8);
+            ctx->len = 0;
+        }
+
+        // Whole blocks are compressed straight from the caller's buffer.
+        const size_t blocks = (len - i) / sizeof(ctx->buf);
+        if (blocks > 0) {
+            _hash(ctx, &bytes[i], blocks);
+            for (size_t j = 0; j < blocks; j++) {
                 _addbits(ctx, sizeof(ctx->buf) * 8);
-                ctx->len = 0;
             }
+            i += blocks * sizeof(ctx->buf);
+        }
+
+        for (; i < len; i++) {
+            ctx->buf[ctx->len++] = bytes[i];
         }
     }
 } // sha256_hash
@@ -230,7 +443,7 @@ void sha256_done(sha256_context *ctx, uint8_t *hash)
         }
 
         if (ctx->len > 55) {
-            _hash(ctx);
+            _hash(ctx, ctx->buf, 1);
             for (j = 0; j < sizeof(ctx->buf); j++) {
                 ctx->buf[j] = 0x00;
             }
@@ -245,7 +458,7 @@ void sha256_done(sha256_context *ctx, uint8_t *hash)
         ctx->buf[58] = _shb(ctx->bits[1],  8);
         ctx->buf[57] = _shb(ctx->bits[1], 16);
         ctx->buf[56] = _shb(ctx->bits[1], 24);
-        _hash(ctx);
+        _hash(ctx, ctx->buf, 1);
 
         if (hash != NULL) {
             for (i = 0, j = 24; i < 4; i++, j -= 8) {
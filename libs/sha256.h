@@ -39,6 +39,17 @@ typedef struct {
     uint32_t W[64];
 } sha256_context;
 
+// Block compression kernels. SHA256_IMPL_AUTO picks the fastest one the CPU supports.
+typedef enum {
+    SHA256_IMPL_AUTO = 0,
+    SHA256_IMPL_SCALAR,
+    SHA256_IMPL_SHANI,
+    SHA256_IMPL_ARMV8
+} sha256_impl;
+
+// Returns 1 on success or 0 if the kernel isn't available on this CPU/build.
+int sha256_set_impl(sha256_impl impl);
+
 void sha256_init(sha256_context *ctx);
 void sha256_hash(sha256_context *ctx, const void *data, size_t len);
 void sha256_done(sha256_context *ctx, uint8_t *hash);
@@ -0,0 +1,72 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* libs/base64.h has no include guard, so libs/base64.c and libs/base85.c are included ahead of this file instead. */
+
+/*
+ * How the payload of a data line is spelt out in text, the "line encoding".
+ *
+ * Base64 is what every terminal reads. The "base85" line encoding uses the
+ * alphabet of RFC 1924 instead, which puts 4 bytes in 5 characters rather
+ * than 3 in 4, so a line of binary data comes out about 6% shorter. Its
+ * alphabet has no ':', which keeps the fields of a line apart, and nothing
+ * a terminal would take as a control sequence.
+ *
+ * Only data lines, and the frame lines that carry data, use it. The rest of
+ * the protocol stays in base64.
+ */
+
+#define LINE_ENCODING_BASE85 "base85"
+
+/**
+ * @return the length of the encoding of `length` bytes.
+ */
+size_t line_encoded_size(bool is_base85, size_t length) {
+    return is_base85 ? b85e_size(length) : b64e_size(length);
+}
+
+/**
+ * @return the characters the encoding takes per byte of data, leaving out padding.
+ */
+double line_encoding_expansion(bool is_base85) {
+    return is_base85 ? 5.0 / 4 : 4.0 / 3;
+}
+
+/**
+ * @return the most bytes which `length` characters can decode to.
+ */
+size_t line_decoded_size(bool is_base85, size_t length) {
+    return is_base85 ? b85d_size(length) : b64d_size(length);
+}
+
+/**
+ * @param out Receives the encoding and a NUL, must hold line_encoded_size() + 1 chars.
+ * @return the length of the encoding excluding the NUL.
+ */
+size_t line_encode(bool is_base85, const unsigned char *data, size_t length, unsigned char *out) {
+    return is_base85 ? b85_encode(data, length, out) : b64_encode(data, length, out);
+}
+
+/**
+ * Decode a payload, checking that it is valid.
+ *
+ * @param out Receives the data, must hold line_decoded_size() bytes.
+ * @return -1 if the payload is valid, otherwise the offset of the first bad character.
+ */
+long line_decode_validate(bool is_base85, const unsigned char *text, size_t length, unsigned char *out,
+        unsigned int *out_length) {
+    return is_base85 ? b85_decode_validate(text, length, out, out_length)
+        : b64_decode_validate(text, length, out, out_length);
+}
+
+/**
+ * @return the name of the line encoding for messages.
+ */
+const char *line_encoding_name(bool is_base85) {
+    return is_base85 ? LINE_ENCODING_BASE85 : "base64";
+}
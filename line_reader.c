@@ -0,0 +1,154 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * A run of bytes inside some other buffer. Not NUL terminated.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+} Slice;
+
+bool slice_starts_with(Slice slice, const char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    return slice.length >= prefix_length && memcmp(slice.data, prefix, prefix_length) == 0;
+}
+
+/**
+ * Buffered line reader on top of plain read(2) calls.
+ *
+ * Lines are returned as slices pointing into the reader's buffer, so they
+ * are only valid until the next call. The buffer grows as needed, so there
+ * is no limit on the length of a line.
+ */
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start;           /* First byte not yet returned. */
+    size_t end;             /* End of the bytes read so far. */
+    size_t scanned;         /* Bytes from `start` known not to hold a line end. */
+    bool eof;
+    bool error;
+} LineReader;
+
+#define LINE_READER_DEFAULT_CAPACITY (64 * 1024)
+
+bool line_reader_init(LineReader *reader, int fd, size_t capacity) {
+    reader->fd = fd;
+    reader->buffer = malloc(capacity);
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = 0;
+    reader->scanned = 0;
+    reader->eof = false;
+    reader->error = reader->buffer == NULL;
+    return !reader->error;
+}
+
+void line_reader_free(LineReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+static bool line_reader_fill(LineReader *reader) {
+    /* Slide the unread bytes to the front, or grow if a single line fills the buffer. */
+    if (reader->end == reader->capacity) {
+        if (reader->start != 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        } else {
+            size_t new_capacity = reader->capacity * 2;
+            char *new_buffer = realloc(reader->buffer, new_capacity);
+            if (new_buffer == NULL) {
+                reader->error = true;
+                return false;
+            }
+            reader->buffer = new_buffer;
+            reader->capacity = new_capacity;
+        }
+    }
+
+    while (true) {
+        ssize_t count = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+        if (count > 0) {
+            reader->end += count;
+            return true;
+        }
+        if (count == 0) {
+            reader->eof = true;
+            return false;
+        }
+        if (errno != EINTR) {
+            reader->error = true;
+            return false;
+        }
+    }
+}
+
+/**
+ * Find the first '\n' or '\r' in a block of bytes.
+ */
+static char *find_line_end(char *data, size_t length) {
+    char *newline = memchr(data, '\n', length);
+    char *carriage_return = memchr(data, '\r', newline != NULL ? (size_t) (newline - data) : length);
+    return carriage_return != NULL ? carriage_return : newline;
+}
+
+/**
+ * Read the next line.
+ *
+ * Lines may end with '\n', '\r' or both, as a tty in raw mode passes the
+ * terminal's line endings through untranslated. Leading and trailing white
+ * space is left out of the returned slice and blank lines are skipped. A
+ * final line without a line ending is returned too.
+ *
+ * @return false at the end of the input or on a read error.
+ */
+bool line_reader_next(LineReader *reader, Slice *line) {
+    while (true) {
+        char *line_start = reader->buffer + reader->start;
+        char *newline = find_line_end(line_start + reader->scanned, reader->end - reader->start - reader->scanned);
+        size_t line_length;
+
+        if (newline != NULL) {
+            line_length = newline - line_start;
+            reader->start += line_length + 1;
+        } else {
+            reader->scanned = reader->end - reader->start;
+            if (line_reader_fill(reader)) {
+                continue;
+            }
+            if (reader->error || reader->start == reader->end) {
+                return false;
+            }
+            line_length = reader->end - reader->start;
+            reader->start = reader->end;
+        }
+        reader->scanned = 0;
+
+        while (line_length != 0 && isspace((unsigned char) line_start[line_length-1])) {
+            line_length--;
+        }
+        while (line_length != 0 && isspace((unsigned char) *line_start)) {
+            line_start++;
+            line_length--;
+        }
+        if (line_length == 0) {
+            continue;
+        }
+        line->data = line_start;
+        line->length = line_length;
+        return true;
+    }
+}
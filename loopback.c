@@ -0,0 +1,1361 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libs/adopt.h"
+#include "libs/adopt.c"
+#include "libs/base64.c"
+#include "libs/base85.c"
+#include "libs/sha256.c"
+
+#include "utils.h"
+#include "utils.c"
+#include "output_buffer.c"
+#include "line_encoding.c"
+#include "chained_hash.c"
+#include "tree_hash.c"
+#include "lz_block.c"
+#include "chunk_dedup.c"
+#include "delta.c"
+
+/*
+ * Stand-in for Extraterm, for testing and measuring `show` and `from`
+ * without a real terminal window.
+ *
+ * The command runs on the slave side of a pty with LC_EXTRATERM_COOKIE set,
+ * while we sit on the master side and play the terminal. File transfer
+ * records from `show` are parsed and their chained hashes verified. Frame
+ * requests from `from` are answered with the contents of a file. The link
+ * between the two can be slowed down to a given bandwidth and latency.
+ * Packed data lines are unpacked before they are checked, and frames are
+ * sent packed when both sides support it. The same goes for hash trees.
+ * Chunk dedup offers are answered from a chunk store which lasts for the
+ * whole run, so a file sent twice only crosses the link once. Likewise the
+ * last version of each file received is kept for delta transfers.
+ *
+ * Anything else the command writes is passed through to our stdout. A
+ * report on each transfer goes to stderr.
+ */
+
+#define LOOPBACK_COOKIE "4242loopback"
+#define LOOPBACK_READ_SIZE (64 * 1024)
+#define LOOPBACK_FRAME_CHUNK_BYTES (3 * 1024)
+#define LOOPBACK_MAX_CHUNK "1048576"
+#define LOOPBACK_FRAME_HASH_LENGTH 20
+/* Signatures per "#G:" line, for the same reason. */
+#define LOOPBACK_SIGNATURES_PER_LINE 20
+/* Hex digits per "#W:" line, which keeps it inside the 1024 chars that a tty in canonical mode takes on macOS. */
+#define LOOPBACK_ANSWER_DIGITS 512
+
+/**
+ * Growable byte buffer. Data is appended at the end and consumed from the front.
+ */
+typedef struct {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} ByteQueue;
+
+static void byte_queue_append(ByteQueue *queue, const void *data, size_t length) {
+    if (queue->capacity - queue->end < length) {
+        memmove(queue->data, queue->data + queue->start, queue->end - queue->start);
+        queue->end -= queue->start;
+        queue->start = 0;
+        if (queue->capacity - queue->end < length) {
+            size_t new_capacity = queue->capacity == 0 ? LOOPBACK_READ_SIZE : queue->capacity;
+            while (new_capacity - queue->end < length) {
+                new_capacity *= 2;
+            }
+            queue->data = realloc(queue->data, new_capacity);
+            queue->capacity = new_capacity;
+        }
+    }
+    memcpy(queue->data + queue->end, data, length);
+    queue->end += length;
+}
+
+static size_t byte_queue_length(const ByteQueue *queue) {
+    return queue->end - queue->start;
+}
+
+static void byte_queue_consume(ByteQueue *queue, size_t length) {
+    queue->start += length;
+    if (queue->start == queue->end) {
+        queue->start = 0;
+        queue->end = 0;
+    }
+}
+
+/**
+ * Simulated link in one direction.
+ *
+ * Bandwidth is a token bucket allowing bursts of up to 10ms worth of data.
+ */
+typedef struct {
+    double bytes_per_second;    /* 0 means unlimited. */
+    double latency;             /* One way, in seconds. */
+    double tokens;
+    double last_refill;
+} Link;
+
+static void link_init(Link *link, double bytes_per_second, double latency) {
+    link->bytes_per_second = bytes_per_second;
+    link->latency = latency;
+    link->tokens = 0;
+    link->last_refill = now_seconds();
+}
+
+/**
+ * How many bytes may cross the link right now.
+ */
+static size_t link_allowance(Link *link, size_t wanted) {
+    if (link->bytes_per_second == 0) {
+        return wanted;
+    }
+    double now = now_seconds();
+    double burst = link->bytes_per_second / 100;
+    link->tokens += (now - link->last_refill) * link->bytes_per_second;
+    if (link->tokens > burst) {
+        link->tokens = burst;
+    }
+    link->last_refill = now;
+    return link->tokens < wanted ? (size_t) link->tokens : wanted;
+}
+
+static void link_consume(Link *link, size_t count) {
+    if (link->bytes_per_second != 0) {
+        link->tokens -= count;
+    }
+}
+
+/**
+ * Milliseconds until at least one byte may cross the link.
+ */
+static int link_wait_ms(const Link *link) {
+    if (link->bytes_per_second == 0 || link->tokens >= 1) {
+        return 0;
+    }
+    return (int) ((1 - link->tokens) / link->bytes_per_second * 1000) + 1;
+}
+
+/**
+ * The chunks which the terminal holds from earlier transfers.
+ */
+typedef struct {
+    unsigned char digest[SHA256_SIZE_BYTES];
+    unsigned char *data;
+    uint32_t length;
+} StoredChunk;
+
+typedef struct {
+    StoredChunk *chunks;
+    size_t count;
+    size_t capacity;
+} ChunkStore;
+
+static const StoredChunk *chunk_store_find(const ChunkStore *store, const unsigned char *digest) {
+    for (size_t i=0; i<store->count; i++) {
+        if (memcmp(store->chunks[i].digest, digest, SHA256_SIZE_BYTES) == 0) {
+            return &store->chunks[i];
+        }
+    }
+    return NULL;
+}
+
+static void chunk_store_add(ChunkStore *store, const unsigned char *data, uint32_t length) {
+    unsigned char digest[SHA256_SIZE_BYTES];
+    sha256(data, length, digest);
+    if (chunk_store_find(store, digest) != NULL) {
+        return;
+    }
+    if (store->count == store->capacity) {
+        store->capacity = store->capacity == 0 ? 256 : store->capacity * 2;
+        store->chunks = realloc(store->chunks, store->capacity * sizeof(StoredChunk));
+    }
+    StoredChunk *chunk = &store->chunks[store->count++];
+    memcpy(chunk->digest, digest, SHA256_SIZE_BYTES);
+    chunk->data = malloc(length);
+    memcpy(chunk->data, data, length);
+    chunk->length = length;
+}
+
+static void chunk_store_free(ChunkStore *store) {
+    for (size_t i=0; i<store->count; i++) {
+        free(store->chunks[i].data);
+    }
+    free(store->chunks);
+}
+
+/**
+ * The last version of a file received, which a delta is made against.
+ */
+typedef struct {
+    char *filename;             /* As it appears in the metadata. */
+    unsigned char *data;
+    size_t length;
+} EarlierVersion;
+
+typedef enum {
+    PARSE_TEXT,
+    PARSE_TRANSFER_METADATA,
+    PARSE_TRANSFER_LINES,
+    PARSE_TRANSFER_TERMINATOR,
+    PARSE_FRAME_NAME,
+} ParseState;
+
+/**
+ * A file transfer coming from `show`.
+ */
+typedef struct {
+    size_t metadata_length;
+    char *metadata;
+    ChainedHash chain;
+    bool is_tree;               /* The data lines are hashed as a tree instead of chained. */
+    TreeHash tree;
+    bool is_packed;             /* The data lines use the lz4-block content encoding. */
+    bool is_base85;             /* The data lines use the base85 line encoding. */
+    bool is_dedup;              /* The chunk-dedup transfer mode. */
+    DedupPlan plan;             /* The chunks offered, and which of them were asked for. */
+    bool is_offer_done;
+    size_t next_chunk;          /* First chunk of the file which hasn't been put together yet. */
+    unsigned char *chunk_data;  /* The wanted chunk which the data lines are filling in. */
+    size_t chunk_fill;
+    bool is_delta;              /* The delta transfer mode. */
+    const unsigned char *base;  /* The earlier version which the delta is against, or NULL. */
+    size_t base_length;
+    uint32_t block_size;
+    ByteQueue delta_input;      /* Instructions which haven't been carried out yet. */
+    sha256_context delta_hash;
+    bool is_delta_ended;
+    uint64_t copied_bytes;
+    uint64_t literal_bytes;
+    size_t signature_bytes;
+    char *filename;
+    ByteQueue contents;         /* The file, to keep as an earlier version. */
+    size_t bytes;
+    size_t wire_bytes;
+    size_t plain_wire_bytes;    /* What the data lines would have taken unpacked. */
+    size_t base64_wire_bytes;   /* What the data lines would have taken in base64. */
+    size_t lines;
+    bool failed;
+    bool mismatched;
+    bool aborted;               /* Ended with an "A:" line. */
+    bool cancel_sent;
+    size_t bytes_at_cancel;
+    double start_time;
+    double first_data_time;
+} Transfer;
+
+typedef struct {
+    const char *cookie;
+    bool quiet;
+    Link upstream;              /* From the command to us. */
+    Link downstream;            /* From us to the command. */
+
+    /* Contents expected from `show`, or NULL. */
+    unsigned char *expected;
+    size_t expected_length;
+
+    /* Contents sent in answer to frame requests, or NULL. */
+    unsigned char *frame;
+    size_t frame_length;
+    size_t frame_chunk_bytes;
+    bool is_frame_packed;       /* The current frame request accepted our content encoding. */
+    bool is_frame_tree;         /* The current frame request accepted a hash tree. */
+    bool is_frame_base85;       /* The current frame request accepted base85 lines. */
+
+    /* Content encodings advertised to the command, comma separated, or NULL. */
+    const char *content_encodings;
+    /* Integrity modes advertised to the command, comma separated, or NULL. */
+    const char *integrity_modes;
+    /* Line encodings advertised to the command, comma separated, or NULL. */
+    const char *line_encodings;
+    /* Transfer modes advertised to the command, comma separated, or NULL. */
+    const char *transfer_modes;
+    ChunkStore store;
+    EarlierVersion *versions;
+    size_t version_count;
+    /* The earlier version of any file that isn't in `versions`, or NULL. */
+    unsigned char *default_base;
+    size_t default_base_length;
+
+    /* Cancel each transfer once this much data has arrived, or 0. */
+    size_t cancel_after_bytes;
+
+    /* Longest allowed wait for a transfer's first data line in seconds, or 0. */
+    double first_data_limit;
+    /* When the command started or the last transfer ended. Time to first
+       data is measured from here, as the start record may be held back too. */
+    double waiting_since;
+
+    ParseState state;
+    ByteQueue input;
+    ByteQueue output;
+    double output_ready_time;
+    double frame_request_time;
+    size_t frame_wire_bytes;
+
+    Transfer transfer;
+    int transfer_count;
+    int failure_count;
+    int frame_request_count;
+} Loopback;
+
+/**
+ * @return the filename in the metadata as it appears there, still escaped, or NULL.
+ */
+static char *metadata_filename(const char *metadata) {
+    const char *key = "\"filename\":\"";
+    const char *start = strstr(metadata, key);
+    if (start == NULL) {
+        return NULL;
+    }
+    start += strlen(key);
+    const char *end = start;
+    while (*end != '\0' && *end != '"') {
+        if (*end == '\\' && end[1] != '\0') {
+            end++;
+        }
+        end++;
+    }
+    return strndup(start, end - start);
+}
+
+static EarlierVersion *find_version(Loopback *loopback, const char *filename) {
+    for (size_t i=0; i<loopback->version_count; i++) {
+        if (strcmp(loopback->versions[i].filename, filename) == 0) {
+            return &loopback->versions[i];
+        }
+    }
+    return NULL;
+}
+
+static void keep_version(Loopback *loopback, const char *filename, const ByteQueue *contents) {
+    EarlierVersion *version = find_version(loopback, filename);
+    if (version == NULL) {
+        loopback->versions = realloc(loopback->versions, (loopback->version_count + 1) * sizeof(EarlierVersion));
+        version = &loopback->versions[loopback->version_count++];
+        version->filename = strdup(filename);
+    } else {
+        free(version->data);
+    }
+    version->length = byte_queue_length(contents);
+    version->data = malloc(version->length + 1);
+    memcpy(version->data, contents->data + contents->start, version->length);
+}
+
+static void report_transfer(Loopback *loopback) {
+    Transfer *transfer = &loopback->transfer;
+    double end_time = now_seconds() + loopback->upstream.latency;
+    double elapsed = end_time - transfer->start_time;
+    double first_data_delay = transfer->first_data_time != 0 ? transfer->first_data_time - loopback->waiting_since : -1.0;
+    bool late = loopback->first_data_limit != 0 && transfer->bytes != 0 &&
+        first_data_delay > loopback->first_data_limit;
+    /* When cancelling, the transfer has to stop early, and otherwise it mustn't. */
+    bool abort_wrong = transfer->aborted != (loopback->cancel_after_bytes != 0);
+    bool ok = !transfer->failed && !transfer->mismatched && !late && !abort_wrong;
+
+    if (transfer->is_packed) {
+        size_t saved = transfer->plain_wire_bytes > transfer->wire_bytes
+            ? transfer->plain_wire_bytes - transfer->wire_bytes : 0;
+        fprintf(stderr, "[loopback] " CONTENT_ENCODING_LZ4_BLOCK ": %zu wire bytes instead of %zu, %.1f%% saved\n",
+            transfer->wire_bytes, transfer->plain_wire_bytes,
+            transfer->plain_wire_bytes != 0 ? 100.0 * saved / transfer->plain_wire_bytes : 0);
+    }
+    if (transfer->is_base85) {
+        size_t saved = transfer->base64_wire_bytes > transfer->wire_bytes
+            ? transfer->base64_wire_bytes - transfer->wire_bytes : 0;
+        fprintf(stderr, "[loopback] " LINE_ENCODING_BASE85 ": %zu wire bytes instead of %zu with base64, %.1f%% saved\n",
+            transfer->wire_bytes, transfer->base64_wire_bytes,
+            transfer->base64_wire_bytes != 0 ? 100.0 * saved / transfer->base64_wire_bytes : 0);
+    }
+    if (transfer->is_dedup) {
+        DedupPlan *plan = &transfer->plan;
+        size_t held = plan->count - plan->wanted_count;
+        uint64_t file_bytes = plan->count == 0 ? 0
+            : plan->chunks[plan->count - 1].offset + plan->chunks[plan->count - 1].length;
+        fprintf(stderr, "[loopback] " TRANSFER_MODE_CHUNK_DEDUP ": %zu of %zu chunks held, %.1f%% hit rate, "
+            "%llu bytes not sent\n", held, plan->count, plan->count != 0 ? 100.0 * held / plan->count : 0,
+            (unsigned long long) (file_bytes - plan->wanted_bytes));
+    }
+    if (transfer->is_delta && transfer->base != NULL) {
+        fprintf(stderr, "[loopback] " TRANSFER_MODE_DELTA ": %llu bytes copied from an earlier version of %zu bytes, "
+            "%llu literal bytes, %zu signature bytes sent back\n", (unsigned long long) transfer->copied_bytes,
+            transfer->base_length, (unsigned long long) transfer->literal_bytes, transfer->signature_bytes);
+    } else if (transfer->is_delta) {
+        fprintf(stderr, "[loopback] " TRANSFER_MODE_DELTA ": no earlier version, sent in full\n");
+    }
+    if (transfer->cancel_sent) {
+        fprintf(stderr, "[loopback] cancelled after %zu bytes, %zu more bytes arrived before the transfer ended\n",
+            transfer->bytes_at_cancel, transfer->bytes - transfer->bytes_at_cancel);
+    }
+    fprintf(stderr, "[loopback] transfer %.*s: %zu bytes, %zu wire bytes, %zu lines, %.1f ms, %.1f MB/s, "
+        "first data %.1f ms, %s\n",
+        (int) transfer->metadata_length, transfer->metadata, transfer->bytes, transfer->wire_bytes, transfer->lines,
+        elapsed * 1e3,
+        elapsed > 0 ? transfer->bytes / elapsed / 1e6 : 0,
+        first_data_delay >= 0 ? first_data_delay * 1e3 : -1.0,
+        transfer->failed ? "hash FAILED" : transfer->mismatched ? "contents DIFFER" : late ? "first data LATE"
+            : abort_wrong ? (transfer->aborted ? "unexpectedly ABORTED" : "NOT CANCELLED")
+            : transfer->aborted ? "ABORTED, OK" : "OK");
+
+    loopback->waiting_since = end_time;
+    loopback->transfer_count++;
+    if (!ok) {
+        loopback->failure_count++;
+    }
+    if (ok && !transfer->aborted && transfer->filename != NULL) {
+        keep_version(loopback, transfer->filename, &transfer->contents);
+    }
+    free(transfer->filename);
+    transfer->filename = NULL;
+    free(transfer->contents.data);
+    free(transfer->delta_input.data);
+    free(transfer->metadata);
+    transfer->metadata = NULL;
+    dedup_plan_free(&transfer->plan);
+    free(transfer->chunk_data);
+    transfer->chunk_data = NULL;
+}
+
+/**
+ * Send a line back to the command, which takes a trip up the link and one down.
+ */
+static void send_reply(Loopback *loopback, const char *line, size_t length) {
+    if (byte_queue_length(&loopback->output) == 0) {
+        loopback->output_ready_time = now_seconds() + loopback->upstream.latency + loopback->downstream.latency;
+    }
+    byte_queue_append(&loopback->output, line, length);
+}
+
+/**
+ * Ask the command to stop the transfer it is sending, the way a terminal's cancel button does.
+ */
+static void send_cancel(Loopback *loopback) {
+    Transfer *transfer = &loopback->transfer;
+    transfer->cancel_sent = true;
+    transfer->bytes_at_cancel = transfer->bytes;
+    const char *cancel_line = "#A:\n";
+    send_reply(loopback, cancel_line, strlen(cancel_line));
+}
+
+/**
+ * Take the next part of the file, once the transfer has put it together.
+ */
+static void take_file_bytes(Loopback *loopback, const unsigned char *data, size_t length) {
+    Transfer *transfer = &loopback->transfer;
+    if (loopback->expected != NULL && (transfer->bytes + length > loopback->expected_length ||
+            memcmp(loopback->expected + transfer->bytes, data, length) != 0)) {
+        transfer->mismatched = true;
+    }
+    if (transfer->is_delta) {
+        sha256_hash(&transfer->delta_hash, data, length);
+    }
+    if (transfer->filename != NULL) {
+        byte_queue_append(&transfer->contents, data, length);
+    }
+    transfer->bytes += length;
+    if (loopback->cancel_after_bytes != 0 && !transfer->cancel_sent &&
+            transfer->bytes >= loopback->cancel_after_bytes) {
+        send_cancel(loopback);
+    }
+}
+
+/**
+ * Send the signatures of the earlier version of the file, or say that there is none.
+ */
+static void send_signatures(Loopback *loopback) {
+    Transfer *transfer = &loopback->transfer;
+    EarlierVersion *version = transfer->filename != NULL ? find_version(loopback, transfer->filename) : NULL;
+    if (version != NULL) {
+        transfer->base = version->data;
+        transfer->base_length = version->length;
+    } else if (loopback->default_base != NULL) {
+        transfer->base = loopback->default_base;
+        transfer->base_length = loopback->default_base_length;
+    }
+    if (transfer->base_length == 0) {
+        transfer->base = NULL;
+    }
+    sha256_init(&transfer->delta_hash);
+
+    char line[3 + LOOPBACK_SIGNATURES_PER_LINE * DELTA_SIGNATURE_HEX_LENGTH + 1];
+    transfer->block_size = transfer->base != NULL ? delta_block_size(transfer->base_length) : 0;
+    int length = snprintf(line, sizeof(line), "#S:%u:%zu\n", transfer->block_size, transfer->base_length);
+    send_reply(loopback, line, length);
+    transfer->signature_bytes = length;
+
+    size_t signature_count = 0;
+    for (size_t offset=0; offset<transfer->base_length; offset+=transfer->block_size) {
+        size_t block_length = transfer->base_length - offset < transfer->block_size
+            ? transfer->base_length - offset : transfer->block_size;
+        DeltaSignature signature;
+        delta_block_signature(transfer->base + offset, block_length, &signature);
+        unsigned char weak[4] = { signature.weak >> 24, signature.weak >> 16, signature.weak >> 8, signature.weak };
+        char *hex = line + 3 + signature_count * DELTA_SIGNATURE_HEX_LENGTH;
+        bytes_to_hex(weak, sizeof(weak), hex);
+        bytes_to_hex(signature.strong, DELTA_STRONG_BYTES, hex + 8);
+        signature_count++;
+        if (signature_count == LOOPBACK_SIGNATURES_PER_LINE || offset + block_length == transfer->base_length) {
+            memcpy(line, "#G:", 3);
+            length = 3 + signature_count * DELTA_SIGNATURE_HEX_LENGTH;
+            line[length++] = '\n';
+            send_reply(loopback, line, length);
+            transfer->signature_bytes += length;
+            signature_count = 0;
+        }
+    }
+}
+
+/**
+ * Carry out the instructions of a delta as they arrive.
+ */
+static void take_delta_data(Loopback *loopback, const unsigned char *data, size_t length) {
+    Transfer *transfer = &loopback->transfer;
+    ByteQueue *input = &transfer->delta_input;
+    byte_queue_append(input, data, length);
+    while (!transfer->failed) {
+        DeltaRecord record;
+        long consumed = delta_parse_record((unsigned char *) input->data + input->start, byte_queue_length(input),
+            &record);
+        if (consumed == 0) {
+            break;
+        }
+        if (consumed < 0 || transfer->is_delta_ended) {
+            fprintf(stderr, "[loopback] Malformed delta instruction.\n");
+            transfer->failed = true;
+            break;
+        }
+
+        if (record.type == DELTA_RECORD_COPY) {
+            uint64_t start = (uint64_t) record.first_block * transfer->block_size;
+            uint64_t end = ((uint64_t) record.first_block + record.block_count) * transfer->block_size;
+            if (end > transfer->base_length) {
+                end = end - transfer->base_length < transfer->block_size ? transfer->base_length : 0;
+            }
+            if (end <= start) {
+                fprintf(stderr, "[loopback] Delta copies blocks past the end of the earlier version.\n");
+                transfer->failed = true;
+                break;
+            }
+            take_file_bytes(loopback, transfer->base + start, end - start);
+            transfer->copied_bytes += end - start;
+        } else if (record.type == DELTA_RECORD_LITERAL) {
+            take_file_bytes(loopback, record.literal, record.literal_length);
+            transfer->literal_bytes += record.literal_length;
+        } else {
+            unsigned char digest[SHA256_SIZE_BYTES];
+            sha256_done(&transfer->delta_hash, digest);
+            if (memcmp(digest, record.file_hash, SHA256_SIZE_BYTES) != 0) {
+                fprintf(stderr, "[loopback] The file rebuilt from the delta doesn't match its hash.\n");
+                transfer->failed = true;
+            }
+            transfer->is_delta_ended = true;
+        }
+        byte_queue_consume(input, consumed);
+    }
+}
+
+/**
+ * Take one "C:" or "Q:" line of a chunk offer. The "Q:" line is answered
+ * with the chunks which aren't in the store.
+ */
+static void handle_offer_line(Loopback *loopback, const char *line, size_t length) {
+    Transfer *transfer = &loopback->transfer;
+    const size_t hash_hex_length = SHA256_SIZE_BYTES * 2;
+    unsigned char digest[SHA256_SIZE_BYTES];
+
+    if (line[0] == 'C') {
+        char *end = NULL;
+        unsigned long chunk_length = length > 3 + hash_hex_length && line[2 + hash_hex_length] == ':'
+            ? strtoul(line + 3 + hash_hex_length, &end, 10) : 0;
+        if (end != line + length || chunk_length == 0 || chunk_length > CHUNK_DEDUP_MAX_BYTES ||
+                !hex_to_bytes(line + 2, SHA256_SIZE_BYTES, digest)) {
+            fprintf(stderr, "[loopback] Malformed chunk offer: %.*s\n", (int) (length < 80 ? length : 80), line);
+            transfer->failed = true;
+            return;
+        }
+        dedup_plan_add(&transfer->plan, digest, chunk_length);
+        return;
+    }
+
+    unsigned char list_hash[SHA256_SIZE_BYTES];
+    dedup_plan_list_hash(&transfer->plan, list_hash);
+    if (length != 2 + hash_hex_length || !hex_to_bytes(line + 2, SHA256_SIZE_BYTES, digest) ||
+            memcmp(digest, list_hash, SHA256_SIZE_BYTES) != 0) {
+        fprintf(stderr, "[loopback] The chunk offer's list hash doesn't match.\n");
+        transfer->failed = true;
+    }
+    transfer->is_offer_done = true;
+
+    /* Answer even a bad offer, as the command is waiting for it. */
+    DedupPlan *plan = &transfer->plan;
+    char answer[3 + LOOPBACK_ANSWER_DIGITS + 1];
+    size_t digit_count = 0;
+    for (size_t i=0; i<plan->count; i+=CHUNK_DEDUP_CHUNKS_PER_DIGIT) {
+        int value = 0;
+        for (size_t j=i; j<i+CHUNK_DEDUP_CHUNKS_PER_DIGIT; j++) {
+            value <<= 1;
+            if (j < plan->count && chunk_store_find(&loopback->store, plan->chunks[j].digest) == NULL) {
+                value |= 1;
+            }
+        }
+        answer[3 + digit_count++] = nibble_to_char(value);
+        if (digit_count == LOOPBACK_ANSWER_DIGITS || i + CHUNK_DEDUP_CHUNKS_PER_DIGIT >= plan->count) {
+            memcpy(answer, "#W:", 3);
+            answer[3 + digit_count] = '\n';
+            dedup_plan_take_answer(plan, answer + 3, digit_count);
+            send_reply(loopback, answer, 3 + digit_count + 1);
+            digit_count = 0;
+        }
+    }
+}
+
+/**
+ * Put the file together from the store and the wanted chunks which the data lines carry.
+ *
+ * @param data The next bytes of the wanted chunks, or NULL at the end line.
+ */
+static void take_dedup_data(Loopback *loopback, const unsigned char *data, size_t length) {
+    Transfer *transfer = &loopback->transfer;
+    DedupPlan *plan = &transfer->plan;
+    while (true) {
+        for (; transfer->next_chunk < plan->count && !plan->chunks[transfer->next_chunk].is_wanted;
+                transfer->next_chunk++) {
+            const StoredChunk *stored = chunk_store_find(&loopback->store, plan->chunks[transfer->next_chunk].digest);
+            if (stored == NULL || stored->length != plan->chunks[transfer->next_chunk].length) {
+                fprintf(stderr, "[loopback] Chunk %zu wasn't sent, but isn't in the store.\n", transfer->next_chunk);
+                transfer->failed = true;
+                continue;
+            }
+            take_file_bytes(loopback, stored->data, stored->length);
+        }
+        if (length == 0 || transfer->next_chunk == plan->count) {
+            break;
+        }
+
+        DedupChunk *chunk = &plan->chunks[transfer->next_chunk];
+        if (transfer->chunk_data == NULL) {
+            transfer->chunk_data = malloc(CHUNK_DEDUP_MAX_BYTES);
+        }
+        size_t take = chunk->length - transfer->chunk_fill < length ? chunk->length - transfer->chunk_fill : length;
+        memcpy(transfer->chunk_data + transfer->chunk_fill, data, take);
+        transfer->chunk_fill += take;
+        data += take;
+        length -= take;
+        if (transfer->chunk_fill == chunk->length) {
+            unsigned char digest[SHA256_SIZE_BYTES];
+            sha256(transfer->chunk_data, chunk->length, digest);
+            if (memcmp(digest, chunk->digest, SHA256_SIZE_BYTES) != 0) {
+                fprintf(stderr, "[loopback] Chunk %zu doesn't match its digest.\n", transfer->next_chunk);
+                transfer->failed = true;
+            } else {
+                chunk_store_add(&loopback->store, transfer->chunk_data, chunk->length);
+            }
+            take_file_bytes(loopback, transfer->chunk_data, chunk->length);
+            transfer->chunk_fill = 0;
+            transfer->next_chunk++;
+        }
+    }
+    if (length != 0) {
+        fprintf(stderr, "[loopback] More data arrived than the wanted chunks hold.\n");
+        transfer->failed = true;
+    }
+}
+
+/**
+ * Check one line of a transfer. Returns false once the end line has been seen.
+ */
+static bool handle_transfer_line(Loopback *loopback, char *line, size_t length) {
+    Transfer *transfer = &loopback->transfer;
+    if (length != 0 && line[length-1] == '\r') {
+        length--;
+    }
+    if (length == 0) {
+        return true;
+    }
+    if (length == 2 && memcmp(line, "A:", 2) == 0) {
+        transfer->aborted = true;
+        return false;
+    }
+    if (transfer->is_dedup && !transfer->is_offer_done && (line[0] == 'C' || line[0] == 'Q') && length >= 2 &&
+            line[1] == ':') {
+        handle_offer_line(loopback, line, length);
+        return true;
+    }
+
+    const size_t hash_hex_length = SHA256_SIZE_BYTES * 2;
+    bool is_end = length >= 2 && memcmp(line, "E:", 2) == 0;
+    if (length < 3 + hash_hex_length || !(is_end || memcmp(line, "D:", 2) == 0) || line[length - hash_hex_length - 1] != ':') {
+        fprintf(stderr, "[loopback] Malformed transfer line: %.*s\n", (int) (length < 60 ? length : 60), line);
+        transfer->failed = true;
+        return !is_end;
+    }
+
+    size_t text_length = length - 2 - 1 - hash_hex_length;
+    unsigned char *chunk = malloc(line_decoded_size(transfer->is_base85, text_length) + 1);
+    unsigned int chunk_length = 0;
+    if (line_decode_validate(transfer->is_base85, (unsigned char *) line + 2, text_length, chunk, &chunk_length) != -1) {
+        fprintf(stderr, "[loopback] Invalid %s in transfer line %zu\n", line_encoding_name(transfer->is_base85),
+            transfer->lines + 1);
+        transfer->failed = true;
+    }
+    transfer->base64_wire_bytes += is_end ? length + 1 : 2 + b64e_size(chunk_length) + 1 + hash_hex_length + 1;
+
+    unsigned char line_hash[SHA256_SIZE_BYTES];
+    if (!transfer->is_tree) {
+        chained_hash_update(&transfer->chain, chunk, chunk_length);
+        memcpy(line_hash, transfer->chain.previous_hash, SHA256_SIZE_BYTES);
+    } else if (is_end) {
+        tree_hash_root(&transfer->tree, line_hash);
+    } else {
+        tree_hash_leaf(chunk, chunk_length, line_hash);
+        tree_hash_push(&transfer->tree, line_hash);
+    }
+    char hash_hex[SHA256_SIZE_BYTES * 2 + 1];
+    sha256_hash_to_hex(line_hash, hash_hex);
+    if (memcmp(hash_hex, line + length - hash_hex_length, hash_hex_length) != 0) {
+        if (!transfer->failed) {
+            fprintf(stderr, "[loopback] Hash mismatch on transfer line %zu\n", transfer->lines + 1);
+        }
+        transfer->failed = true;
+    }
+
+    /* The hash covers the packed payload, which is unpacked once it has been checked. */
+    if (transfer->is_packed && !is_end) {
+        long long unpacked_length = lz_block_unpacked_length(chunk, chunk_length);
+        unsigned char *unpacked = malloc(unpacked_length > 0 ? unpacked_length : 1);
+        if (unpacked_length < 0 || !lz_block_unpack(chunk, chunk_length, unpacked)) {
+            fprintf(stderr, "[loopback] Corrupt packed data in transfer line %zu\n", transfer->lines + 1);
+            transfer->failed = true;
+            unpacked_length = 0;
+        }
+        free(chunk);
+        chunk = unpacked;
+        chunk_length = unpacked_length;
+    }
+    transfer->plain_wire_bytes += is_end ? length + 1
+        : 2 + line_encoded_size(transfer->is_base85, chunk_length) + 1 + hash_hex_length + 1;
+
+    if (transfer->is_dedup && !transfer->is_offer_done) {
+        fprintf(stderr, "[loopback] Transfer line %zu came before the end of the chunk offer.\n", transfer->lines + 1);
+        transfer->failed = true;
+    }
+    if (!is_end) {
+        if (transfer->first_data_time == 0) {
+            transfer->first_data_time = now_seconds() + loopback->upstream.latency;
+        }
+        transfer->lines++;
+        if (transfer->is_dedup) {
+            take_dedup_data(loopback, chunk, chunk_length);
+        } else if (transfer->base != NULL) {
+            take_delta_data(loopback, chunk, chunk_length);
+        } else {
+            take_file_bytes(loopback, chunk, chunk_length);
+        }
+    } else {
+        if (transfer->is_dedup) {
+            take_dedup_data(loopback, NULL, 0);
+            if (transfer->next_chunk != transfer->plan.count) {
+                fprintf(stderr, "[loopback] The data lines ended before the last wanted chunk.\n");
+                transfer->failed = true;
+            }
+        }
+        if (transfer->base != NULL && (!transfer->is_delta_ended || byte_queue_length(&transfer->delta_input) != 0)) {
+            fprintf(stderr, "[loopback] The delta didn't end with its hash.\n");
+            transfer->failed = true;
+        }
+        if (loopback->expected != NULL && transfer->bytes != loopback->expected_length) {
+            transfer->mismatched = true;
+        }
+    }
+    free(chunk);
+    return !is_end;
+}
+
+/**
+ * @param chain Hash chain of the frame, which always covers the metadata line.
+ *          That line is also always base64.
+ * @param tree Hash tree of the frame's other lines, or NULL to chain them too.
+ */
+static void append_frame_line(Loopback *loopback, const char *prefix, const unsigned char *data, size_t length,
+        ChainedHash *chain, TreeHash *tree) {
+
+    ByteQueue *output = &loopback->output;
+    unsigned char *packed = NULL;
+    if (loopback->is_frame_packed && strcmp(prefix, "#D:") == 0) {
+        packed = malloc(LZ_BLOCK_PACKED_BOUND(length));
+        length = lz_block_pack(data, length, true, packed);
+        data = packed;
+    }
+    unsigned char line_hash[SHA256_SIZE_BYTES];
+    if (tree == NULL) {
+        chained_hash_update(chain, data, length);
+        memcpy(line_hash, chain->previous_hash, SHA256_SIZE_BYTES);
+    } else if (strcmp(prefix, "#D:") == 0) {
+        tree_hash_leaf(data, length, line_hash);
+        tree_hash_push(tree, line_hash);
+    } else {
+        tree_hash_root(tree, line_hash);
+    }
+
+    bool is_base85 = loopback->is_frame_base85 && strcmp(prefix, "#M:") != 0;
+    char *text = malloc(line_encoded_size(is_base85, length) + 1);
+    size_t text_length = line_encode(is_base85, data, length, (unsigned char *) text);
+    char hash_hex[LOOPBACK_FRAME_HASH_LENGTH];
+    bytes_to_hex(line_hash, LOOPBACK_FRAME_HASH_LENGTH / 2, hash_hex);
+
+    byte_queue_append(output, prefix, strlen(prefix));
+    byte_queue_append(output, text, text_length);
+    byte_queue_append(output, ":", 1);
+    byte_queue_append(output, hash_hex, LOOPBACK_FRAME_HASH_LENGTH);
+    byte_queue_append(output, "\n", 1);
+    free(text);
+    free(packed);
+}
+
+/**
+ * Answer a request from `from` with the frame file.
+ */
+static void answer_frame_request(Loopback *loopback, const char *frame_name) {
+    loopback->frame_request_count++;
+    loopback->frame_request_time = now_seconds() - loopback->upstream.latency;
+    if (byte_queue_length(&loopback->output) == 0) {
+        /* The request took a trip up the link and the answer takes one down. */
+        loopback->output_ready_time = now_seconds() + loopback->upstream.latency + loopback->downstream.latency;
+    }
+
+    ChainedHash chain;
+    chained_hash_init(&chain);
+    TreeHash tree;
+    tree_hash_init(&tree);
+
+    if (loopback->frame == NULL) {
+        fprintf(stderr, "[loopback] Frame '%s' requested, but there is no frame to send.\n", frame_name);
+        const char *metadata = "{}";
+        append_frame_line(loopback, "#M:", (const unsigned char *) metadata, strlen(metadata), &chain, NULL);
+        append_frame_line(loopback, "#A:", NULL, 0, &chain, NULL);
+        return;
+    }
+
+    char metadata[256];
+    int metadata_length = snprintf(metadata, sizeof(metadata),
+        "{\"filename\":\"frame-%s.bin\",\"mimeType\":\"application/octet-stream\",\"filesize\":%zu%s%s%s}",
+        frame_name, loopback->frame_length,
+        loopback->is_frame_packed ? ",\"contentEncoding\":\"" CONTENT_ENCODING_LZ4_BLOCK "\"" : "",
+        loopback->is_frame_tree ? ",\"integrity\":\"" INTEGRITY_TREE_SHA256 "\"" : "",
+        loopback->is_frame_base85 ? ",\"lineEncoding\":\"" LINE_ENCODING_BASE85 "\"" : "");
+    append_frame_line(loopback, "#M:", (unsigned char *) metadata, metadata_length, &chain, NULL);
+
+    TreeHash *data_tree = loopback->is_frame_tree ? &tree : NULL;
+    for (size_t offset=0; offset<loopback->frame_length; offset+=loopback->frame_chunk_bytes) {
+        size_t length = loopback->frame_length - offset;
+        if (length > loopback->frame_chunk_bytes) {
+            length = loopback->frame_chunk_bytes;
+        }
+        append_frame_line(loopback, "#D:", loopback->frame + offset, length, &chain, data_tree);
+    }
+    append_frame_line(loopback, "#E:", NULL, 0, &chain, data_tree);
+    loopback->frame_wire_bytes = byte_queue_length(&loopback->output);
+}
+
+static void report_frame_sent(Loopback *loopback) {
+    /* Measured from when the request left the command until the last line reaches it. */
+    double elapsed = now_seconds() + loopback->downstream.latency - loopback->frame_request_time;
+    fprintf(stderr, "[loopback] frame: %zu bytes, %zu wire bytes%s%s%s, %.1f ms, %.1f MB/s\n", loopback->frame_length,
+        loopback->frame_wire_bytes, loopback->is_frame_packed ? " (" CONTENT_ENCODING_LZ4_BLOCK ")" : "",
+        loopback->is_frame_tree ? " (" INTEGRITY_TREE_SHA256 ")" : "",
+        loopback->is_frame_base85 ? " (" LINE_ENCODING_BASE85 ")" : "",
+        elapsed * 1e3, elapsed > 0 ? loopback->frame_length / elapsed / 1e6 : 0);
+}
+
+/**
+ * Parse what the command has written so far.
+ */
+static void process_input(Loopback *loopback) {
+    ByteQueue *input = &loopback->input;
+    size_t cookie_length = strlen(loopback->cookie);
+
+    while (byte_queue_length(input) != 0) {
+        char *data = input->data + input->start;
+        size_t length = byte_queue_length(input);
+
+        switch (loopback->state) {
+            case PARSE_TEXT: {
+                char *escape = memchr(data, '\x1b', length);
+                size_t text_length = escape != NULL ? (size_t) (escape - data) : length;
+                if (text_length != 0) {
+                    if (!loopback->quiet) {
+                        write_fully(STDOUT_FILENO, data, text_length);
+                    }
+                    byte_queue_consume(input, text_length);
+                    continue;
+                }
+
+                /* An escape sequence. Wait for all of its header. */
+                char *bell = memchr(data, '\x07', length);
+                if (length < 2 || data[1] != '&' ||
+                        (length >= 2 + cookie_length && memcmp(data + 2, loopback->cookie, cookie_length) != 0)) {
+                    if (!loopback->quiet) {
+                        write_fully(STDOUT_FILENO, data, 1);
+                    }
+                    byte_queue_consume(input, 1);
+                    continue;
+                }
+                if (bell == NULL) {
+                    return;
+                }
+
+                const char *command = data + 2 + cookie_length;
+                size_t header_length = bell + 1 - data;
+                if (strncmp(command, ";5;", 3) == 0) {
+                    Transfer *transfer = &loopback->transfer;
+                    memset(transfer, 0, sizeof(*transfer));
+                    transfer->metadata_length = strtoul(command + 3, NULL, 10);
+                    transfer->start_time = now_seconds() + loopback->upstream.latency;
+                    chained_hash_init(&transfer->chain);
+                    tree_hash_init(&transfer->tree);
+                    loopback->state = PARSE_TRANSFER_METADATA;
+                } else if (strncmp(command, ";4\x07", 3) == 0 || strncmp(command, ";4;", 3) == 0) {
+                    /* The request may list the content encodings, integrity modes and line encodings
+                       which the command can cope with. */
+                    char *accepted = command[2] == ';' ? strndup(command + 3, bell - command - 3) : NULL;
+                    loopback->is_frame_packed = list_contains(accepted, CONTENT_ENCODING_LZ4_BLOCK) &&
+                        list_contains(loopback->content_encodings, CONTENT_ENCODING_LZ4_BLOCK);
+                    loopback->is_frame_tree = list_contains(accepted, INTEGRITY_TREE_SHA256) &&
+                        list_contains(loopback->integrity_modes, INTEGRITY_TREE_SHA256);
+                    loopback->is_frame_base85 = list_contains(accepted, LINE_ENCODING_BASE85) &&
+                        list_contains(loopback->line_encodings, LINE_ENCODING_BASE85);
+                    free(accepted);
+                    loopback->state = PARSE_FRAME_NAME;
+                } else {
+                    fprintf(stderr, "[loopback] Unknown command: %.*s\n", (int) (bell - command), command);
+                }
+                byte_queue_consume(input, header_length);
+                break;
+            }
+
+            case PARSE_TRANSFER_METADATA: {
+                Transfer *transfer = &loopback->transfer;
+                if (length < transfer->metadata_length) {
+                    return;
+                }
+                transfer->metadata = strndup(data, transfer->metadata_length);
+                byte_queue_consume(input, transfer->metadata_length);
+
+                char *encoding = strstr(transfer->metadata, "\"contentEncoding\":");
+                if (encoding != NULL) {
+                    transfer->is_packed = strncmp(encoding + strlen("\"contentEncoding\":"),
+                        "\"" CONTENT_ENCODING_LZ4_BLOCK "\"", strlen(CONTENT_ENCODING_LZ4_BLOCK) + 2) == 0 &&
+                        list_contains(loopback->content_encodings, CONTENT_ENCODING_LZ4_BLOCK);
+                    if (!transfer->is_packed) {
+                        fprintf(stderr, "[loopback] Transfer uses a content encoding which wasn't offered.\n");
+                        transfer->failed = true;
+                    }
+                }
+                char *integrity = strstr(transfer->metadata, "\"integrity\":");
+                if (integrity != NULL) {
+                    transfer->is_tree = strncmp(integrity + strlen("\"integrity\":"),
+                        "\"" INTEGRITY_TREE_SHA256 "\"", strlen(INTEGRITY_TREE_SHA256) + 2) == 0 &&
+                        list_contains(loopback->integrity_modes, INTEGRITY_TREE_SHA256);
+                    if (!transfer->is_tree) {
+                        fprintf(stderr, "[loopback] Transfer uses an integrity mode which wasn't offered.\n");
+                        transfer->failed = true;
+                    }
+                }
+                char *line_encoding = strstr(transfer->metadata, "\"lineEncoding\":");
+                if (line_encoding != NULL) {
+                    transfer->is_base85 = strncmp(line_encoding + strlen("\"lineEncoding\":"),
+                        "\"" LINE_ENCODING_BASE85 "\"", strlen(LINE_ENCODING_BASE85) + 2) == 0 &&
+                        list_contains(loopback->line_encodings, LINE_ENCODING_BASE85);
+                    if (!transfer->is_base85) {
+                        fprintf(stderr, "[loopback] Transfer uses a line encoding which wasn't offered.\n");
+                        transfer->failed = true;
+                    }
+                }
+                char *transfer_mode = strstr(transfer->metadata, "\"transferMode\":");
+                if (transfer_mode != NULL) {
+                    const char *value = transfer_mode + strlen("\"transferMode\":");
+                    transfer->is_dedup = strncmp(value, "\"" TRANSFER_MODE_CHUNK_DEDUP "\"",
+                        strlen(TRANSFER_MODE_CHUNK_DEDUP) + 2) == 0 &&
+                        list_contains(loopback->transfer_modes, TRANSFER_MODE_CHUNK_DEDUP);
+                    transfer->is_delta = strncmp(value, "\"" TRANSFER_MODE_DELTA "\"",
+                        strlen(TRANSFER_MODE_DELTA) + 2) == 0 &&
+                        list_contains(loopback->transfer_modes, TRANSFER_MODE_DELTA);
+                    if (!transfer->is_dedup && !transfer->is_delta) {
+                        fprintf(stderr, "[loopback] Transfer uses a transfer mode which wasn't offered.\n");
+                        transfer->failed = true;
+                    }
+                }
+                /* Every file received is kept as the earlier version for the next delta. */
+                if (list_contains(loopback->transfer_modes, TRANSFER_MODE_DELTA)) {
+                    transfer->filename = metadata_filename(transfer->metadata);
+                }
+                if (transfer->is_delta) {
+                    send_signatures(loopback);
+                }
+                loopback->state = PARSE_TRANSFER_LINES;
+                break;
+            }
+
+            case PARSE_TRANSFER_LINES: {
+                char *newline = memchr(data, '\n', length);
+                if (newline == NULL) {
+                    return;
+                }
+                bool more = handle_transfer_line(loopback, data, newline - data);
+                loopback->transfer.wire_bytes += newline + 1 - data;
+                byte_queue_consume(input, newline + 1 - data);
+                if (!more) {
+                    loopback->state = PARSE_TRANSFER_TERMINATOR;
+                }
+                break;
+            }
+
+            case PARSE_TRANSFER_TERMINATOR:
+                if (data[0] != '\0') {
+                    fprintf(stderr, "[loopback] Transfer wasn't terminated by a NUL.\n");
+                    loopback->transfer.failed = true;
+                } else {
+                    byte_queue_consume(input, 1);
+                }
+                report_transfer(loopback);
+                loopback->state = PARSE_TEXT;
+                break;
+
+            case PARSE_FRAME_NAME: {
+                char *nul = memchr(data, '\0', length);
+                if (nul == NULL) {
+                    return;
+                }
+                answer_frame_request(loopback, data);
+                byte_queue_consume(input, nul + 1 - data);
+                loopback->state = PARSE_TEXT;
+                break;
+            }
+        }
+    }
+}
+
+static bool read_whole_file(const char *filename, unsigned char **data, size_t *length) {
+    FILE *fhandle = fopen(filename, "rb");
+    if (fhandle == NULL) {
+        fprintf(stderr, "[Error] Unable to open file '%s'. %s\n", filename, strerror(errno));
+        return false;
+    }
+    fseek(fhandle, 0, SEEK_END);
+    *length = ftell(fhandle);
+    fseek(fhandle, 0, SEEK_SET);
+    *data = malloc(*length + 1);
+    bool ok = fread(*data, 1, *length, fhandle) == *length;
+    fclose(fhandle);
+    if (!ok) {
+        fprintf(stderr, "[Error] Unable to read file '%s'.\n", filename);
+    }
+    return ok;
+}
+
+static pid_t spawn_on_pty(int master_fd, int parent_slave_fd, char **command) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    close(parent_slave_fd);
+    setsid();
+    int slave_fd = open(ptsname(master_fd), O_RDWR);
+    if (slave_fd == -1) {
+        perror("[Error] Unable to open the pty slave");
+        _exit(127);
+    }
+    ioctl(slave_fd, TIOCSCTTY, 0);
+    dup2(slave_fd, STDIN_FILENO);
+    dup2(slave_fd, STDOUT_FILENO);
+    dup2(slave_fd, STDERR_FILENO);
+    if (slave_fd > STDERR_FILENO) {
+        close(slave_fd);
+    }
+    close(master_fd);
+
+    setenv("LC_EXTRATERM_COOKIE", LOOPBACK_COOKIE, 1);
+    execvp(command[0], command);
+    fprintf(stderr, "[Error] Unable to run '%s'. %s\n", command[0], strerror(errno));
+    _exit(127);
+}
+
+/**
+ * Shuttle bytes between us and the command until it exits and all of its output has been read.
+ */
+static int run_loopback(Loopback *loopback, int master_fd, pid_t pid) {
+    char buffer[LOOPBACK_READ_SIZE];
+    bool master_open = true;
+    int status = 0;
+    bool exited = false;
+
+    while (master_open) {
+        if (!exited && waitpid(pid, &status, WNOHANG) == pid) {
+            exited = true;
+        }
+
+        struct pollfd pfd = { .fd = master_fd, .events = 0 };
+        int timeout = 100;
+
+        size_t readable = link_allowance(&loopback->upstream, sizeof(buffer));
+        if (readable != 0) {
+            pfd.events |= POLLIN;
+        } else {
+            timeout = link_wait_ms(&loopback->upstream);
+        }
+
+        size_t pending = byte_queue_length(&loopback->output);
+        if (pending != 0) {
+            double wait = loopback->output_ready_time - now_seconds();
+            size_t writable = link_allowance(&loopback->downstream, pending);
+            if (wait > 0) {
+                int wait_ms = (int) (wait * 1000) + 1;
+                timeout = wait_ms < timeout ? wait_ms : timeout;
+            } else if (writable != 0) {
+                pfd.events |= POLLOUT;
+            } else {
+                int wait_ms = link_wait_ms(&loopback->downstream);
+                timeout = wait_ms < timeout ? wait_ms : timeout;
+            }
+        }
+
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[Error] poll");
+            break;
+        }
+
+        /* Nothing more can arrive once the command is gone and the pty is empty. */
+        if (exited && (pfd.events & POLLIN) && !(pfd.revents & POLLIN)) {
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            size_t writable = link_allowance(&loopback->downstream, byte_queue_length(&loopback->output));
+            ssize_t count = write(master_fd, loopback->output.data + loopback->output.start, writable);
+            if (count > 0) {
+                link_consume(&loopback->downstream, count);
+                byte_queue_consume(&loopback->output, count);
+                if (byte_queue_length(&loopback->output) == 0 && loopback->frame != NULL) {
+                    report_frame_sent(loopback);
+                }
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t count = read(master_fd, buffer, readable != 0 ? readable : 1);
+            if (count > 0) {
+                link_consume(&loopback->upstream, count);
+                byte_queue_append(&loopback->input, buffer, count);
+                process_input(loopback);
+            } else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+                master_open = false;
+            }
+        }
+    }
+
+    if (!exited) {
+        waitpid(pid, &status, 0);
+    }
+    if (loopback->state != PARSE_TEXT && loopback->state != PARSE_FRAME_NAME) {
+        fprintf(stderr, "[loopback] The command exited in the middle of a transfer.\n");
+        loopback->failure_count++;
+    }
+
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "[loopback] The command was killed by signal %d.\n", WTERMSIG(status));
+        return EXIT_FAILURE;
+    }
+    if (WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[loopback] The command exited with status %d.\n", WEXITSTATUS(status));
+        return WEXITSTATUS(status);
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    char **command = NULL;
+    char *bandwidth = NULL;
+    char *latency = NULL;
+    char *expect_filename = NULL;
+    char *frame_filename = NULL;
+    char *frame_chunk = NULL;
+    char *first_data_within = NULL;
+    char *max_chunk = NULL;
+    char *cancel_after = NULL;
+    char *content_encodings = NULL;
+    char *integrity_modes = NULL;
+    char *line_encodings = NULL;
+    char *transfer_modes = NULL;
+    char *chunk_store_filename = NULL;
+    char *delta_base_filename = NULL;
+    int quiet_flag = 0;
+    int help_flag = 0;
+
+    adopt_spec opt_specs[] = {
+        { .type=ADOPT_TYPE_SWITCH, .name="help", .alias='h', .value=&help_flag, .switch_value=1, .help="show this help message and exit" },
+        { .type=ADOPT_TYPE_VALUE, .name="bandwidth", .alias='b', .value=&bandwidth, .help="link bandwidth in bytes per second (default: unlimited)" },
+        { .type=ADOPT_TYPE_VALUE, .name="latency", .alias='l', .value=&latency, .help="one way link latency in milliseconds (default: 0)" },
+        { .type=ADOPT_TYPE_VALUE, .name="expect", .alias='e', .value=&expect_filename, .help="file which transfers from the command must match" },
+        { .type=ADOPT_TYPE_VALUE, .name="frame", .alias='f', .value=&frame_filename, .help="file to send in answer to frame requests" },
+        { .type=ADOPT_TYPE_VALUE, .name="frame-chunk", .value=&frame_chunk, .help="bytes per line when sending a frame (default: 3072)" },
+        { .type=ADOPT_TYPE_VALUE, .name="cancel-after", .value=&cancel_after, .help="cancel transfers after this many bytes, and fail those which aren't aborted" },
+        { .type=ADOPT_TYPE_VALUE, .name="max-chunk", .value=&max_chunk, .help="largest data chunk to advertise to the command (default: 1048576)" },
+        { .type=ADOPT_TYPE_VALUE, .name="content-encodings", .value=&content_encodings, .help="content encodings to advertise to the command, comma separated (default: none)" },
+        { .type=ADOPT_TYPE_VALUE, .name="integrity", .value=&integrity_modes, .help="integrity modes to advertise to the command, comma separated (default: none)" },
+        { .type=ADOPT_TYPE_VALUE, .name="line-encodings", .value=&line_encodings, .help="line encodings to advertise to the command, comma separated (default: none)" },
+        { .type=ADOPT_TYPE_VALUE, .name="transfer-modes", .value=&transfer_modes, .help="transfer modes to advertise to the command, comma separated (default: none)" },
+        { .type=ADOPT_TYPE_VALUE, .name="chunk-store", .value=&chunk_store_filename, .help="file whose chunks the terminal holds from the start, for chunk-dedup" },
+        { .type=ADOPT_TYPE_VALUE, .name="delta-base", .value=&delta_base_filename, .help="file the terminal holds as the earlier version of every file it hasn't received yet, for delta" },
+        { .type=ADOPT_TYPE_VALUE, .name="first-data-within", .value=&first_data_within, .help="fail transfers whose first data takes longer than this many milliseconds" },
+        { .type=ADOPT_TYPE_SWITCH, .name="quiet", .alias='q', .value=&quiet_flag, .switch_value=1, .help="don't pass through the command's other output" },
+        { .type=ADOPT_TYPE_LITERAL },
+        { .type=ADOPT_TYPE_ARGS, .value=&command, .value_name="command", .help="command to run, and its arguments" },
+        { 0 },
+    };
+
+    adopt_opt result;
+    if (adopt_parse(&result, opt_specs, argv + 1, argc - 1, ADOPT_PARSE_DEFAULT) != 0) {
+        adopt_status_fprint(stderr, argv[0], &result);
+        adopt_usage_fprint(stderr, argv[0], opt_specs);
+        return EXIT_FAILURE;
+    }
+    if (help_flag || command == NULL || result.args_len == 0) {
+        adopt_usage_fprint(stderr, argv[0], opt_specs);
+        return help_flag ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* The ARGS array isn't NULL terminated. */
+    char **command_argv = calloc(result.args_len + 1, sizeof(char *));
+    memcpy(command_argv, command, result.args_len * sizeof(char *));
+
+    Loopback loopback = {0};
+    loopback.cookie = LOOPBACK_COOKIE;
+    loopback.quiet = quiet_flag;
+    loopback.content_encodings = content_encodings;
+    loopback.integrity_modes = integrity_modes;
+    loopback.line_encodings = line_encodings;
+    loopback.transfer_modes = transfer_modes;
+    loopback.state = PARSE_TEXT;
+    loopback.frame_chunk_bytes = frame_chunk != NULL ? strtoul(frame_chunk, NULL, 10) : LOOPBACK_FRAME_CHUNK_BYTES;
+    if (loopback.frame_chunk_bytes == 0) {
+        loopback.frame_chunk_bytes = LOOPBACK_FRAME_CHUNK_BYTES;
+    }
+    loopback.cancel_after_bytes = cancel_after != NULL ? strtoull(cancel_after, NULL, 10) : 0;
+    loopback.first_data_limit = first_data_within != NULL ? strtod(first_data_within, NULL) / 1000 : 0;
+    link_init(&loopback.upstream, bandwidth != NULL ? strtod(bandwidth, NULL) : 0,
+        latency != NULL ? strtod(latency, NULL) / 1000 : 0);
+    link_init(&loopback.downstream, loopback.upstream.bytes_per_second, loopback.upstream.latency);
+
+    if (expect_filename != NULL && !read_whole_file(expect_filename, &loopback.expected, &loopback.expected_length)) {
+        return EXIT_FAILURE;
+    }
+    if (frame_filename != NULL && !read_whole_file(frame_filename, &loopback.frame, &loopback.frame_length)) {
+        return EXIT_FAILURE;
+    }
+    if (delta_base_filename != NULL &&
+            !read_whole_file(delta_base_filename, &loopback.default_base, &loopback.default_base_length)) {
+        return EXIT_FAILURE;
+    }
+    if (chunk_store_filename != NULL) {
+        unsigned char *data;
+        size_t length;
+        if (!read_whole_file(chunk_store_filename, &data, &length)) {
+            return EXIT_FAILURE;
+        }
+        for (size_t offset=0; offset<length; ) {
+            size_t chunk_length = chunk_dedup_cut(data + offset, length - offset);
+            chunk_store_add(&loopback.store, data + offset, chunk_length);
+            offset += chunk_length;
+        }
+        free(data);
+    }
+
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+        perror("[Error] Unable to create a pty");
+        return EXIT_FAILURE;
+    }
+
+    /* Hold the slave open ourselves. Otherwise Linux throws away whatever the
+       command wrote but we haven't read yet, as soon as the command exits. */
+    int slave_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY);
+    if (slave_fd == -1) {
+        perror("[Error] Unable to open the pty slave");
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    setenv("LC_EXTRATERM_MAX_CHUNK", max_chunk != NULL ? max_chunk : LOOPBACK_MAX_CHUNK, 1);
+    if (content_encodings != NULL) {
+        setenv("LC_EXTRATERM_CONTENT_ENCODINGS", content_encodings, 1);
+    } else {
+        unsetenv("LC_EXTRATERM_CONTENT_ENCODINGS");
+    }
+    if (integrity_modes != NULL) {
+        setenv("LC_EXTRATERM_INTEGRITY", integrity_modes, 1);
+    } else {
+        unsetenv("LC_EXTRATERM_INTEGRITY");
+    }
+    if (line_encodings != NULL) {
+        setenv("LC_EXTRATERM_LINE_ENCODINGS", line_encodings, 1);
+    } else {
+        unsetenv("LC_EXTRATERM_LINE_ENCODINGS");
+    }
+    if (transfer_modes != NULL) {
+        setenv("LC_EXTRATERM_TRANSFER_MODES", transfer_modes, 1);
+    } else {
+        unsetenv("LC_EXTRATERM_TRANSFER_MODES");
+    }
+    loopback.waiting_since = now_seconds();
+    pid_t pid = spawn_on_pty(master_fd, slave_fd, command_argv);
+    fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+    int rc = run_loopback(&loopback, master_fd, pid);
+    close(slave_fd);
+    close(master_fd);
+
+    if (expect_filename != NULL && loopback.transfer_count == 0) {
+        fprintf(stderr, "[loopback] Expected a transfer, but none arrived.\n");
+        loopback.failure_count++;
+    }
+    if (rc == EXIT_SUCCESS && loopback.failure_count != 0) {
+        rc = EXIT_FAILURE;
+    }
+
+    free(loopback.input.data);
+    free(loopback.output.data);
+    free(loopback.expected);
+    free(loopback.frame);
+    chunk_store_free(&loopback.store);
+    for (size_t i=0; i<loopback.version_count; i++) {
+        free(loopback.versions[i].filename);
+        free(loopback.versions[i].data);
+    }
+    free(loopback.versions);
+    free(loopback.default_base);
+    free(command_argv);
+    return rc;
+}
@@ -0,0 +1,293 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Compression of file transfer chunks, the "lz4-block" content encoding.
+ *
+ * Each chunk is packed on its own as its decoded length, 4 bytes little
+ * endian, followed by a block in the LZ4 block format, which any LZ4 block
+ * decoder can unpack. As in the LZ4 frame format, a set top bit in the
+ * length means that the chunk follows as it is instead, which is how data
+ * that doesn't compress gets through at the cost of only 4 bytes.
+ *
+ * The compressor here is a plain greedy one with a small hash table: it
+ * goes for speed over ratio, as its output still has to squeeze through a
+ * terminal.
+ *
+ * Chunks must be smaller than 2GB.
+ */
+
+#define CONTENT_ENCODING_LZ4_BLOCK "lz4-block"
+
+#define LZ_BLOCK_HASH_BITS 12
+#define LZ_BLOCK_MIN_MATCH 4
+#define LZ_BLOCK_MAX_OFFSET 65535
+/* The format requires the last 5 bytes to be literals, and the last match to start 12 bytes before the end. */
+#define LZ_BLOCK_LAST_LITERALS 5
+#define LZ_BLOCK_MATCH_FIND_LIMIT 12
+
+#define LZ_BLOCK_PREFIX_BYTES 4
+#define LZ_BLOCK_STORED_FLAG 0x80000000u
+/* Largest packed size of a chunk of `length` bytes. */
+#define LZ_BLOCK_PACKED_BOUND(length) (LZ_BLOCK_PREFIX_BYTES + (length) + (length) / 255 + 16)
+
+/* Chunks whose bytes look more random than this, in bits per byte, aren't worth compressing. */
+#define LZ_BLOCK_MAX_ENTROPY_BITS 7.5
+
+static uint32_t lz_block_read_u32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_block_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_BLOCK_HASH_BITS);
+}
+
+static unsigned char *lz_block_put_length(unsigned char *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/**
+ * Write one sequence, some literals followed by a match.
+ *
+ * @param match_length 0 for the last sequence, which has only literals.
+ */
+static unsigned char *lz_block_put_sequence(unsigned char *op, const unsigned char *literals, size_t literal_length,
+        size_t offset, size_t match_length) {
+
+    unsigned char *token = op++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        op = lz_block_put_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t code = match_length - LZ_BLOCK_MIN_MATCH;
+    *token |= code < 15 ? code : 15;
+    if (code >= 15) {
+        op = lz_block_put_length(op, code - 15);
+    }
+    return op;
+}
+
+static size_t lz_block_compress(const unsigned char *src, size_t length, unsigned char *dst) {
+    uint32_t table[1 << LZ_BLOCK_HASH_BITS] = {0};
+    unsigned char *op = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+    size_t match_limit = length - LZ_BLOCK_LAST_LITERALS;
+
+    while (i + LZ_BLOCK_MATCH_FIND_LIMIT < length) {
+        uint32_t sequence = lz_block_read_u32(src + i);
+        uint32_t *entry = &table[lz_block_hash(sequence)];
+        size_t candidate = *entry;
+        *entry = i;
+
+        if (candidate >= i || i - candidate > LZ_BLOCK_MAX_OFFSET || lz_block_read_u32(src + candidate) != sequence) {
+            /* Skip ahead faster the longer nothing has matched, so incompressible data goes by quickly. */
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        while (i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1]) {
+            i--;
+            candidate--;
+        }
+        size_t match_end = i + LZ_BLOCK_MIN_MATCH;
+        while (match_end < match_limit && src[match_end] == src[candidate + match_end - i]) {
+            match_end++;
+        }
+
+        op = lz_block_put_sequence(op, src + anchor, i - anchor, i - candidate, match_end - i);
+        table[lz_block_hash(lz_block_read_u32(src + match_end - 2))] = match_end - 2;
+        i = anchor = match_end;
+    }
+    return lz_block_put_sequence(op, src + anchor, length - anchor, 0, 0) - dst;
+}
+
+static void lz_block_put_prefix(unsigned char *dst, uint32_t prefix) {
+    for (int i=0; i<LZ_BLOCK_PREFIX_BYTES; i++) {
+        dst[i] = prefix >> (8 * i);
+    }
+}
+
+/**
+ * Pack a chunk.
+ *
+ * @param compress false to store the chunk as it is, for data that isn't
+ *          worth trying to compress. Chunks which don't get smaller are
+ *          stored anyway.
+ * @param dst Receives the packed chunk, must hold LZ_BLOCK_PACKED_BOUND(length) bytes.
+ * @return the packed length.
+ */
+size_t lz_block_pack(const unsigned char *src, size_t length, bool compress, unsigned char *dst) {
+    if (compress) {
+        size_t block_length = lz_block_compress(src, length, dst + LZ_BLOCK_PREFIX_BYTES);
+        if (block_length < length) {
+            lz_block_put_prefix(dst, length);
+            return LZ_BLOCK_PREFIX_BYTES + block_length;
+        }
+    }
+    lz_block_put_prefix(dst, length | LZ_BLOCK_STORED_FLAG);
+    memcpy(dst + LZ_BLOCK_PREFIX_BYTES, src, length);
+    return LZ_BLOCK_PREFIX_BYTES + length;
+}
+
+/**
+ * Read the decoded length from the front of a packed chunk.
+ *
+ * @return the length, or -1 if the chunk is too short to hold one or its
+ *          block could never decode to that much.
+ */
+long long lz_block_unpacked_length(const unsigned char *src, size_t length) {
+    if (length < LZ_BLOCK_PREFIX_BYTES) {
+        return -1;
+    }
+    uint32_t prefix = 0;
+    for (int i=0; i<LZ_BLOCK_PREFIX_BYTES; i++) {
+        prefix |= (uint32_t) src[i] << (8 * i);
+    }
+    size_t block_length = length - LZ_BLOCK_PREFIX_BYTES;
+    if (prefix & LZ_BLOCK_STORED_FLAG) {
+        return (prefix & ~LZ_BLOCK_STORED_FLAG) == block_length ? (long long) block_length : -1;
+    }
+    /* No byte of a block decodes to more than 255 bytes. */
+    if (prefix > (unsigned long long) block_length * 255) {
+        return -1;
+    }
+    return prefix;
+}
+
+static bool lz_block_get_length(const unsigned char **ip, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * Unpack a chunk. Corrupt input is caught and never writes outside `dst`.
+ *
+ * @param dst Receives the chunk, must hold lz_block_unpacked_length() bytes.
+ * @return false if the packed chunk is corrupt.
+ */
+bool lz_block_unpack(const unsigned char *src, size_t length, unsigned char *dst) {
+    long long capacity = lz_block_unpacked_length(src, length);
+    if (capacity < 0) {
+        return false;
+    }
+    if (src[LZ_BLOCK_PREFIX_BYTES - 1] & (LZ_BLOCK_STORED_FLAG >> 24)) {
+        memcpy(dst, src + LZ_BLOCK_PREFIX_BYTES, capacity);
+        return true;
+    }
+
+    const unsigned char *ip = src + LZ_BLOCK_PREFIX_BYTES;
+    const unsigned char *end = src + length;
+    size_t out = 0;
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !lz_block_get_length(&ip, end, &literal_length)) {
+            return false;
+        }
+        if (literal_length > (size_t) (end - ip) || literal_length > capacity - out) {
+            return false;
+        }
+        memcpy(dst + out, ip, literal_length);
+        ip += literal_length;
+        out += literal_length;
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !lz_block_get_length(&ip, end, &match_length)) {
+            return false;
+        }
+        match_length += LZ_BLOCK_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > capacity - out) {
+            return false;
+        }
+
+        unsigned char *op = dst + out;
+        const unsigned char *match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+        } else {
+            /* Overlapping, which repeats the last `offset` bytes. */
+            for (size_t i=0; i<match_length; i++) {
+                op[i] = match[i];
+            }
+        }
+        out += match_length;
+    }
+    return out == (size_t) capacity;
+}
+
+/**
+ * log2() to within about 0.005, without needing libm.
+ */
+static double lz_block_log2(double x) {
+    union { double d; uint64_t u; } value = { x };
+    int exponent = (int) ((value.u >> 52) & 0x7ff) - 1023;
+    value.u = (value.u & ~(0x7ffULL << 52)) | (1023ULL << 52);
+    double m = value.d;
+    return exponent + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+/**
+ * Order-0 entropy of some bytes, in bits per byte.
+ */
+double byte_entropy_bits(const unsigned char *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    size_t counts[256] = {0};
+    for (size_t i=0; i<length; i++) {
+        counts[data[i]]++;
+    }
+    double sum = 0;
+    for (int i=0; i<256; i++) {
+        if (counts[i] != 0) {
+            sum += counts[i] * lz_block_log2(counts[i]);
+        }
+    }
+    return lz_block_log2(length) - sum / length;
+}
+
+/**
+ * Quick guess at whether compressing data like this is worth the time.
+ * Already compressed files, images and the like are let through as they are.
+ */
+bool lz_block_is_worth_compressing(const unsigned char *data, size_t length) {
+    return byte_entropy_bits(data, length) < LZ_BLOCK_MAX_ENTROPY_BITS;
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Read access to a regular file through memory mappings.
+ *
+ * Chunks are handed out as pointers straight into the mapping, so nothing
+ * is copied before hashing and encoding. The file is mapped a window at a
+ * time, which keeps files bigger than the address space working and lets
+ * pages which have been sent be dropped again.
+ *
+ * The size is fixed when the file is opened. Anything appended later is
+ * ignored. If the file gets shorter, touching the missing pages raises
+ * SIGBUS, which mapped_file_guard() turns into an error return.
+ */
+typedef struct {
+    int fd;
+    off_t size;
+    off_t offset;               /* Next byte to hand out. */
+    unsigned char *window;      /* NULL if nothing is mapped. */
+    off_t window_offset;
+    size_t window_length;
+} MappedFile;
+
+#define MAPPED_FILE_WINDOW_BYTES (64 * 1024 * 1024)
+
+/**
+ * Set up access to `fd` by mapping.
+ *
+ * @return false if the file isn't a regular file, in which case it has to be read.
+ */
+bool mapped_file_open(MappedFile *file, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    file->fd = fd;
+    file->size = st.st_size;
+    file->offset = 0;
+    file->window = NULL;
+    file->window_offset = 0;
+    file->window_length = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+static void mapped_file_unmap(MappedFile *file) {
+    if (file->window != NULL) {
+        munmap(file->window, file->window_length);
+        file->window = NULL;
+    }
+}
+
+/**
+ * Map the window which starts at the page holding the current offset.
+ */
+static bool mapped_file_map_window(MappedFile *file) {
+    mapped_file_unmap(file);
+
+    off_t page_size = sysconf(_SC_PAGESIZE);
+    file->window_offset = file->offset - file->offset % page_size;
+    off_t remaining = file->size - file->window_offset;
+    file->window_length = remaining < MAPPED_FILE_WINDOW_BYTES ? remaining : MAPPED_FILE_WINDOW_BYTES;
+
+    void *window = mmap(NULL, file->window_length, PROT_READ, MAP_SHARED, file->fd, file->window_offset);
+    if (window == MAP_FAILED) {
+        return false;
+    }
+    file->window = window;
+    madvise(window, file->window_length, MADV_SEQUENTIAL);
+    madvise(window, file->window_length, MADV_WILLNEED);
+    return true;
+}
+
+/**
+ * Get the next chunk of the file.
+ *
+ * @param length Receives the chunk's length, at most `max_bytes` and 0 at the end of the file.
+ * @return a pointer to the chunk, valid until the next call, or NULL if the file couldn't be mapped.
+ */
+const unsigned char *mapped_file_next(MappedFile *file, size_t max_bytes, size_t *length) {
+    off_t remaining = file->size - file->offset;
+    *length = remaining < (off_t) max_bytes ? (size_t) remaining : max_bytes;
+    if (*length == 0) {
+        return (const unsigned char *) "";
+    }
+
+    off_t window_end = file->window_offset + file->window_length;
+    if (file->window == NULL || file->offset + (off_t) *length > window_end) {
+        if (!mapped_file_map_window(file)) {
+            return NULL;
+        }
+    }
+
+    const unsigned char *chunk = file->window + (file->offset - file->window_offset);
+    file->offset += *length;
+    return chunk;
+}
+
+/**
+ * Skip ahead to `offset`. Only forwards, as the window never moves back.
+ */
+void mapped_file_seek(MappedFile *file, off_t offset) {
+    file->offset = offset;
+}
+
+void mapped_file_close(MappedFile *file) {
+    mapped_file_unmap(file);
+}
+
+static sigjmp_buf mapped_file_jump_buffer;
+static volatile sig_atomic_t is_mapped_file_guarded = 0;
+
+static void mapped_file_on_sigbus(int signal_number) {
+    if (is_mapped_file_guarded) {
+        siglongjmp(mapped_file_jump_buffer, 1);
+    }
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+/**
+ * Catch SIGBUS from a mapping while the caller works through it.
+ *
+ * Use it as `if (sigsetjmp(mapped_file_jump_buffer, 1) != 0) { ...the file shrank... }`
+ * followed by mapped_file_guard(). Locals changed after the sigsetjmp()
+ * can't be relied on in the error branch.
+ */
+void mapped_file_guard() {
+    struct sigaction action = {0};
+    action.sa_handler = mapped_file_on_sigbus;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+    is_mapped_file_guarded = 1;
+}
+
+void mapped_file_unguard() {
+    is_mapped_file_guarded = 0;
+}
@@ -0,0 +1,282 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/**
+ * Large output buffer for building whole protocol records in place.
+ *
+ * Callers reserve space, encode directly into it and commit what they
+ * wrote. The buffer only goes to the file descriptor when it fills up or
+ * is explicitly flushed, so a small transfer costs a single write(2).
+ *
+ * It can also serve as a bounded queue: `output_buffer_write_some()` sends
+ * roughly what the descriptor takes right now and leaves the rest queued
+ * for later. The descriptor itself stays blocking, as its flags would be
+ * shared with the shell and everything else on the terminal, so this is
+ * best effort. A write may still wait while part of a slice drains.
+ */
+typedef struct {
+    int fd;
+    char *data;
+    size_t start;       /* Where the data not yet written begins. */
+    size_t length;      /* Where it ends. */
+    size_t capacity;
+    bool failed;
+} OutputBuffer;
+
+#define OUTPUT_BUFFER_DEFAULT_CAPACITY (256 * 1024)
+
+/* Most that output_buffer_write_some() writes at once. POLLOUT only says that
+   some room is free, not how much, and TIOCOUTQ tells what is queued but not
+   the queue's size. Keeping writes this small bounds how long one can block. */
+#define OUTPUT_BUFFER_WRITE_SLICE (16 * 1024)
+
+/**
+ * Wait until a write to `fd` can make progress.
+ */
+bool wait_writable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write all of `length` bytes, retrying after partial writes and signals.
+ *
+ * A non-blocking `fd` is waited on when it is full.
+ */
+bool write_fully(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length != 0) {
+        ssize_t count = write(fd, bytes, length);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd)) {
+                continue;
+            }
+            return false;
+        }
+        bytes += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Write all of the given buffers, retrying after partial writes and signals.
+ *
+ * The iovec array is modified as the writes progress. A non-blocking `fd`
+ * is waited on when it is full.
+ */
+bool writev_fully(int fd, struct iovec *iov, int iov_count) {
+    while (iov_count != 0) {
+        ssize_t count = writev(fd, iov, iov_count);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd)) {
+                continue;
+            }
+            return false;
+        }
+        while (iov_count != 0 && (size_t) count >= iov->iov_len) {
+            count -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count != 0) {
+            iov->iov_base = (char *) iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+    return true;
+}
+
+bool output_buffer_init(OutputBuffer *out, int fd, size_t capacity) {
+    out->fd = fd;
+    out->data = malloc(capacity);
+    out->start = 0;
+    out->length = 0;
+    out->capacity = capacity;
+    out->failed = out->data == NULL;
+    return !out->failed;
+}
+
+void output_buffer_free(OutputBuffer *out) {
+    free(out->data);
+    out->data = NULL;
+    out->start = 0;
+    out->length = 0;
+    out->capacity = 0;
+}
+
+/**
+ * Bytes committed but not written yet.
+ */
+size_t output_buffer_pending(OutputBuffer *out) {
+    return out->length - out->start;
+}
+
+/**
+ * Bytes which can be reserved without anything having to be written first.
+ */
+size_t output_buffer_space(OutputBuffer *out) {
+    return out->capacity - output_buffer_pending(out);
+}
+
+/**
+ * Send everything buffered so far to the file descriptor.
+ *
+ * @return false if this or an earlier write failed.
+ */
+bool output_buffer_flush(OutputBuffer *out) {
+    if (out->length != out->start && !out->failed) {
+        if (!write_fully(out->fd, out->data + out->start, out->length - out->start)) {
+            out->failed = true;
+        }
+    }
+    out->start = 0;
+    out->length = 0;
+    return !out->failed;
+}
+
+/**
+ * Write about as much as the file descriptor takes right now.
+ *
+ * The descriptor is polled before each write, which is kept to
+ * OUTPUT_BUFFER_WRITE_SLICE bytes, and the writing stops once it is full.
+ * This is best effort: a write can still block until the part of its slice
+ * which didn't fit has drained.
+ *
+ * @param written Receives the number of bytes written.
+ * @return false if this or an earlier write failed.
+ */
+bool output_buffer_write_some(OutputBuffer *out, size_t *written) {
+    *written = 0;
+    while (out->length != out->start && !out->failed) {
+        struct pollfd pfd = { .fd = out->fd, .events = POLLOUT };
+        int ready = poll(&pfd, 1, 0);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            break;
+        }
+        if (ready == -1 || (pfd.revents & POLLNVAL)) {
+            out->failed = true;
+            break;
+        }
+
+        size_t length = out->length - out->start;
+        ssize_t count = write(out->fd, out->data + out->start,
+            length < OUTPUT_BUFFER_WRITE_SLICE ? length : OUTPUT_BUFFER_WRITE_SLICE);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                out->failed = true;
+            }
+            break;
+        }
+        out->start += count;
+        *written += count;
+    }
+    if (out->start == out->length) {
+        out->start = 0;
+        out->length = 0;
+    }
+    return !out->failed;
+}
+
+/**
+ * Throw away queued lines which haven't started to go out yet.
+ *
+ * A line which was partly written is kept up to its end, so that the
+ * receiver never sees a torn line.
+ *
+ * @param is_mid_line true if the last write stopped inside a line.
+ */
+void output_buffer_drop_queued_lines(OutputBuffer *out, bool is_mid_line) {
+    if (!is_mid_line) {
+        out->length = out->start;
+        return;
+    }
+    char *newline = memchr(out->data + out->start, '\n', out->length - out->start);
+    if (newline != NULL) {
+        out->length = newline + 1 - out->data;
+    }
+}
+
+/**
+ * Make room for at least `count` bytes and return where they go.
+ *
+ * The space only becomes part of the output after `output_buffer_commit()`.
+ * The buffer grows if `count` is larger than its whole capacity.
+ */
+char *output_buffer_reserve(OutputBuffer *out, size_t count) {
+    if (out->capacity - out->length < count && out->start != 0) {
+        /* Move what is still queued down to make room. */
+        memmove(out->data, out->data + out->start, out->length - out->start);
+        out->length -= out->start;
+        out->start = 0;
+    }
+    if (out->capacity - out->length < count) {
+        output_buffer_flush(out);
+        if (out->capacity < count) {
+            char *data = realloc(out->data, count);
+            if (data == NULL) {
+                abort();
+            }
+            out->data = data;
+            out->capacity = count;
+        }
+    }
+    return out->data + out->length;
+}
+
+void output_buffer_commit(OutputBuffer *out, size_t count) {
+    out->length += count;
+}
+
+void output_buffer_append(OutputBuffer *out, const void *data, size_t count) {
+    memcpy(output_buffer_reserve(out, count), data, count);
+    output_buffer_commit(out, count);
+}
+
+void output_buffer_append_str(OutputBuffer *out, const char *str) {
+    output_buffer_append(out, str, strlen(str));
+}
+
+void output_buffer_append_char(OutputBuffer *out, char c) {
+    *output_buffer_reserve(out, 1) = c;
+    output_buffer_commit(out, 1);
+}
+
+void output_buffer_append_b64(OutputBuffer *out, const unsigned char *data, size_t count) {
+    /* b64_encode() also writes a NUL which is reserved but not committed. */
+    char *dest = output_buffer_reserve(out, b64e_size(count) + 1);
+    output_buffer_commit(out, b64_encode(data, count, (unsigned char *) dest));
+}
+
+void output_buffer_append_hex(OutputBuffer *out, const unsigned char *bytes, size_t count) {
+    char *dest = output_buffer_reserve(out, count * 2);
+    bytes_to_hex(bytes, count, dest);
+    output_buffer_commit(out, count * 2);
+}
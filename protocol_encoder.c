@@ -0,0 +1,224 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Writes protocol records into a caller supplied buffer, never allocating.
+ *
+ * An encoder without a buffer only counts, which is how the size of a
+ * record is found before encoding it for real. Writing past the end of the
+ * buffer is caught, sets `overflow` and drops the rest of the record.
+ */
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t length;
+    bool overflow;
+} ProtocolEncoder;
+
+const char *PROTOCOL_INTRO = "\x1b&";
+#define PROTOCOL_COMMAND_REQUEST_FRAME "4"
+#define PROTOCOL_COMMAND_FILE_TRANSFER "5"
+#define PROTOCOL_NO_FILESIZE ((size_t) -1)
+
+void protocol_encoder_init(ProtocolEncoder *enc, char *buffer, size_t capacity) {
+    enc->data = buffer;
+    enc->capacity = capacity;
+    enc->length = 0;
+    enc->overflow = false;
+}
+
+/**
+ * Set up an encoder which only measures what would be written.
+ */
+void protocol_encoder_init_counting(ProtocolEncoder *enc) {
+    protocol_encoder_init(enc, NULL, 0);
+}
+
+void protocol_encoder_put(ProtocolEncoder *enc, const void *data, size_t count) {
+    if (enc->data != NULL) {
+        if (enc->overflow || enc->capacity - enc->length < count) {
+            enc->overflow = true;
+            return;
+        }
+        memcpy(enc->data + enc->length, data, count);
+    }
+    enc->length += count;
+}
+
+void protocol_encoder_put_str(ProtocolEncoder *enc, const char *str) {
+    protocol_encoder_put(enc, str, strlen(str));
+}
+
+void protocol_encoder_put_char(ProtocolEncoder *enc, char c) {
+    protocol_encoder_put(enc, &c, 1);
+}
+
+void protocol_encoder_put_uint(ProtocolEncoder *enc, unsigned long long value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count] = '0' + value % 10;
+        value /= 10;
+        count++;
+    } while (value != 0);
+    protocol_encoder_put(enc, digits + sizeof(digits) - count, count);
+}
+
+/**
+ * Write a string as a quoted JSON string.
+ *
+ * Quotes, backslashes and control chars are escaped. Everything else,
+ * including UTF-8 sequences, is passed through as is.
+ */
+void protocol_encoder_put_json_string(ProtocolEncoder *enc, const char *str) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    protocol_encoder_put_char(enc, '"');
+    const char *run_start = str;
+    const char *p = str;
+    for (; *p != '\0'; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        protocol_encoder_put(enc, run_start, p - run_start);
+        run_start = p + 1;
+
+        char escape[6] = { '\\', 0 };
+        size_t escape_length = 2;
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = HEX_DIGITS[c >> 4];
+                escape[5] = HEX_DIGITS[c & 0x0f];
+                escape_length = 6;
+                break;
+        }
+        protocol_encoder_put(enc, escape, escape_length);
+    }
+    protocol_encoder_put(enc, run_start, p - run_start);
+    protocol_encoder_put_char(enc, '"');
+}
+
+static void put_json_string_field(ProtocolEncoder *enc, bool *is_first, const char *key, const char *value) {
+    protocol_encoder_put_str(enc, *is_first ? "{\"" : ",\"");
+    protocol_encoder_put_str(enc, key);
+    protocol_encoder_put_str(enc, "\":");
+    protocol_encoder_put_json_string(enc, value);
+    *is_first = false;
+}
+
+static void put_file_transfer_metadata(ProtocolEncoder *enc, const char *mimetype, const char *charset,
+        const char *filename, size_t filesize, bool download_flag, const char *content_encoding,
+        const char *integrity, const char *line_encoding, const char *transfer_mode) {
+
+    bool is_first = true;
+    if (mimetype != NULL) {
+        put_json_string_field(enc, &is_first, "mimeType", mimetype);
+    }
+    if (filename != NULL) {
+        put_json_string_field(enc, &is_first, "filename", filename);
+    }
+    if (charset != NULL) {
+        put_json_string_field(enc, &is_first, "charset", charset);
+    }
+    if (filesize != PROTOCOL_NO_FILESIZE) {
+        protocol_encoder_put_str(enc, is_first ? "{\"filesize\":" : ",\"filesize\":");
+        protocol_encoder_put_uint(enc, filesize);
+        is_first = false;
+    }
+    if (download_flag) {
+        put_json_string_field(enc, &is_first, "download", "true");
+    }
+    if (content_encoding != NULL) {
+        put_json_string_field(enc, &is_first, "contentEncoding", content_encoding);
+    }
+    if (integrity != NULL) {
+        put_json_string_field(enc, &is_first, "integrity", integrity);
+    }
+    if (line_encoding != NULL) {
+        put_json_string_field(enc, &is_first, "lineEncoding", line_encoding);
+    }
+    if (transfer_mode != NULL) {
+        put_json_string_field(enc, &is_first, "transferMode", transfer_mode);
+    }
+    protocol_encoder_put_str(enc, is_first ? "{}" : "}");
+}
+
+/**
+ * Encode the record which starts a file transfer.
+ *
+ * It is the escape intro, cookie and command code followed by the length
+ * of the JSON metadata, a BEL, and the metadata itself.
+ *
+ * @param filesize Size of the file or PROTOCOL_NO_FILESIZE.
+ * @param content_encoding How the data lines are packed, or NULL if they hold the plain data.
+ * @param integrity How the data lines are hashed, e.g. INTEGRITY_TREE_SHA256,
+ *          or NULL for the chained hash.
+ * @param line_encoding How the data lines are spelt out, e.g. LINE_ENCODING_BASE85, or NULL for base64.
+ * @param transfer_mode How the transfer goes, e.g. TRANSFER_MODE_CHUNK_DEDUP, or NULL for the data
+ *          lines alone.
+ * @return false if the record didn't fit in the encoder's buffer.
+ */
+bool protocol_encode_start_file_transfer(ProtocolEncoder *enc, const char *cookie, const char *mimetype,
+        const char *charset, const char *filename, size_t filesize, bool download_flag, const char *content_encoding,
+        const char *integrity, const char *line_encoding, const char *transfer_mode) {
+
+    ProtocolEncoder json_size;
+    protocol_encoder_init_counting(&json_size);
+    put_file_transfer_metadata(&json_size, mimetype, charset, filename, filesize, download_flag, content_encoding,
+        integrity, line_encoding, transfer_mode);
+
+    protocol_encoder_put_str(enc, PROTOCOL_INTRO);
+    protocol_encoder_put_str(enc, cookie);
+    protocol_encoder_put_str(enc, ";" PROTOCOL_COMMAND_FILE_TRANSFER ";");
+    protocol_encoder_put_uint(enc, json_size.length);
+    protocol_encoder_put_char(enc, '\x07');
+    put_file_transfer_metadata(enc, mimetype, charset, filename, filesize, download_flag, content_encoding,
+        integrity, line_encoding, transfer_mode);
+    return !enc->overflow;
+}
+
+/**
+ * Encode the record which ends a file transfer.
+ */
+bool protocol_encode_end_file_transfer(ProtocolEncoder *enc) {
+    protocol_encoder_put_char(enc, '\0');
+    return !enc->overflow;
+}
+
+/**
+ * Encode the request asking the terminal to send the contents of a frame.
+ *
+ * @param accepted Content encodings, integrity modes and line encodings which
+ *          the terminal may use for the frame, comma separated, or NULL for
+ *          the plain data, the chained hash and base64 only.
+ */
+bool protocol_encode_request_frame(ProtocolEncoder *enc, const char *cookie, const char *frame_name,
+        const char *accepted) {
+    protocol_encoder_put_str(enc, PROTOCOL_INTRO);
+    protocol_encoder_put_str(enc, cookie);
+    protocol_encoder_put_str(enc, ";" PROTOCOL_COMMAND_REQUEST_FRAME);
+    if (accepted != NULL) {
+        protocol_encoder_put_char(enc, ';');
+        protocol_encoder_put_str(enc, accepted);
+    }
+    protocol_encoder_put_char(enc, '\x07');
+    protocol_encoder_put_str(enc, frame_name);
+    protocol_encoder_put_char(enc, '\0');
+    return !enc->overflow;
+}
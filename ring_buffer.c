@@ -0,0 +1,121 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Bounded, blocking FIFO of pointers for handing work between threads.
+ *
+ * Producers block while the buffer is full and consumers block while it
+ * is empty. Closing the buffer wakes everybody up: pushes fail from then
+ * on, while pops keep returning the items already queued until it is
+ * drained.
+ */
+typedef struct {
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} RingBuffer;
+
+bool ring_buffer_init(RingBuffer *rb, size_t capacity) {
+    rb->items = calloc(capacity, sizeof(void *));
+    if (rb->items == NULL) {
+        return false;
+    }
+    rb->capacity = capacity;
+    rb->head = 0;
+    rb->count = 0;
+    rb->closed = false;
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->not_empty, NULL);
+    pthread_cond_init(&rb->not_full, NULL);
+    return true;
+}
+
+void ring_buffer_destroy(RingBuffer *rb) {
+    pthread_cond_destroy(&rb->not_full);
+    pthread_cond_destroy(&rb->not_empty);
+    pthread_mutex_destroy(&rb->mutex);
+    free(rb->items);
+    rb->items = NULL;
+}
+
+/**
+ * Append an item, waiting for space if needed.
+ *
+ * @return false if the buffer was closed and the item was not queued.
+ */
+bool ring_buffer_push(RingBuffer *rb, void *item) {
+    pthread_mutex_lock(&rb->mutex);
+    while (rb->count == rb->capacity && !rb->closed) {
+        pthread_cond_wait(&rb->not_full, &rb->mutex);
+    }
+    if (rb->closed) {
+        pthread_mutex_unlock(&rb->mutex);
+        return false;
+    }
+    rb->items[(rb->head + rb->count) % rb->capacity] = item;
+    rb->count++;
+    pthread_cond_signal(&rb->not_empty);
+    pthread_mutex_unlock(&rb->mutex);
+    return true;
+}
+
+/**
+ * Remove the oldest item, waiting for one if needed.
+ *
+ * @return false once the buffer is closed and empty.
+ */
+bool ring_buffer_pop(RingBuffer *rb, void **item) {
+    pthread_mutex_lock(&rb->mutex);
+    while (rb->count == 0 && !rb->closed) {
+        pthread_cond_wait(&rb->not_empty, &rb->mutex);
+    }
+    if (rb->count == 0) {
+        pthread_mutex_unlock(&rb->mutex);
+        return false;
+    }
+    *item = rb->items[rb->head];
+    rb->head = (rb->head + 1) % rb->capacity;
+    rb->count--;
+    pthread_cond_signal(&rb->not_full);
+    pthread_mutex_unlock(&rb->mutex);
+    return true;
+}
+
+/**
+ * Remove the oldest item if there is one, without waiting.
+ *
+ * @return false if the buffer is currently empty.
+ */
+bool ring_buffer_try_pop(RingBuffer *rb, void **item) {
+    pthread_mutex_lock(&rb->mutex);
+    if (rb->count == 0) {
+        pthread_mutex_unlock(&rb->mutex);
+        return false;
+    }
+    *item = rb->items[rb->head];
+    rb->head = (rb->head + 1) % rb->capacity;
+    rb->count--;
+    pthread_cond_signal(&rb->not_full);
+    pthread_mutex_unlock(&rb->mutex);
+    return true;
+}
+
+void ring_buffer_close(RingBuffer *rb) {
+    pthread_mutex_lock(&rb->mutex);
+    rb->closed = true;
+    pthread_cond_broadcast(&rb->not_empty);
+    pthread_cond_broadcast(&rb->not_full);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <termios.h>
 
@@ -16,11 +18,24 @@
 #include "libs/adopt.c"
 #include "libs/sha256.c"
 #include "libs/base64.c"
-#include "libs/parson.c"
+#include "libs/base85.c"
 
-#include "extraterm_client.c"
 #include "tty_utils.c"
+#include "utils.h"
 #include "utils.c"
+#include "output_buffer.c"
+#include "protocol_encoder.c"
+#include "extraterm_client.c"
+#include "line_encoding.c"
+#include "chained_hash.c"
+#include "tree_hash.c"
+#include "chunk_sizer.c"
+#include "lz_block.c"
+#include "transfer_cancel.c"
+#include "ring_buffer.c"
+#include "mapped_file.c"
+#include "chunk_dedup.c"
+#include "delta.c"
 
 #ifndef APP_VERSION
 #define APP_VERSION git
@@ -29,66 +44,643 @@
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
 #define QUOTED_APP_VERSION EXPAND_AND_QUOTE(APP_VERSION)
 
-/* This is kept a multiple of 3 to avoid padding in the base64 representation. */
-const size_t MAX_CHUNK_BYTES = 3 * 1024;
+/* Chunk size which every terminal accepts, and where adaptive sizing starts.
+   This is kept a multiple of 3 to avoid padding in the base64 representation. */
+#define DEFAULT_CHUNK_BYTES (3 * 1024)
 
-int send_mimetype_data(FILE* fhandle, const char* filename, const char* mimetype, const char* charset,
-                        size_t filesize, bool download_flag) {
-    turn_off_echo();
+/* How long streamed input may wait for more before it is sent, by default. */
+#define DEFAULT_STREAM_IDLE_MS 50
+#define NO_STREAMING -1
+
+/* Compressed files smaller than this go out before the pipeline's threads would have paid for themselves. */
+#define PIPELINE_MIN_FILE_BYTES (256 * 1024)
+
+/* "D:" + base64 + ":" + hex hash + "\n" + NUL. Base85 is never longer. */
+#define DATA_LINE_CAPACITY(chunk_bytes) (2 + b64e_size(chunk_bytes) + 1 + SHA256_SIZE_BYTES * 2 + 1 + 1)
+/* Room for the data line of a chunk, whether or not it gets packed. */
+#define CHUNK_LINE_CAPACITY(chunk_bytes) DATA_LINE_CAPACITY(LZ_BLOCK_PACKED_BOUND(chunk_bytes))
+
+/* "C:" + hex digest + ":" + length + "\n" + NUL */
+#define CHUNK_OFFER_LINE_CAPACITY (2 + SHA256_SIZE_BYTES * 2 + 1 + 10 + 1 + 1)
+/* How long the terminal has to say which chunks it wants, or to send the signatures for a delta. */
+#define TERMINAL_REPLY_TIMEOUT_MS 30000
+
+/**
+ * How chunks become the payload of their data lines.
+ */
+typedef enum {
+    PACKING_OFF,            /* The payload is the chunk as it is. */
+    PACKING_UNDECIDED,      /* lz4-block content encoding, until the first chunk has been looked at. */
+    PACKING_COMPRESS,
+    PACKING_STORE,          /* lz4-block, but the data doesn't look compressible. */
+} Packing;
+
+/**
+ * Settle whether to compress, going by the first chunk.
+ */
+static Packing decide_packing(Packing packing, const unsigned char *chunk, size_t length) {
+    if (packing != PACKING_UNDECIDED) {
+        return packing;
+    }
+    return lz_block_is_worth_compressing(chunk, length) ? PACKING_COMPRESS : PACKING_STORE;
+}
+
+/**
+ * Hashes and encodes a transfer's data lines in the integrity mode and line
+ * encoding it was started with.
+ */
+typedef struct {
+    bool is_tree;               /* INTEGRITY_TREE_SHA256, otherwise the chained hash. */
+    bool is_base85;             /* LINE_ENCODING_BASE85, otherwise base64. */
+    ChainedHash chain;
+    TreeHash tree;
+} TransferLines;
+
+static void transfer_lines_init(TransferLines *lines, bool is_tree, bool is_base85) {
+    lines->is_tree = is_tree;
+    lines->is_base85 = is_base85;
+    chained_hash_init(&lines->chain);
+    tree_hash_init(&lines->tree);
+}
+
+/**
+ * Get the hash for the end line.
+ */
+static void transfer_lines_end(TransferLines *lines, unsigned char *end_hash) {
+    if (lines->is_tree) {
+        tree_hash_root(&lines->tree, end_hash);
+    } else {
+        chained_hash_update(&lines->chain, "", 0);
+        memcpy(end_hash, lines->chain.previous_hash, SHA256_SIZE_BYTES);
+    }
+}
+
+/**
+ * Format a complete data line around a payload and its hash.
+ *
+ * @param buffer The chunk, or the packed chunk when there is a content encoding.
+ * @param is_base85 Encode the payload in base85 rather than base64.
+ * @param line Receives the NUL terminated line, must hold DATA_LINE_CAPACITY(length) chars.
+ * @return the length of the line excluding the NUL.
+ */
+size_t format_hashed_data_line(const unsigned char *buffer, size_t length, const unsigned char *line_hash,
+        bool is_base85, char *line) {
+    size_t line_length = 0;
+    line[line_length++] = 'D';
+    line[line_length++] = ':';
+    line_length += line_encode(is_base85, buffer, length, (unsigned char *) line + line_length);
+    line[line_length++] = ':';
+    sha256_hash_to_hex((unsigned char *) line_hash, line + line_length);
+    line_length += SHA256_SIZE_BYTES * 2;
+    line[line_length++] = '\n';
+    line[line_length] = '\0';
+    return line_length;
+}
+
+/**
+ * Hash a chunk as the next data line and format the line.
+ *
+ * @see format_hashed_data_line()
+ */
+size_t format_data_line(TransferLines *lines, const unsigned char *buffer, size_t length, char *line) {
+    if (lines->is_tree) {
+        unsigned char leaf[SHA256_SIZE_BYTES];
+        tree_hash_leaf(buffer, length, leaf);
+        tree_hash_push(&lines->tree, leaf);
+        return format_hashed_data_line(buffer, length, leaf, lines->is_base85, line);
+    }
+    chained_hash_update(&lines->chain, buffer, length);
+    return format_hashed_data_line(buffer, length, lines->chain.previous_hash, lines->is_base85, line);
+}
+
+#include "show_pipeline.c"
+
+static bool is_same_file(int fd1, int fd2) {
+    struct stat st1, st2;
+    if (fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0) {
+        return false;
+    }
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/**
+ * Wait until the terminal can take more output, or something happens which may cancel the transfer.
+ */
+static bool wait_for_terminal(int fd, TransferCancel *cancel) {
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = POLLOUT },
+        { .fd = cancel->fd, .events = POLLIN },
+    };
+    if (poll(pfds, cancel->fd != -1 ? 2 : 1, -1) == -1 && errno != EINTR) {
+        return false;
+    }
+    return true;
+}
 
-    extraterm_start_file_transfer(mimetype, charset, filename, filesize, download_flag);
-    unsigned char buffer[MAX_CHUNK_BYTES];
+/**
+ * Get the next piece of the input.
+ *
+ * @param buffer Receives the piece when it is read, must hold `max_bytes`.
+ * @param plan If not NULL, only the chunks which it wants are read.
+ * @param piece Receives where the piece is.
+ * @param length Receives the length of the piece, 0 at the end.
+ * @return false if the input failed.
+ */
+static bool next_input_piece(FILE *fhandle, MappedFile *mapped, DedupPlan *plan, unsigned char *buffer,
+        size_t max_bytes, const unsigned char **piece, size_t *length) {
+    *piece = buffer;
+    if (plan != NULL) {
+        uint64_t offset;
+        if (!dedup_plan_next_range(plan, &offset, &max_bytes)) {
+            *length = 0;
+            return true;
+        }
+        if (mapped != NULL) {
+            mapped_file_seek(mapped, offset);
+        } else if (ftello(fhandle) != (off_t) offset && fseeko(fhandle, offset, SEEK_SET) != 0) {
+            return false;
+        }
+    }
 
-    size_t read_count;
-    char b64buffer[b64d_size(MAX_CHUNK_BYTES)];
+    if (mapped != NULL) {
+        *piece = mapped_file_next(mapped, max_bytes, length);
+        if (*piece == NULL) {
+            return false;
+        }
+    } else {
+        *length = fread(buffer, 1, max_bytes, fhandle);
+        if (*length == 0 && !feof(fhandle)) {
+            return false;
+        }
+    }
+    /* The chunks were offered, so all of them have to be there. */
+    return plan == NULL || *length == max_bytes;
+}
 
-    sha256_context hash;
+/**
+ * The chunk loop of send_data_lines().
+ *
+ * @param buffer Where chunks are read to, unless they come from `mapped`.
+ * @param packed Where chunks are packed to, if `packing` isn't PACKING_OFF.
+ */
+static int send_chunks(FILE* fhandle, MappedFile *mapped, DedupPlan *plan, OutputBuffer *out, TransferLines *lines,
+        ChunkSizer *sizer, Packing packing, TransferCancel *cancel, unsigned char *buffer, unsigned char *packed) {
+    bool is_input_done = false;
+    /* The start record counts as a line in progress until it has gone out. */
+    bool is_mid_line = output_buffer_pending(out) != 0;
+    double waited_seconds = 0;
+    int result = EXIT_SUCCESS;
 
-    bool is_previous_hash = false;
-    unsigned char previous_hash[SHA256_SIZE_BYTES];
     while (true) {
-        read_count = fread(buffer, 1, MAX_CHUNK_BYTES, fhandle);
-        if (read_count == 0) {
-            if (!feof(fhandle)) {
-                 return EXIT_FAILURE;
+        if (transfer_cancel_check(cancel)) {
+            output_buffer_drop_queued_lines(out, is_mid_line);
+            result = EXIT_CANCELLED;
+            break;
+        }
+
+        bool has_room = output_buffer_space(out) >= CHUNK_LINE_CAPACITY(sizer->chunk_bytes);
+        if (!is_input_done && has_room) {
+            const unsigned char *chunk;
+            size_t read_count;
+            if (!next_input_piece(fhandle, mapped, plan, buffer, sizer->chunk_bytes, &chunk, &read_count)) {
+                result = EXIT_FAILURE;
+                break;
             }
+
+            if (read_count == 0) {
+                is_input_done = true;
+            } else {
+                if (packing != PACKING_OFF) {
+                    packing = decide_packing(packing, chunk, read_count);
+                    read_count = lz_block_pack(chunk, read_count, packing == PACKING_COMPRESS, packed);
+                    chunk = packed;
+                }
+                char *line = output_buffer_reserve(out, DATA_LINE_CAPACITY(read_count));
+                output_buffer_commit(out, format_data_line(lines, chunk, read_count, line));
+            }
+        }
+
+        size_t written;
+        if (!output_buffer_write_some(out, &written)) {
+            result = EXIT_FAILURE;
             break;
         }
+        if (written != 0) {
+            is_mid_line = output_buffer_pending(out) != 0 && out->data[out->start - 1] != '\n';
+            /* The time spent waiting for the terminal is what the link speed is measured by. */
+            chunk_sizer_update(sizer, written, waited_seconds);
+            waited_seconds = 0;
+        }
 
-        sha256_init(&hash);
-        if (is_previous_hash) {
-            sha256_hash(&hash, previous_hash, SHA256_SIZE_BYTES);
+        if (output_buffer_pending(out) == 0) {
+            if (is_input_done) {
+                break;
+            }
+        } else if (is_input_done || !has_room) {
+            double start_time = now_seconds();
+            if (!wait_for_terminal(out->fd, cancel)) {
+                result = EXIT_FAILURE;
+                break;
+            }
+            waited_seconds += now_seconds() - start_time;
         }
-        sha256_hash(&hash, buffer, read_count);
+    }
+    return result;
+}
 
-        fputs("D:", stdout);
-        b64_encode(buffer, read_count, (unsigned char *) b64buffer);
-        fputs(b64buffer, stdout);
+/**
+ * Send the data lines for the whole of `fhandle`.
+ *
+ * Only about what the terminal takes right now is written, see
+ * output_buffer_write_some(). While the terminal can't take any more,
+ * chunks keep being read and encoded into the output buffer, which doubles
+ * as a bounded queue, and only once that is full do we wait on the terminal.
+ *
+ * @param mapped If not NULL, chunks are hashed and encoded straight out of
+ *          this mapping of the file instead of being read from `fhandle`.
+ * @param plan If not NULL, only the chunks which the terminal wants are sent.
+ * @param packing PACKING_OFF, or PACKING_UNDECIDED to pack chunks with lz_block_pack().
+ * @return EXIT_SUCCESS, EXIT_FAILURE or EXIT_CANCELLED.
+ */
+int send_data_lines(FILE* fhandle, MappedFile *mapped, DedupPlan *plan, OutputBuffer *out, TransferLines *lines,
+        ChunkSizer *sizer, Packing packing, TransferCancel *cancel) {
+    unsigned char *buffer = mapped == NULL ? malloc(sizer->max_bytes) : NULL;
+    unsigned char *packed = packing != PACKING_OFF ? malloc(LZ_BLOCK_PACKED_BOUND(sizer->max_bytes)) : NULL;
+    if ((mapped == NULL && buffer == NULL) || (packing != PACKING_OFF && packed == NULL)) {
+        perror("[Error] Unable to allocate the chunk buffers.");
+        free(packed);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    /* Nothing here changes between the sigsetjmp() and the end of send_chunks(),
+       which keeps its own state out of reach of a siglongjmp(). */
+    if (mapped != NULL) {
+        if (sigsetjmp(mapped_file_jump_buffer, 1) != 0) {
+            /* The file got shorter. The line being encoded was never committed. */
+            mapped_file_unguard();
+            free(packed);
+            return EXIT_FAILURE;
+        }
+        mapped_file_guard();
+    }
+    int result = send_chunks(fhandle, mapped, plan, out, lines, sizer, packing, cancel, buffer, packed);
+    if (mapped != NULL) {
+        mapped_file_unguard();
+    }
+    free(packed);
+    free(buffer);
+    return result;
+}
 
-        fputs(":", stdout);
+/**
+ * Send data lines from a live source, like a pipe from `tail -f`, as the data arrives.
+ *
+ * A partial chunk is sent once a newline arrives and nothing more is
+ * waiting right behind it, or at the latest `idle_ms` after its first byte
+ * came in. Whatever has been encoded is flushed to the terminal before
+ * waiting on the input again, so no byte is held back for much longer than
+ * `idle_ms`, however slowly the input trickles in.
+ *
+ * @return EXIT_SUCCESS, EXIT_FAILURE or EXIT_CANCELLED.
+ */
+int send_data_lines_streaming(int fd, OutputBuffer *out, TransferLines *lines, int idle_ms, TransferCancel *cancel) {
+    unsigned char buffer[DEFAULT_CHUNK_BYTES];
+    size_t length = 0;
+    double deadline = 0;            /* When the contents of `buffer` must be sent. */
+    bool newline_pending = false;
+    bool is_start_pending = output_buffer_pending(out) != 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
 
-        sha256_done(&hash, previous_hash);
-        is_previous_hash = true;
+    while (true) {
+        if (transfer_cancel_check(cancel)) {
+            /* Only whole lines are flushed here, but the start record has to go out. */
+            output_buffer_drop_queued_lines(out, is_start_pending);
+            return EXIT_CANCELLED;
+        }
 
-        print_hex(previous_hash, SHA256_SIZE_BYTES);
+        bool send_chunk = false;
+        int ready = poll(&pfd, 1, 0);
+        if (ready == 0) {
+            if (length != 0 && (newline_pending || now_seconds() >= deadline)) {
+                send_chunk = true;
+            } else {
+                /* About to wait, so everything encoded so far goes out first. */
+                if (!output_buffer_flush(out)) {
+                    return EXIT_FAILURE;
+                }
+                is_start_pending = false;
+                int timeout = -1;
+                if (length != 0) {
+                    timeout = (int) ((deadline - now_seconds()) * 1000) + 1;
+                    timeout = timeout < 0 ? 0 : timeout;
+                }
+                ready = poll(&pfd, 1, timeout);
+                send_chunk = ready == 0;
+            }
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return EXIT_FAILURE;
+        }
+
+        if ( ! send_chunk) {
+            ssize_t read_count = read(fd, buffer + length, DEFAULT_CHUNK_BYTES - length);
+            if (read_count < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                return EXIT_FAILURE;
+            }
+            if (read_count == 0) {
+                break;
+            }
 
-        puts("");
+            if (length == 0) {
+                deadline = now_seconds() + idle_ms / 1000.0;
+            }
+            if (memchr(buffer + length, '\n', read_count) != NULL) {
+                newline_pending = true;
+            }
+            length += read_count;
+            send_chunk = length == DEFAULT_CHUNK_BYTES || now_seconds() >= deadline;
+        }
+
+        if (send_chunk) {
+            char *line = output_buffer_reserve(out, DATA_LINE_CAPACITY(length));
+            output_buffer_commit(out, format_data_line(lines, buffer, length, line));
+            length = 0;
+            newline_pending = false;
+        }
     }
 
-    fputs("E::", stdout);
-    sha256_init(&hash);
-    sha256_hash(&hash, previous_hash, SHA256_SIZE_BYTES);
-    sha256_done(&hash, previous_hash);
-    print_hex(previous_hash, SHA256_SIZE_BYTES);
-    puts("");
+    if (length != 0) {
+        char *line = output_buffer_reserve(out, DATA_LINE_CAPACITY(length));
+        output_buffer_commit(out, format_data_line(lines, buffer, length, line));
+    }
+    return EXIT_SUCCESS;
+}
 
-    fflush(stdout);
+/**
+ * Offer the terminal the chunks of the file, and read which of them it wants.
+ *
+ * stdout is still blocking here.
+ *
+ * @return EXIT_SUCCESS, EXIT_FAILURE or EXIT_CANCELLED.
+ */
+static int offer_chunks(OutputBuffer *out, DedupPlan *plan, TransferCancel *cancel) {
+    for (size_t i=0; i<plan->count; i++) {
+        char *line = output_buffer_reserve(out, CHUNK_OFFER_LINE_CAPACITY);
+        size_t length = 0;
+        line[length++] = 'C';
+        line[length++] = ':';
+        sha256_hash_to_hex(plan->chunks[i].digest, line + length);
+        length += SHA256_SIZE_BYTES * 2;
+        length += snprintf(line + length, CHUNK_OFFER_LINE_CAPACITY - length, ":%u\n", plan->chunks[i].length);
+        output_buffer_commit(out, length);
+    }
+    unsigned char list_hash[SHA256_SIZE_BYTES];
+    dedup_plan_list_hash(plan, list_hash);
+    output_buffer_append(out, "Q:", 2);
+    output_buffer_append_hex(out, list_hash, SHA256_SIZE_BYTES);
+    output_buffer_append_char(out, '\n');
+    if (!output_buffer_flush(out)) {
+        return EXIT_FAILURE;
+    }
 
-    extraterm_end_file_transfer();
+    char reply[TRANSFER_CANCEL_REPLY_BYTES];
+    while (!dedup_plan_is_answered(plan)) {
+        long length = transfer_cancel_read_reply(cancel, reply, TERMINAL_REPLY_TIMEOUT_MS);
+        if (length < 0) {
+            if (cancel->is_cancelled) {
+                return EXIT_CANCELLED;
+            }
+            fputs("[Error] The terminal didn't say which chunks it wants.\n", stderr);
+            return EXIT_FAILURE;
+        }
+        /* Anything else was typed, and is ignored as it is during any transfer. */
+        if (strncmp(reply, "#W:", 3) == 0 && !dedup_plan_take_answer(plan, reply + 3, length - 3)) {
+            fputs("[Error] The terminal's answer to the chunk offer is malformed.\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Wait for the signatures of the terminal's previous version of the file.
+ *
+ * @param base Receives the signatures, indexed. It has no blocks if there is no previous version.
+ * @return EXIT_SUCCESS, EXIT_FAILURE or EXIT_CANCELLED.
+ */
+static int receive_signatures(OutputBuffer *out, DeltaBase *base, TransferCancel *cancel) {
+    /* The terminal can't answer a start record which it hasn't seen. */
+    if (!output_buffer_flush(out)) {
+        return EXIT_FAILURE;
+    }
+
+    char reply[TRANSFER_CANCEL_REPLY_BYTES];
+    bool is_header_read = false;
+    while (!is_header_read || !delta_base_is_complete(base)) {
+        long length = transfer_cancel_read_reply(cancel, reply, TERMINAL_REPLY_TIMEOUT_MS);
+        if (length < 0) {
+            if (cancel->is_cancelled) {
+                return EXIT_CANCELLED;
+            }
+            fputs("[Error] The terminal didn't send the signatures of its copy of the file.\n", stderr);
+            return EXIT_FAILURE;
+        }
+        bool is_valid = true;
+        if (!is_header_read && strncmp(reply, "#S:", 3) == 0) {
+            is_valid = delta_base_take_header(base, reply + 3);
+            is_header_read = true;
+        } else if (is_header_read && strncmp(reply, "#G:", 3) == 0) {
+            is_valid = delta_base_take_signatures(base, reply + 3, length - 3);
+        }
+        if (!is_valid) {
+            fputs("[Error] The terminal's signatures of its copy of the file are malformed.\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (base->count != 0 && !delta_base_index(base)) {
+        fputs("[Error] Out of memory indexing the signatures.\n", stderr);
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
-int show_file(const char* filename, const char* mimetype, const char* charset, const char* filepath, bool download_flag) {
+/**
+ * Work out the delta of a file into a temporary file.
+ *
+ * @return the delta, read from its start, or NULL if it couldn't be made.
+ */
+static FILE *make_delta_file(const DeltaBase *base, FILE *fhandle, size_t filesize) {
+    FILE *delta_file = tmpfile();
+    if (delta_file == NULL) {
+        return NULL;
+    }
+    if (!delta_encode(base, fileno(fhandle), filesize, delta_file) || fflush(delta_file) != 0 ||
+            fseeko(delta_file, 0, SEEK_SET) != 0) {
+        fclose(delta_file);
+        return NULL;
+    }
+    return delta_file;
+}
+
+/**
+ * @param mapped Mapping of `fhandle` to send from, or NULL to read it.
+ * @param stream_idle_ms Send the input as it arrives, see send_data_lines_streaming(),
+ *          or NO_STREAMING to read it in whole chunks.
+ * @param compress_flag Compress the data if the terminal accepts it. This is opt-in.
+ * @param base85_flag Send base85 data lines if the terminal accepts them, otherwise base64.
+ * @param dedup_flag Skip the chunks of a regular file which the terminal already has, if it can do that.
+ * @param delta_flag Send a regular file as its changes against the terminal's previous version of it,
+ *          if it can do that. This goes before dedup.
+ */
+int send_mimetype_data(FILE* fhandle, MappedFile *mapped, const char* filename, const char* mimetype,
+                        const char* charset, size_t filesize, bool download_flag, bool pipeline_flag,
+                        int stream_idle_ms, bool compress_flag, bool base85_flag, bool dedup_flag, bool delta_flag) {
+    turn_off_echo();
+
+    /* Base85 lines are 6% shorter, but its scalar encoder makes about 450 MB/s against several GB/s for the
+       SIMD base64 ones (see bench.c). That only pays on a slow link, so it is opt-in. */
+    bool is_base85 = base85_flag && extraterm_accepts_line_encoding(LINE_ENCODING_BASE85);
+
+    ChunkSizer sizer;
+    chunk_sizer_init(&sizer, STDOUT_FILENO, DEFAULT_CHUNK_BYTES, extraterm_max_chunk_bytes(DEFAULT_CHUNK_BYTES),
+        line_encoding_expansion(is_base85));
+
+    /* Room for at least two of the biggest lines, so that one can be encoded while the other is written. */
+    size_t out_capacity = OUTPUT_BUFFER_DEFAULT_CAPACITY;
+    if (out_capacity < 2 * CHUNK_LINE_CAPACITY(sizer.max_bytes)) {
+        out_capacity = 2 * CHUNK_LINE_CAPACITY(sizer.max_bytes);
+    }
+    OutputBuffer out;
+    if (!output_buffer_init(&out, STDOUT_FILENO, out_capacity)) {
+        perror("[Error] Unable to allocate the output buffer.");
+        return EXIT_FAILURE;
+    }
+
+    /* Streamed data goes out in small pieces as soon as it arrives, which is no time to compress it. */
+    Packing packing = PACKING_OFF;
+    if (compress_flag && stream_idle_ms == NO_STREAMING &&
+            extraterm_accepts_content_encoding(CONTENT_ENCODING_LZ4_BLOCK)) {
+        packing = PACKING_UNDECIDED;
+    }
+
+    /* Terminals which can check a hash tree get one, as its lines can be checked in parallel. */
+    bool is_tree = extraterm_accepts_integrity(INTEGRITY_TREE_SHA256);
+
+    /* The terminal can cancel by sending a line to our tty, unless that is where the data comes from. */
+    int tty_fd = isatty(STDIN_FILENO) && !is_same_file(fileno(fhandle), STDIN_FILENO) ? STDIN_FILENO : -1;
+
+    /* Dedup and delta need the whole file up front, and the terminal's answer on our tty. The
+       pipeline reads the file straight through, so it sends everything. */
+    bool is_whole_file = filesize != (size_t) -1 && stream_idle_ms == NO_STREAMING && !pipeline_flag && tty_fd != -1;
+    bool is_delta = delta_flag && is_whole_file && extraterm_accepts_transfer_mode(TRANSFER_MODE_DELTA);
+    DedupPlan plan;
+    dedup_plan_init(&plan);
+    bool is_dedup = dedup_flag && !is_delta && is_whole_file &&
+        extraterm_accepts_transfer_mode(TRANSFER_MODE_CHUNK_DEDUP);
+    if (is_dedup && !dedup_plan_scan(&plan, fileno(fhandle), filesize)) {
+        perror("[Error] Unable to read the file");
+        dedup_plan_free(&plan);
+        output_buffer_free(&out);
+        return EXIT_FAILURE;
+    }
+
+    /* Compression is the slow part of a transfer, so a file big enough to repay the threads has it done on
+       the pipeline's workers, one per core. Only chunk-dedup, which skips some chunks, can't use them. */
+    bool is_pipelined = pipeline_flag ||
+        (packing != PACKING_OFF && !is_dedup && filesize != (size_t) -1 && filesize >= PIPELINE_MIN_FILE_BYTES &&
+            show_pipeline_worker_count() > 1);
+
+    extraterm_start_file_transfer(&out, mimetype, charset, filename, filesize, download_flag,
+        packing != PACKING_OFF ? CONTENT_ENCODING_LZ4_BLOCK : NULL, is_tree ? INTEGRITY_TREE_SHA256 : NULL,
+        is_base85 ? LINE_ENCODING_BASE85 : NULL,
+        is_delta ? TRANSFER_MODE_DELTA : is_dedup ? TRANSFER_MODE_CHUNK_DEDUP : NULL);
+
+    TransferLines lines;
+    transfer_lines_init(&lines, is_tree, is_base85);
+
+    TransferCancel cancel;
+    transfer_cancel_begin(&cancel, tty_fd);
+
+    int result = EXIT_SUCCESS;
+    DeltaBase base;
+    delta_base_init(&base);
+    FILE *delta_file = NULL;
+    if (is_dedup) {
+        result = offer_chunks(&out, &plan, &cancel);
+    } else if (is_delta) {
+        result = receive_signatures(&out, &base, &cancel);
+        /* Without a previous version the file goes as it is. */
+        if (result == EXIT_SUCCESS && base.count != 0) {
+            delta_file = make_delta_file(&base, fhandle, filesize);
+            if (delta_file == NULL) {
+                perror("[Error] Unable to work out the changes to the file");
+                result = EXIT_FAILURE;
+            }
+        }
+    }
+
+    if (result != EXIT_SUCCESS) {
+        /* The chunk offer or the signatures went wrong. */
+    } else if (stream_idle_ms != NO_STREAMING) {
+        result = send_data_lines_streaming(fileno(fhandle), &out, &lines, stream_idle_ms, &cancel);
+    } else if (is_pipelined) {
+        /* The pipeline writes straight to the fd, so the start record has to go out first. */
+        if (output_buffer_flush(&out)) {
+            result = send_data_lines_pipelined(delta_file != NULL ? delta_file : fhandle, &lines, &sizer, packing,
+                &cancel);
+        } else {
+            result = EXIT_FAILURE;
+        }
+    } else if (delta_file != NULL) {
+        result = send_data_lines(delta_file, NULL, NULL, &out, &lines, &sizer, packing, &cancel);
+    } else {
+        result = send_data_lines(fhandle, mapped, is_dedup ? &plan : NULL, &out, &lines, &sizer, packing, &cancel);
+    }
+
+    if (result == EXIT_SUCCESS) {
+        unsigned char end_hash[SHA256_SIZE_BYTES];
+        transfer_lines_end(&lines, end_hash);
+        output_buffer_append(&out, "E::", 3);
+        output_buffer_append_hex(&out, end_hash, SHA256_SIZE_BYTES);
+        output_buffer_append_char(&out, '\n');
+
+        extraterm_end_file_transfer(&out);
+    } else if (result == EXIT_CANCELLED || !out.failed) {
+        /* Some data lines were dropped unsent, or the input failed part way. Either way
+           there is no hash the terminal could check, but it shouldn't be left waiting. */
+        output_buffer_append(&out, "A:\n", 3);
+        extraterm_end_file_transfer(&out);
+    }
+
+    bool is_flushed = output_buffer_flush(&out);
+    transfer_cancel_end(&cancel);
+    if (!is_flushed) {
+        perror("[Error] Unable to write to the terminal.");
+        result = EXIT_FAILURE;
+    }
+    if (delta_file != NULL) {
+        fclose(delta_file);
+    }
+    delta_base_free(&base);
+    dedup_plan_free(&plan);
+    output_buffer_free(&out);
+    return result;
+}
+
+/**
+ * @param stream_idle_ms How to send a file which isn't a regular one, as for send_mimetype_data().
+ *          Regular files are always read in whole chunks.
+ * @param mmap_flag Send regular files straight out of a memory mapping.
+ */
+int show_file(const char* filename, const char* mimetype, const char* charset, const char* filepath, bool download_flag,
+        bool pipeline_flag, int stream_idle_ms, bool mmap_flag, bool compress_flag, bool base85_flag, bool dedup_flag,
+        bool delta_flag) {
     FILE* fhandle = fopen(filepath, "rb");
     if (fhandle == NULL) {
         fprintf(stderr, "[Error] Unable to open file '%s'. %s\n", filepath, strerror(errno));
@@ -98,17 +690,39 @@ int show_file(const char* filename, const char* mimetype, const char* charset, c
     struct stat st;
     if (fstat(fileno(fhandle), &st) != 0) {
         perror("[Error] Error occured while getting the file size.");
+        fclose(fhandle);
         return EXIT_FAILURE;
     }
 
-    int result = send_mimetype_data(fhandle, filename ? filename : filepath, mimetype, charset, st.st_size, download_flag);
+    /* Pipes, devices and the like have no size to announce. They are read like stdin, in whole chunks
+       unless streaming was asked for. */
+    size_t filesize = -1;
+    if (S_ISREG(st.st_mode)) {
+        filesize = st.st_size;
+        stream_idle_ms = NO_STREAMING;
+    }
+
+    MappedFile mapped;
+    bool is_mapped = mmap_flag && !pipeline_flag && mapped_file_open(&mapped, fileno(fhandle));
+
+    int result = send_mimetype_data(fhandle, is_mapped ? &mapped : NULL, filename ? filename : filepath, mimetype,
+        charset, filesize, download_flag, pipeline_flag, stream_idle_ms, compress_flag, base85_flag, dedup_flag,
+        delta_flag);
 
+    if (is_mapped) {
+        if (result == EXIT_FAILURE && fstat(fileno(fhandle), &st) == 0 && st.st_size < mapped.size) {
+            fprintf(stderr, "[Error] File '%s' got shorter while it was being sent.\n", filepath);
+        }
+        mapped_file_close(&mapped);
+    }
     fclose(fhandle);
     return result;
 }
 
-int show_stdin(const char* mimetype, const char* charset, const char* filename, bool download_flag) {
-    return send_mimetype_data(stdin, filename, mimetype, charset, -1, download_flag);
+int show_stdin(const char* mimetype, const char* charset, const char* filename, bool download_flag, bool pipeline_flag,
+        int stream_idle_ms, bool compress_flag, bool base85_flag) {
+    return send_mimetype_data(stdin, NULL, filename, mimetype, charset, -1, download_flag, pipeline_flag, stream_idle_ms,
+        compress_flag, base85_flag, false, false);
 }
 
 void show_version() {
@@ -120,8 +734,16 @@ int main(int argc, char *argv[]) {
     char *charset = NULL;
     char *mimetype = NULL;
     char *filename = NULL;
+    int delta_flag = 0;
     int download_flag = 0;
     int help_flag = 0;
+    int base85_flag = 0;
+    int compress_flag = 0;
+    int no_dedup_flag = 0;
+    int no_mmap_flag = 0;
+    int pipeline_flag = 0;
+    int stream_flag = 0;
+    char *stream_idle = NULL;
     int text_flag = 0;
     int version_flag = 0;
 
@@ -129,6 +751,14 @@ int main(int argc, char *argv[]) {
         { .type=ADOPT_TYPE_SWITCH, .name="help", .alias='h', .value=&help_flag, .switch_value=1, .help="show this help message and exit" },
         { .type=ADOPT_TYPE_SWITCH, .name="version", .alias='v', .value=&version_flag, .switch_value=1 },
         { .type=ADOPT_TYPE_SWITCH, .name="download", .alias='d', .value=&download_flag, .switch_value=1 },
+        { .type=ADOPT_TYPE_SWITCH, .name="delta", .value=&delta_flag, .switch_value=1, .help="send only the changes against the terminal's copy of an earlier version of the file" },
+        { .type=ADOPT_TYPE_SWITCH, .name="pipeline", .value=&pipeline_flag, .switch_value=1, .help="read, encode and write on separate threads, which --compress already does for large files on multi-core machines" },
+        { .type=ADOPT_TYPE_SWITCH, .name="compress", .value=&compress_flag, .switch_value=1, .help="compress the data if the terminal accepts compressed data" },
+        { .type=ADOPT_TYPE_SWITCH, .name="base85", .value=&base85_flag, .switch_value=1, .help="send base85 instead of base64 if the terminal accepts it, which is 6% smaller but slower to encode" },
+        { .type=ADOPT_TYPE_SWITCH, .name="no-dedup", .value=&no_dedup_flag, .switch_value=1, .help="send every chunk even if the terminal already has some of them" },
+        { .type=ADOPT_TYPE_SWITCH, .name="no-mmap", .value=&no_mmap_flag, .switch_value=1, .help="read files instead of mapping them into memory" },
+        { .type=ADOPT_TYPE_SWITCH, .name="stream", .alias='s', .value=&stream_flag, .switch_value=1, .help="send stdin, and files which aren't regular ones, as they arrive instead of in whole chunks" },
+        { .type=ADOPT_TYPE_VALUE, .name="stream-idle", .value=&stream_idle, .help="milliseconds that streamed input may wait for more before it is sent (default: 50)" },
         { .type=ADOPT_TYPE_SWITCH, .name="text", .alias='t', .value=&text_flag, .switch_value=1, .help="treat the file as plain text" },
         { .type=ADOPT_TYPE_VALUE, .name="charset", .value=&charset, .help="the character set of the input file (default: UTF8)" },
         { .type=ADOPT_TYPE_VALUE, .name="mimetype", .value=&mimetype, .help="the mime-type of the input file (default: auto-detect)" },
@@ -163,15 +793,29 @@ int main(int argc, char *argv[]) {
         mimetype = "text/plain";
     }
 
+    int stream_idle_ms = NO_STREAMING;
+    if (stream_flag || stream_idle != NULL) {
+        if (pipeline_flag) {
+            fprintf(stderr, "[Error] --stream and --pipeline can't be used together.\n");
+            return EXIT_FAILURE;
+        }
+        stream_idle_ms = stream_idle != NULL ? atoi(stream_idle) : DEFAULT_STREAM_IDLE_MS;
+        if (stream_idle_ms < 0) {
+            stream_idle_ms = 0;
+        }
+    }
+
     if (filename_array) {
         for (int i = 0; i < result.args_len; i++) {
-            int result = show_file(filename, mimetype, charset, filename_array[i], download_flag);
+            int result = show_file(filename, mimetype, charset, filename_array[i], download_flag, pipeline_flag,
+                stream_idle_ms, !no_mmap_flag, compress_flag, base85_flag, !no_dedup_flag, delta_flag);
             if (result != EXIT_SUCCESS) {
                 return result;
             }
         }
     } else {
-        return show_stdin(mimetype, charset, filename, download_flag);
+        return show_stdin(mimetype, charset, filename, download_flag, pipeline_flag, stream_idle_ms, compress_flag,
+            base85_flag);
     }
     return EXIT_SUCCESS;
 }
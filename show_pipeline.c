@@ -0,0 +1,345 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Pipelined version of the chunk loop in `send_mimetype_data()`.
+ *
+ * Three threads are connected by bounded ring buffers:
+ *
+ *   reader --(read_slots)--> hasher/encoder --(encoded_slots)--> writer
+ *      ^                                                            |
+ *      +------------------------(free_slots)------------------------+
+ *
+ * A fixed pool of slots circulates between them, so memory use is bounded
+ * and a slow stage simply makes the others wait. There is exactly one
+ * hasher/encoder thread and every ring buffer is FIFO, which keeps the
+ * chained hash in the same order as the sequential loop.
+ *
+ * The writer times its writes for the chunk sizer, and the reader picks
+ * up the new chunk size for the next slot it fills. The writer also checks
+ * for a cancel between batches.
+ *
+ * With a content encoding or a hash tree, the reader also hands each slot
+ * to a pool of worker threads, one per core, through `work_slots`. The
+ * workers pack the chunks and, as a tree's leaves don't depend on each
+ * other, hash and encode the whole line too. The hasher/encoder still takes
+ * the slots in order from `read_slots` and waits for each one to be worked
+ * on, then has nothing left to do but add the leaf to the tree.
+ */
+
+#define PIPELINE_SLOT_COUNT 16
+#define PIPELINE_MAX_WORKERS 8
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    unsigned char *packed;
+    size_t packed_length;
+    unsigned char leaf[SHA256_SIZE_BYTES];
+    bool is_worked;             /* Guarded by `work_mutex`. */
+    char *line;
+    size_t line_length;
+} PipelineSlot;
+
+typedef struct {
+    FILE *input;
+    int output_fd;
+    TransferLines *lines;
+    ChunkSizer *sizer;
+    TransferCancel *cancel;
+    size_t chunk_bytes;         /* Shared copy of sizer->chunk_bytes, accessed atomically. */
+    bool is_packing;
+    Packing packing;            /* Settled by the reader before the first slot goes out to the workers. */
+    bool is_tree;
+    bool is_working;            /* Slots go through the workers. */
+
+    RingBuffer free_slots;
+    RingBuffer read_slots;
+    RingBuffer work_slots;
+    RingBuffer encoded_slots;
+
+    pthread_mutex_t work_mutex;
+    pthread_cond_t worked;
+    bool aborted;               /* Guarded by `work_mutex`. */
+
+    bool read_failed;
+    bool write_failed;
+    bool cancelled;
+} ShowPipeline;
+
+/**
+ * @return how many worker threads the pipeline runs when it has work for them, one per core.
+ */
+static int show_pipeline_worker_count() {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpu_count < 1 ? 1 : cpu_count > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : cpu_count;
+}
+
+static void show_pipeline_abort(ShowPipeline *pipeline) {
+    ring_buffer_close(&pipeline->free_slots);
+    ring_buffer_close(&pipeline->read_slots);
+    ring_buffer_close(&pipeline->work_slots);
+    ring_buffer_close(&pipeline->encoded_slots);
+
+    pthread_mutex_lock(&pipeline->work_mutex);
+    pipeline->aborted = true;
+    pthread_cond_broadcast(&pipeline->worked);
+    pthread_mutex_unlock(&pipeline->work_mutex);
+}
+
+static void *show_pipeline_reader(void *arg) {
+    ShowPipeline *pipeline = arg;
+    PipelineSlot *slot;
+
+    while (ring_buffer_pop(&pipeline->free_slots, (void **) &slot)) {
+        size_t chunk_bytes = __atomic_load_n(&pipeline->chunk_bytes, __ATOMIC_RELAXED);
+        slot->length = fread(slot->data, 1, chunk_bytes, pipeline->input);
+        if (slot->length == 0) {
+            if (!feof(pipeline->input)) {
+                pipeline->read_failed = true;
+            }
+            break;
+        }
+
+        if (pipeline->is_working) {
+            if (pipeline->is_packing) {
+                pipeline->packing = decide_packing(pipeline->packing, slot->data, slot->length);
+            }
+            slot->is_worked = false;
+            if (!ring_buffer_push(&pipeline->work_slots, slot)) {
+                break;
+            }
+        }
+        if (!ring_buffer_push(&pipeline->read_slots, slot)) {
+            break;
+        }
+    }
+
+    ring_buffer_close(&pipeline->work_slots);
+    ring_buffer_close(&pipeline->read_slots);
+    return NULL;
+}
+
+static void *show_pipeline_worker(void *arg) {
+    ShowPipeline *pipeline = arg;
+    PipelineSlot *slot;
+
+    while (ring_buffer_pop(&pipeline->work_slots, (void **) &slot)) {
+        if (pipeline->is_packing) {
+            slot->packed_length = lz_block_pack(slot->data, slot->length, pipeline->packing == PACKING_COMPRESS,
+                slot->packed);
+        }
+        if (pipeline->is_tree) {
+            const unsigned char *payload = pipeline->is_packing ? slot->packed : slot->data;
+            size_t payload_length = pipeline->is_packing ? slot->packed_length : slot->length;
+            tree_hash_leaf(payload, payload_length, slot->leaf);
+            slot->line_length = format_hashed_data_line(payload, payload_length, slot->leaf, pipeline->lines->is_base85,
+                slot->line);
+        }
+
+        pthread_mutex_lock(&pipeline->work_mutex);
+        slot->is_worked = true;
+        pthread_cond_broadcast(&pipeline->worked);
+        pthread_mutex_unlock(&pipeline->work_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Wait for a worker to finish with a slot.
+ *
+ * @return false if the pipeline was aborted first.
+ */
+static bool show_pipeline_wait_worked(ShowPipeline *pipeline, PipelineSlot *slot) {
+    pthread_mutex_lock(&pipeline->work_mutex);
+    while (!slot->is_worked && !pipeline->aborted) {
+        pthread_cond_wait(&pipeline->worked, &pipeline->work_mutex);
+    }
+    bool is_worked = slot->is_worked;
+    pthread_mutex_unlock(&pipeline->work_mutex);
+    return is_worked;
+}
+
+static void *show_pipeline_encoder(void *arg) {
+    ShowPipeline *pipeline = arg;
+    PipelineSlot *slot;
+
+    while (ring_buffer_pop(&pipeline->read_slots, (void **) &slot)) {
+        if (pipeline->is_working && !show_pipeline_wait_worked(pipeline, slot)) {
+            break;
+        }
+        if (pipeline->is_tree) {
+            tree_hash_push(&pipeline->lines->tree, slot->leaf);
+        } else if (pipeline->is_packing) {
+            slot->line_length = format_data_line(pipeline->lines, slot->packed, slot->packed_length, slot->line);
+        } else {
+            slot->line_length = format_data_line(pipeline->lines, slot->data, slot->length, slot->line);
+        }
+        if (!ring_buffer_push(&pipeline->encoded_slots, slot)) {
+            break;
+        }
+    }
+
+    ring_buffer_close(&pipeline->encoded_slots);
+    return NULL;
+}
+
+static void *show_pipeline_writer(void *arg) {
+    ShowPipeline *pipeline = arg;
+    PipelineSlot *batch[PIPELINE_SLOT_COUNT];
+    struct iovec iov[PIPELINE_SLOT_COUNT];
+
+    /* Gather every line that is ready and send them with a single writev(2). */
+    while (ring_buffer_pop(&pipeline->encoded_slots, (void **) &batch[0])) {
+        if (transfer_cancel_check(pipeline->cancel)) {
+            pipeline->cancelled = true;
+            show_pipeline_abort(pipeline);
+            break;
+        }
+
+        int batch_count = 1;
+        while (batch_count < PIPELINE_SLOT_COUNT &&
+                ring_buffer_try_pop(&pipeline->encoded_slots, (void **) &batch[batch_count])) {
+            batch_count++;
+        }
+
+        size_t batch_bytes = 0;
+        for (int i=0; i<batch_count; i++) {
+            iov[i].iov_base = batch[i]->line;
+            iov[i].iov_len = batch[i]->line_length;
+            batch_bytes += batch[i]->line_length;
+        }
+        double start_time = now_seconds();
+        if (!writev_fully(pipeline->output_fd, iov, batch_count)) {
+            pipeline->write_failed = true;
+            show_pipeline_abort(pipeline);
+            break;
+        }
+        chunk_sizer_update(pipeline->sizer, batch_bytes, now_seconds() - start_time);
+        __atomic_store_n(&pipeline->chunk_bytes, pipeline->sizer->chunk_bytes, __ATOMIC_RELAXED);
+
+        for (int i=0; i<batch_count; i++) {
+            ring_buffer_push(&pipeline->free_slots, batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Send the data lines for the whole of `fhandle` using the three stage pipeline.
+ *
+ * @param lines Takes in every data line. On success it is ready for the end line.
+ * @param sizer Decides the chunk sizes and is told how the writes go.
+ * @param packing PACKING_OFF, or PACKING_UNDECIDED to pack chunks with lz_block_pack().
+ * @return EXIT_SUCCESS, EXIT_FAILURE or EXIT_CANCELLED.
+ */
+int send_data_lines_pipelined(FILE *fhandle, TransferLines *lines, ChunkSizer *sizer, Packing packing,
+        TransferCancel *cancel) {
+    ShowPipeline pipeline = {
+        .input = fhandle,
+        .output_fd = STDOUT_FILENO,
+        .lines = lines,
+        .sizer = sizer,
+        .cancel = cancel,
+        .chunk_bytes = sizer->chunk_bytes,
+        .is_packing = packing != PACKING_OFF,
+        .packing = packing,
+        .is_tree = lines->is_tree,
+        .is_working = packing != PACKING_OFF || lines->is_tree,
+        .aborted = false,
+        .read_failed = false,
+        .write_failed = false,
+        .cancelled = false,
+    };
+
+    const size_t line_capacity = CHUNK_LINE_CAPACITY(sizer->max_bytes);
+    const size_t packed_capacity = packing != PACKING_OFF ? LZ_BLOCK_PACKED_BOUND(sizer->max_bytes) : 0;
+    const size_t slot_bytes = sizer->max_bytes + packed_capacity + line_capacity;
+    PipelineSlot slots[PIPELINE_SLOT_COUNT];
+    unsigned char *slot_memory = malloc(PIPELINE_SLOT_COUNT * slot_bytes);
+    if (slot_memory == NULL) {
+        perror("[Error] Unable to allocate the pipeline buffers.");
+        return EXIT_FAILURE;
+    }
+
+    RingBuffer *buffers[] = { &pipeline.free_slots, &pipeline.read_slots, &pipeline.work_slots,
+        &pipeline.encoded_slots };
+    const int buffer_count = sizeof(buffers) / sizeof(buffers[0]);
+    int ready_count = 0;
+    while (ready_count < buffer_count && ring_buffer_init(buffers[ready_count], PIPELINE_SLOT_COUNT)) {
+        ready_count++;
+    }
+    if (ready_count < buffer_count) {
+        perror("[Error] Unable to allocate the pipeline buffers.");
+        while (ready_count > 0) {
+            ring_buffer_destroy(buffers[--ready_count]);
+        }
+        free(slot_memory);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&pipeline.work_mutex, NULL);
+    pthread_cond_init(&pipeline.worked, NULL);
+
+    for (int i=0; i<PIPELINE_SLOT_COUNT; i++) {
+        slots[i].data = slot_memory + i * slot_bytes;
+        slots[i].packed = slots[i].data + sizer->max_bytes;
+        slots[i].line = (char *) slots[i].packed + packed_capacity;
+        ring_buffer_push(&pipeline.free_slots, &slots[i]);
+    }
+
+    int worker_count = pipeline.is_working ? show_pipeline_worker_count() : 0;
+
+    /* The writer starts last, so nothing reaches the terminal unless every stage is running. */
+    pthread_t reader_thread, encoder_thread, writer_thread;
+    pthread_t worker_threads[PIPELINE_MAX_WORKERS];
+    bool is_reader_started = pthread_create(&reader_thread, NULL, show_pipeline_reader, &pipeline) == 0;
+    int started_worker_count = 0;
+    while (is_reader_started && started_worker_count < worker_count &&
+            pthread_create(&worker_threads[started_worker_count], NULL, show_pipeline_worker, &pipeline) == 0) {
+        started_worker_count++;
+    }
+    bool is_encoder_started = is_reader_started && started_worker_count == worker_count &&
+        pthread_create(&encoder_thread, NULL, show_pipeline_encoder, &pipeline) == 0;
+    bool is_writer_started = is_encoder_started &&
+        pthread_create(&writer_thread, NULL, show_pipeline_writer, &pipeline) == 0;
+
+    if (is_writer_started) {
+        pthread_join(writer_thread, NULL);
+    } else {
+        fputs("[Error] Unable to start the pipeline threads.\n", stderr);
+    }
+    /* If the writer gave up early, or never started, the other stages may still be waiting on a buffer. */
+    show_pipeline_abort(&pipeline);
+    if (is_encoder_started) {
+        pthread_join(encoder_thread, NULL);
+    }
+    for (int i=0; i<started_worker_count; i++) {
+        pthread_join(worker_threads[i], NULL);
+    }
+    if (is_reader_started) {
+        pthread_join(reader_thread, NULL);
+    }
+
+    pthread_cond_destroy(&pipeline.worked);
+    pthread_mutex_destroy(&pipeline.work_mutex);
+    ring_buffer_destroy(&pipeline.encoded_slots);
+    ring_buffer_destroy(&pipeline.work_slots);
+    ring_buffer_destroy(&pipeline.read_slots);
+    ring_buffer_destroy(&pipeline.free_slots);
+    free(slot_memory);
+
+    if (!is_writer_started || pipeline.read_failed || pipeline.write_failed) {
+        return EXIT_FAILURE;
+    }
+    if (pipeline.cancelled) {
+        return EXIT_CANCELLED;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,268 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* Longest line the terminal may answer with, which is also about what a tty takes in a line. */
+#define TRANSFER_CANCEL_REPLY_BYTES 4096
+
+/* Most type-ahead kept to give back to the tty at the end. */
+#define TRANSFER_CANCEL_TYPED_BYTES 4096
+
+/**
+ * Notices when a transfer to the terminal should stop early.
+ *
+ * Either the user hits Ctrl+C, or the terminal sends a line starting with
+ * "#A:" to our tty, the same abort line it uses for frame transfers.
+ * While a transfer is being watched, anything else typed into the tty has
+ * to be read to get to the abort line, as a tty can't be peeked at. The tty
+ * stays in canonical mode, so only whole lines are read, never one still
+ * being typed. They are kept, and pushed back into the tty's input with
+ * TIOCSTI once the transfer ends, so that the shell still gets the
+ * type-ahead. Where TIOCSTI isn't allowed, as on Linux with
+ * dev.tty.legacy_tiocsti set to 0, or the type-ahead overflows
+ * TRANSFER_CANCEL_TYPED_BYTES, it is lost and that is reported on stderr,
+ * so it doesn't go missing silently. A second Ctrl+C gets the usual
+ * treatment, in case we are stuck waiting on a terminal which has stopped
+ * reading.
+ *
+ * Transfer modes in which the terminal answers us read the answer through
+ * here too, see transfer_cancel_read_reply().
+ */
+typedef struct {
+    int fd;                 /* The tty being watched, or -1. */
+    bool is_line_start;
+    int match_length;       /* How much of "#A:" has been matched at the start of the line. */
+    bool is_cancelled;
+    char reply[TRANSFER_CANCEL_REPLY_BYTES];
+    size_t reply_length;    /* Read from the tty, but not taken as a reply yet. */
+    char typed[TRANSFER_CANCEL_TYPED_BYTES];
+    size_t typed_length;    /* Type-ahead to give back to the tty. */
+    size_t typed_line_start;    /* Where the current line of it starts. */
+    bool is_typed_overflowed;   /* Some type-ahead didn't fit in `typed`. */
+} TransferCancel;
+
+/* Process exit status of a cancelled transfer, as after SIGINT. */
+#define EXIT_CANCELLED 130
+
+static volatile sig_atomic_t is_sigint_received = 0;
+static struct sigaction sigint_action_before_transfer;
+
+static void note_sigint(int signal_number) {
+    (void) signal_number;
+    if (is_sigint_received) {
+        sigaction(SIGINT, &sigint_action_before_transfer, NULL);
+        raise(SIGINT);
+        return;
+    }
+    is_sigint_received = 1;
+}
+
+/**
+ * Start watching for a cancel.
+ *
+ * @param tty_fd The terminal to listen to, or -1 if only Ctrl+C counts.
+ */
+void transfer_cancel_begin(TransferCancel *cancel, int tty_fd) {
+    cancel->fd = tty_fd;
+    cancel->is_line_start = true;
+    cancel->match_length = 0;
+    cancel->is_cancelled = false;
+    cancel->reply_length = 0;
+    cancel->typed_length = 0;
+    cancel->typed_line_start = 0;
+    cancel->is_typed_overflowed = false;
+
+    is_sigint_received = 0;
+    struct sigaction action = {0};
+    action.sa_handler = note_sigint;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &sigint_action_before_transfer);
+}
+
+/**
+ * Put back the SIGINT handling from before transfer_cancel_begin(), and
+ * give the type-ahead back to the tty.
+ */
+void transfer_cancel_end(TransferCancel *cancel) {
+    sigaction(SIGINT, &sigint_action_before_transfer, NULL);
+    if (cancel->fd == -1) {
+        /* The tty went away, and what was typed into it with it. */
+        cancel->typed_length = 0;
+        return;
+    }
+
+    size_t given_length = 0;
+    int error = ENOTSUP;
+#ifdef TIOCSTI
+    while (given_length < cancel->typed_length) {
+        if (ioctl(cancel->fd, TIOCSTI, &cancel->typed[given_length]) == -1) {
+            error = errno;
+            break;
+        }
+        given_length++;
+    }
+#endif
+    if (given_length < cancel->typed_length) {
+        fprintf(stderr, "[Error] Unable to give %zu bytes typed during the transfer back to the tty. %s\n",
+            cancel->typed_length - given_length, strerror(error));
+    }
+    if (cancel->is_typed_overflowed) {
+        fprintf(stderr, "[Error] More was typed during the transfer than could be kept, and some of it was lost.\n");
+    }
+    cancel->typed_length = 0;
+}
+
+/**
+ * Look for an abort line in input from the tty, and keep the rest as type-ahead.
+ */
+static void scan_for_abort_line(TransferCancel *cancel, const char *data, size_t length) {
+    static const char ABORT_PREFIX[] = "#A:";
+    for (size_t i=0; i<length && !cancel->is_cancelled; i++) {
+        char c = data[i];
+        if (cancel->typed_length < sizeof(cancel->typed)) {
+            cancel->typed[cancel->typed_length++] = c;
+        } else {
+            cancel->is_typed_overflowed = true;
+        }
+        if (c == '\n' || c == '\r') {
+            cancel->is_line_start = true;
+            cancel->match_length = 0;
+            cancel->typed_line_start = cancel->typed_length;
+            continue;
+        }
+        if (cancel->is_line_start && c == ABORT_PREFIX[cancel->match_length]) {
+            cancel->match_length++;
+            if (cancel->match_length == sizeof(ABORT_PREFIX) - 1) {
+                /* The abort line is the terminal's, not type-ahead. */
+                cancel->typed_length = cancel->typed_line_start;
+                cancel->is_cancelled = true;
+            }
+        } else {
+            cancel->is_line_start = false;
+        }
+    }
+}
+
+/**
+ * Read whatever the tty has for us without blocking.
+ */
+static void read_tty_input(TransferCancel *cancel) {
+    char buffer[256];
+    struct pollfd pfd = { .fd = cancel->fd, .events = POLLIN };
+    while (!cancel->is_cancelled && poll(&pfd, 1, 0) == 1) {
+        if ((pfd.revents & POLLIN) == 0) {
+            /* Hung up. Nobody is left to cancel anything. */
+            cancel->fd = -1;
+            return;
+        }
+        ssize_t count = read(cancel->fd, buffer, sizeof(buffer));
+        if (count <= 0) {
+            if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            cancel->fd = -1;
+            return;
+        }
+        scan_for_abort_line(cancel, buffer, count);
+    }
+}
+
+/**
+ * Check for a cancel. Never blocks.
+ */
+bool transfer_cancel_check(TransferCancel *cancel) {
+    if (is_sigint_received) {
+        cancel->is_cancelled = true;
+    }
+    if (!cancel->is_cancelled && cancel->reply_length != 0) {
+        /* Whatever came after the last reply. */
+        scan_for_abort_line(cancel, cancel->reply, cancel->reply_length);
+        cancel->reply_length = 0;
+    }
+    if (!cancel->is_cancelled && cancel->fd != -1) {
+        read_tty_input(cancel);
+    }
+    return cancel->is_cancelled;
+}
+
+/**
+ * Wait for the next line which the terminal sends in answer to the transfer.
+ *
+ * An abort line or Ctrl+C cancels the transfer instead.
+ *
+ * @param line Receives the line without its line end, NUL terminated. It
+ *          must hold TRANSFER_CANCEL_REPLY_BYTES chars.
+ * @param timeout_ms Longest wait for the whole line.
+ * @return the length of the line, or -1 if the transfer was cancelled, the
+ *          tty closed, the line was too long or it didn't come in time.
+ */
+long transfer_cancel_read_reply(TransferCancel *cancel, char *line, int timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (true) {
+        char *newline = memchr(cancel->reply, '\n', cancel->reply_length);
+        if (newline != NULL) {
+            size_t line_length = newline - cancel->reply;
+            size_t consumed = line_length + 1;
+            if (line_length != 0 && cancel->reply[line_length - 1] == '\r') {
+                line_length--;
+            }
+            memcpy(line, cancel->reply, line_length);
+            line[line_length] = '\0';
+            memmove(cancel->reply, cancel->reply + consumed, cancel->reply_length - consumed);
+            cancel->reply_length -= consumed;
+            cancel->is_line_start = true;
+            cancel->match_length = 0;
+            cancel->typed_line_start = cancel->typed_length;
+            if (strncmp(line, "#A:", 3) == 0) {
+                cancel->is_cancelled = true;
+                return -1;
+            }
+            return line_length;
+        }
+
+        if (is_sigint_received) {
+            cancel->is_cancelled = true;
+        }
+        if (cancel->is_cancelled || cancel->fd == -1 || cancel->reply_length == sizeof(cancel->reply)) {
+            return -1;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= timeout_ms) {
+            return -1;
+        }
+        struct pollfd pfd = { .fd = cancel->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms - elapsed_ms);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        ssize_t count = read(cancel->fd, cancel->reply + cancel->reply_length,
+            sizeof(cancel->reply) - cancel->reply_length);
+        if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (count <= 0) {
+            cancel->fd = -1;
+            return -1;
+        }
+        cancel->reply_length += count;
+    }
+}
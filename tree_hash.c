@@ -0,0 +1,101 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libs/sha256.h"
+
+/*
+ * The "tree-sha256" integrity mode of file transfers.
+ *
+ * Instead of chaining, each data line carries the hash of its own payload,
+ * a leaf of a Merkle tree, and the end line carries the root of the tree.
+ * Lines can then be hashed and checked in any order and on any number of
+ * threads, while the root still ties every line to its place in the file.
+ *
+ * The tree is the one from RFC 6962: a leaf is SHA-256(0x00 || payload), a
+ * node is SHA-256(0x01 || left || right), and a tree of n leaves has the
+ * largest power of two below n on its left. The root of no leaves at all
+ * is the hash of nothing.
+ */
+
+#define INTEGRITY_TREE_SHA256 "tree-sha256"
+
+/* Enough for 2^64 leaves. */
+#define TREE_HASH_MAX_DEPTH 64
+
+/**
+ * Builds the root from the leaves as they come, in order.
+ *
+ * Only the roots of the complete subtrees seen so far are kept, one for
+ * each bit set in the leaf count, biggest first.
+ */
+typedef struct {
+    int count;
+    uint64_t leaf_counts[TREE_HASH_MAX_DEPTH];
+    unsigned char hashes[TREE_HASH_MAX_DEPTH][SHA256_SIZE_BYTES];
+} TreeHash;
+
+void tree_hash_init(TreeHash *tree) {
+    tree->count = 0;
+}
+
+/**
+ * Hash the payload of one line.
+ *
+ * This is independent of every other line, so any thread may do it.
+ */
+void tree_hash_leaf(const void *data, size_t length, unsigned char *leaf) {
+    const unsigned char prefix = 0x00;
+    sha256_context hash;
+    sha256_init(&hash);
+    sha256_hash(&hash, &prefix, 1);
+    sha256_hash(&hash, data, length);
+    sha256_done(&hash, leaf);
+}
+
+static void tree_hash_node(const unsigned char *left, const unsigned char *right, unsigned char *node) {
+    const unsigned char prefix = 0x01;
+    sha256_context hash;
+    sha256_init(&hash);
+    sha256_hash(&hash, &prefix, 1);
+    sha256_hash(&hash, left, SHA256_SIZE_BYTES);
+    sha256_hash(&hash, right, SHA256_SIZE_BYTES);
+    sha256_done(&hash, node);
+}
+
+/**
+ * Add the next leaf, as made by tree_hash_leaf().
+ */
+void tree_hash_push(TreeHash *tree, const unsigned char *leaf) {
+    memcpy(tree->hashes[tree->count], leaf, SHA256_SIZE_BYTES);
+    tree->leaf_counts[tree->count] = 1;
+    tree->count++;
+
+    while (tree->count >= 2 && tree->leaf_counts[tree->count - 2] == tree->leaf_counts[tree->count - 1]) {
+        tree->count--;
+        tree_hash_node(tree->hashes[tree->count - 1], tree->hashes[tree->count], tree->hashes[tree->count - 1]);
+        tree->leaf_counts[tree->count - 1] *= 2;
+    }
+}
+
+/**
+ * Get the root of the tree over every leaf pushed so far.
+ */
+void tree_hash_root(const TreeHash *tree, unsigned char *root) {
+    if (tree->count == 0) {
+        sha256("", 0, root);
+        return;
+    }
+
+    /* The smaller subtrees on the right join up first. */
+    memcpy(root, tree->hashes[tree->count - 1], SHA256_SIZE_BYTES);
+    for (int i=tree->count-2; i>=0; i--) {
+        tree_hash_node(tree->hashes[i], root, root);
+    }
+}
@@ -0,0 +1,179 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libs/base64.c"
+
+#include "tty_utils.c"
+#include "utils.h"
+#include "utils.c"
+#include "output_buffer.c"
+#include "line_reader.c"
+
+/*
+ * Measures how fast frame data lines can be pushed through a pty into a
+ * reader like `from`, with the slave side in canonical mode (ECHO off only,
+ * what `from` used to do) and in raw mode.
+ *
+ * Canonical mode can't carry lines longer than the line discipline's 4095
+ * byte limit, so it is measured with small chunks only.
+ */
+
+typedef struct {
+    const char *name;
+    bool raw;
+    size_t payload_bytes;
+} BenchCase;
+
+/**
+ * The receiving side. Runs in the child with the pty slave as stdin.
+ */
+static void receive_lines(bool raw, int result_fd) {
+    if (raw) {
+        turn_on_raw_mode();
+    } else {
+        turn_off_echo();
+    }
+
+    /* Tell the parent that the tty is set up. */
+    char ready = 'R';
+    write(result_fd, &ready, 1);
+
+    LineReader reader;
+    line_reader_init(&reader, STDIN_FILENO, LINE_READER_DEFAULT_CAPACITY);
+    unsigned char *decoded = NULL;
+    size_t decoded_capacity = 0;
+    size_t total_bytes = 0;
+    double start_time = 0;
+
+    Slice line;
+    while (line_reader_next(&reader, &line)) {
+        if (start_time == 0) {
+            start_time = now_seconds();
+        }
+        if (slice_starts_with(line, "#E:")) {
+            break;
+        }
+        size_t b64_length = line.length - 3 - 20 - 1;
+        if (decoded_capacity < b64d_size(b64_length)) {
+            decoded_capacity = b64d_size(b64_length);
+            decoded = realloc(decoded, decoded_capacity);
+        }
+        unsigned int decoded_length = 0;
+        if (b64_decode_validate((const unsigned char *) line.data + 3, b64_length, decoded, &decoded_length) != -1) {
+            fprintf(stderr, "[Error] Line arrived damaged.\n");
+            exit(EXIT_FAILURE);
+        }
+        total_bytes += decoded_length;
+    }
+
+    double elapsed = now_seconds() - start_time;
+    write(result_fd, &total_bytes, sizeof(total_bytes));
+    write(result_fd, &elapsed, sizeof(elapsed));
+    free(decoded);
+    line_reader_free(&reader);
+    exit(EXIT_SUCCESS);
+}
+
+static bool run_case(const BenchCase *bench_case, size_t total_bytes) {
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+        perror("[Error] Unable to create a pty");
+        return false;
+    }
+
+    int result_pipe[2];
+    if (pipe(result_pipe) != 0) {
+        perror("[Error] pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int slave_fd = open(ptsname(master_fd), O_RDWR);
+        if (slave_fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+        dup2(slave_fd, STDIN_FILENO);
+        close(slave_fd);
+        close(master_fd);
+        close(result_pipe[0]);
+        receive_lines(bench_case->raw, result_pipe[1]);
+    }
+    close(result_pipe[1]);
+
+    char ready;
+    if (read(result_pipe[0], &ready, 1) != 1) {
+        fprintf(stderr, "[Error] Receiver failed to start.\n");
+        return false;
+    }
+
+    /* One data line, repeated. The hash isn't checked by the receiver. */
+    unsigned char *payload = malloc(bench_case->payload_bytes);
+    for (size_t i=0; i<bench_case->payload_bytes; i++) {
+        payload[i] = i * 31 + 7;
+    }
+    char *line = malloc(3 + b64e_size(bench_case->payload_bytes) + 1 + 20 + 2);
+    size_t line_length = 0;
+    memcpy(line, "#D:", 3);
+    line_length = 3 + b64_encode(payload, bench_case->payload_bytes, (unsigned char *) line + 3);
+    memcpy(line + line_length, ":0123456789abcdef0123\n", 22);
+    line_length += 22;
+
+    size_t sent_bytes = 0;
+    while (sent_bytes < total_bytes) {
+        if (!write_fully(master_fd, line, line_length)) {
+            perror("[Error] Writing to the pty");
+            return false;
+        }
+        sent_bytes += bench_case->payload_bytes;
+    }
+    const char *end_line = "#E::0123456789abcdef0123\n";
+    write_fully(master_fd, end_line, strlen(end_line));
+
+    size_t received_bytes = 0;
+    double elapsed = 0;
+    read(result_pipe[0], &received_bytes, sizeof(received_bytes));
+    read(result_pipe[0], &elapsed, sizeof(elapsed));
+    waitpid(pid, NULL, 0);
+
+    printf("%-10s %8zu B chunks  %8.1f MB/s  %s\n", bench_case->name, bench_case->payload_bytes,
+        received_bytes / elapsed / 1e6, received_bytes == sent_bytes ? "" : "(data lost)");
+
+    free(line);
+    free(payload);
+    close(result_pipe[0]);
+    close(master_fd);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    size_t total_mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+
+    const BenchCase cases[] = {
+        { "canonical", false, 2 * 1024 },
+        { "raw", true, 2 * 1024 },
+        { "raw", true, 48 * 1024 },
+        { "raw", true, 1024 * 1024 },
+    };
+
+    printf("Frame download through a pty, %zu MiB per case\n", total_mib);
+    for (int i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+        if (!run_case(&cases[i], total_mib * 1024 * 1024)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,31 +1,112 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
 #include <unistd.h>
 #include <termios.h>
 
 struct termios old_tty_settings;
+bool is_old_tty_settings = false;
+
+/*
+ * Raw mode read tuning. With VMIN=1 and VTIME=0 a read(2) returns as soon as
+ * anything is queued, and returns everything that is queued. While data
+ * streams in faster than it is consumed the reads naturally grow to fill the
+ * reader's buffer, and the last line of a frame is never held back waiting
+ * on an inter-byte timer. See tty_bench.c.
+ */
+#define RAW_MODE_VMIN 1
+#define RAW_MODE_VTIME 0
 
 void restore_tty() {
-    tcsetattr(STDIN_FILENO, TCSADRAIN, &old_tty_settings);
+    if (is_old_tty_settings) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &old_tty_settings);
+    }
     fflush(stderr);
 }
 
+static void restore_tty_on_signal(int signal_number) {
+    /* Only async-signal-safe calls in here. Any half received frame is dropped
+       so that it doesn't end up being fed to the shell. */
+    if (is_old_tty_settings) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_tty_settings);
+    }
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+/**
+ * Remember the tty settings as they were before we touched them.
+ *
+ * Only the first call saves anything, so that later calls can't mistake our
+ * own modified settings for the user's. The settings are put back at exit
+ * and when we are killed by a signal.
+ */
+static bool save_tty_settings() {
+    if (is_old_tty_settings) {
+        return true;
+    }
+
+    if (tcgetattr(STDIN_FILENO, &old_tty_settings) == -1) {
+        perror("tcgetattr");
+        return false;
+    }
+    is_old_tty_settings = true;
+
+    /* Set up a hook to restore the tty settings at exit. */
+    atexit(restore_tty);
+
+    const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+    for (int i=0; i<sizeof(signals)/sizeof(signals[0]); i++) {
+        struct sigaction action = {0};
+        action.sa_handler = restore_tty_on_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(signals[i], &action, NULL);
+    }
+    return true;
+}
+
 void turn_off_echo() {
     /* Turn off echo on the tty. */
     if (!isatty(STDIN_FILENO)) {
         return;
     }
 
-    if (tcgetattr(STDIN_FILENO, &old_tty_settings) == -1) {
-        perror("tcgetattr");
+    if (!save_tty_settings()) {
         return;
     }
 
-    struct termios new_tty_settings;
-    tcgetattr(STDIN_FILENO, &new_tty_settings);
+    struct termios new_tty_settings = old_tty_settings;
     new_tty_settings.c_lflag = new_tty_settings.c_lflag & ~ECHO;
 
     tcsetattr(STDIN_FILENO, TCSADRAIN, &new_tty_settings);
+}
 
-    /* Set up a hook to restore the tty settings at exit. */
-    atexit(restore_tty);
+/**
+ * Put the tty on stdin into non-canonical raw input mode.
+ *
+ * The kernel's line discipline stops assembling lines, translating chars
+ * and echoing, so arbitrarily long lines arrive untouched and the reader
+ * does its own framing. Lines may then end in '\r' instead of '\n'.
+ *
+ * Output processing is left alone because stdout is usually the same tty.
+ * ISIG also stays on so that the user can still interrupt a stuck transfer;
+ * the protocol's base64 lines never contain those control chars.
+ */
+void turn_on_raw_mode() {
+    if (!isatty(STDIN_FILENO)) {
+        return;
+    }
+
+    if (!save_tty_settings()) {
+        return;
+    }
+
+    struct termios new_tty_settings = old_tty_settings;
+    new_tty_settings.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    new_tty_settings.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN);
+    new_tty_settings.c_cc[VMIN] = RAW_MODE_VMIN;
+    new_tty_settings.c_cc[VTIME] = RAW_MODE_VTIME;
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &new_tty_settings);
 }
@@ -6,10 +6,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
 
 #include "libs/sha256.h"
 #include "arena.h"
@@ -47,42 +50,212 @@ int file_extension_index(char *str) {
     return -1;
 }
 
-char *find_suitable_filename(char *filename) {
-  const int COUNTER_WIDTH = 3;
+/**
+ * The numbered variations of a file name which already exist in a directory.
+ *
+ * For "dir/foo.txt" these are "foo.txt" itself, numbered as 0, and the
+ * names "foo(N).txt" for N >= 1. The numbers are kept sorted.
+ */
+typedef struct {
+    char *directory;
+    char *stem;                 /* Base name without the extension. */
+    const char *extension;      /* Extension including its '.', may be "". */
+    unsigned long long *used;
+    size_t used_count;
+    bool is_listed;             /* The directory could be read, so `used` is complete. */
+} FilenameVariations;
 
-  if (access(filename, F_OK) != 0) {
-      return strdup(filename);
-  }
+static int compare_counters(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
 
-  int ext_index = file_extension_index(filename);
+/**
+ * Parse the N out of a directory entry of the form "<stem>(N)<extension>".
+ */
+static bool parse_variation_counter(const FilenameVariations *variations, const char *name,
+        unsigned long long *counter) {
 
-  char *tmp_filename = strdup(filename);
-  char *template = NULL;
-  char *result = NULL;
-  if (ext_index != -1) {
-      tmp_filename[ext_index] = '\0';
-      template = malloc(strlen(filename) + strlen("(%u)") + 1);
-      sprintf(template, "%s(%%u).%s", tmp_filename, tmp_filename + ext_index + 1);
-      free(tmp_filename);
-  } else {
-      template = malloc(strlen(filename) + strlen("(%u)") + 1);
-      sprintf(template, "%s(%%u)", filename);
-  }
-  result = malloc(strlen(filename) + 2 + COUNTER_WIDTH + 1);
+    size_t stem_length = strlen(variations->stem);
+    if (strncmp(name, variations->stem, stem_length) != 0 || name[stem_length] != '(') {
+        return false;
+    }
+    const char *digits = name + stem_length + 1;
+    const char *p = digits;
+    unsigned long long value = 0;
+    while (isdigit((unsigned char) *p)) {
+        unsigned int digit = *p - '0';
+        if (value > (ULLONG_MAX - digit) / 10) {
+            return false;   /* Nobody is going to count that far. */
+        }
+        value = value * 10 + digit;
+        p++;
+    }
+    if (p == digits || value == 0 || *p != ')' || strcmp(p + 1, variations->extension) != 0) {
+        return false;
+    }
+    *counter = value;
+    return true;
+}
+
+/**
+ * Collect the used variations of `filename` with a single scan of its directory.
+ *
+ * A directory which can't be read leaves `is_listed` false and no variations used.
+ *
+ * @return false if out of memory.
+ */
+static bool scan_filename_variations(const char *filename, FilenameVariations *variations) {
+    const char *slash = strrchr(filename, '/');
+    const char *base_name = slash != NULL ? slash + 1 : filename;
+    variations->directory = slash == NULL ? strdup(".")
+        : slash == filename ? strdup("/") : strndup(filename, slash - filename);
+    variations->stem = strdup(base_name);
+    int ext_index = file_extension_index(variations->stem);
+    if (ext_index != -1) {
+        variations->extension = base_name + ext_index;
+        variations->stem[ext_index] = '\0';
+    } else {
+        variations->extension = "";
+    }
+    variations->used = NULL;
+    variations->used_count = 0;
+    variations->is_listed = false;
+    if (variations->directory == NULL || variations->stem == NULL) {
+        return false;
+    }
+
+    DIR *dir = opendir(variations->directory);
+    if (dir == NULL) {
+        return true;
+    }
+
+    size_t used_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long counter;
+        if (strcmp(entry->d_name, base_name) == 0) {
+            counter = 0;
+        } else if (!parse_variation_counter(variations, entry->d_name, &counter)) {
+            continue;
+        }
+
+        if (variations->used_count == used_capacity) {
+            used_capacity = used_capacity == 0 ? 64 : used_capacity * 2;
+            unsigned long long *used = realloc(variations->used, used_capacity * sizeof(unsigned long long));
+            if (used == NULL) {
+                closedir(dir);
+                return false;
+            }
+            variations->used = used;
+        }
+        variations->used[variations->used_count++] = counter;
+    }
+    closedir(dir);
+    variations->is_listed = true;
+
+    qsort(variations->used, variations->used_count, sizeof(unsigned long long), compare_counters);
+    return true;
+}
+
+static void free_filename_variations(FilenameVariations *variations) {
+    free(variations->directory);
+    free(variations->stem);
+    free(variations->used);
+}
+
+static char *format_filename_variation(const char *filename, const FilenameVariations *variations,
+        unsigned long long counter) {
+
+    if (counter == 0) {
+        return strdup(filename);
+    }
+    size_t directory_length = strlen(filename) - strlen(variations->stem) - strlen(variations->extension);
+    size_t length = directory_length + strlen(variations->stem) + 2 + 20 + strlen(variations->extension) + 1;
+    char *result = malloc(length);
+    if (result == NULL) {
+        return NULL;
+    }
+    snprintf(result, length, "%.*s%s(%llu)%s", (int) directory_length, filename, variations->stem, counter,
+        variations->extension);
+    return result;
+}
+
+/**
+ * Find a name for a new file which doesn't clash with any existing file.
+ *
+ * This is `filename` itself if it is free, otherwise the lowest numbered
+ * free variation like "foo(2).txt". The directory is only read once. When
+ * it can't be read, as in a write-only directory, the plain name and then
+ * its variations are simply tried in turn.
+ *
+ * @param filename_claim Called to atomically take each candidate name in
+ *          turn, until it succeeds. It must fail with errno set to EEXIST if
+ *          the name has been taken in the meantime. Any other failure stops
+ *          the search. NULL just picks the first free name, racily.
+ * @return the new malloc'ed file name, or NULL.
+ */
+char *claim_suitable_filename(const char *filename, bool (*filename_claim)(const char *candidate, void *context),
+        void *context) {
+
+    FilenameVariations variations;
+    if (!scan_filename_variations(filename, &variations)) {
+        free_filename_variations(&variations);
+        return NULL;
+    }
+
+    char *result = NULL;
+    size_t used_index = 0;
+    for (unsigned long long counter=0; counter<ULLONG_MAX; counter++) {
+        while (used_index < variations.used_count && variations.used[used_index] < counter) {
+            used_index++;
+        }
+        if (used_index < variations.used_count && variations.used[used_index] == counter) {
+            continue;
+        }
+
+        char *candidate = format_filename_variation(filename, &variations, counter);
+        if (candidate == NULL) {
+            break;
+        }
+        if (filename_claim == NULL) {
+            /* Without a listing of the directory, ask about each name instead. */
+            if (variations.is_listed || access(candidate, F_OK) != 0) {
+                result = candidate;
+                break;
+            }
+            errno = EEXIST;
+        } else if (filename_claim(candidate, context)) {
+            result = candidate;
+            break;
+        }
+        free(candidate);
+        if (errno != EEXIST) {
+            break;
+        }
+    }
 
-  const unsigned int max_counter = pow(10, COUNTER_WIDTH);
+    free_filename_variations(&variations);
+    return result;
+}
 
-  for (unsigned int i=1; i<max_counter; i++) {
-      sprintf(result, template, i);
-      if (access(result, F_OK) != 0) {
-          free(template);
-          return result;
-      }
-  }
+/**
+ * Claim a file name by creating the file with O_EXCL.
+ *
+ * @param context Points to an int which receives the open file descriptor.
+ */
+bool create_file_exclusive(const char *filename, void *context) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return false;
+    }
+    *(int *) context = fd;
+    return true;
+}
 
-  free(template);
-  free(result);
-  return NULL;
+char *find_suitable_filename(const char *filename) {
+    return claim_suitable_filename(filename, NULL, NULL);
 }
 
 void string_strip(char *buffer) {
@@ -120,23 +293,66 @@ char nibble_to_char(unsigned char nibble) {
     return nibble < 10 ? '0' + nibble : 'a' + (nibble - 10);
 }
 
-void print_hex(unsigned char *buffer, size_t count) {
+/**
+ * Format bytes as lowercase hex.
+ *
+ * @param hex_buffer Receives `count * 2` chars. No NUL is appended.
+ */
+void bytes_to_hex(const unsigned char *bytes, size_t count, char *hex_buffer) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
     for (size_t i=0; i<count; i++) {
-        unsigned char byte = buffer[i];
-        unsigned char nibble = byte & 0xf;
-        unsigned char top_nibble = (byte >> 4) & 0xf;
-        char c1 = nibble_to_char(top_nibble);
-        char c2 = nibble_to_char(nibble);
-        printf("%c%c", c1, c2);
+        unsigned char b = bytes[i];
+        hex_buffer[i*2] = HEX_DIGITS[b >> 4];
+        hex_buffer[i*2+1] = HEX_DIGITS[b & 0x0f];
     }
 }
 
-void sha256_hash_to_hex(unsigned char *bytes, char *hex_buffer) {
-    for (int i=0; i<SHA256_SIZE_BYTES; i++) {
-        unsigned char b = bytes[i];
-        hex_buffer[i*2] = nibble_to_char((b & 0xf0) >> 4);
-        hex_buffer[i*2+1] = nibble_to_char(b & 0x0f);
+/**
+ * @return the value of a hex digit in either case, or -1.
+ */
+int hex_char_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
     }
+    return -1;
+}
+
+/**
+ * Parse `count * 2` hex digits.
+ *
+ * @return false if any of them isn't a hex digit.
+ */
+bool hex_to_bytes(const char *hex, size_t count, unsigned char *bytes) {
+    for (size_t i=0; i<count; i++) {
+        int high = hex_char_value(hex[i*2]);
+        int low = hex_char_value(hex[i*2+1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        bytes[i] = high << 4 | low;
+    }
+    return true;
+}
+
+void print_hex(unsigned char *buffer, size_t count) {
+    char hex_buffer[256];
+    while (count != 0) {
+        size_t piece = count < sizeof(hex_buffer) / 2 ? count : sizeof(hex_buffer) / 2;
+        bytes_to_hex(buffer, piece, hex_buffer);
+        fwrite(hex_buffer, 1, piece * 2, stdout);
+        buffer += piece;
+        count -= piece;
+    }
+}
+
+void sha256_hash_to_hex(unsigned char *bytes, char *hex_buffer) {
+    bytes_to_hex(bytes, SHA256_SIZE_BYTES, hex_buffer);
     hex_buffer[SHA256_SIZE_BYTES * 2] = '\0';
 }
 
@@ -153,3 +369,41 @@ char *arena_strdup(Arena *arena, const char *str) {
     strncpy(new_str, str, len);
     return new_str;
 }
+
+/**
+ * Check whether a comma separated list holds a name.
+ *
+ * @param list The list, or NULL for an empty one.
+ */
+bool list_contains(const char *list, const char *name) {
+    size_t name_length = strlen(name);
+    while (list != NULL && *list != '\0') {
+        const char *comma = strchr(list, ',');
+        size_t length = comma != NULL ? (size_t) (comma - list) : strlen(list);
+        if (length == name_length && strncmp(list, name, length) == 0) {
+            return true;
+        }
+        list = comma != NULL ? comma + 1 : NULL;
+    }
+    return false;
+}
+
+/**
+ * Add a name to the end of a comma separated list.
+ *
+ * @param list NUL terminated list, empty to start with.
+ * @param capacity Size of the buffer holding `list`.
+ * @return false if the name didn't fit, which leaves the list as it was.
+ */
+bool list_append(char *list, size_t capacity, const char *name) {
+    size_t length = strlen(list);
+    size_t name_length = strlen(name);
+    if (length + (length != 0 ? 1 : 0) + name_length + 1 > capacity) {
+        return false;
+    }
+    if (length != 0) {
+        list[length++] = ',';
+    }
+    memcpy(list + length, name, name_length + 1);
+    return true;
+}
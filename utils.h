@@ -0,0 +1,20 @@
+/**
+ * Copyright 2024 Simon Edwards <simon@simonzone.com>
+ *
+ * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
+ */
+#ifndef UTILS_H_
+#define UTILS_H_
+
+#include <time.h>
+
+/**
+ * @return seconds on the monotonic clock, for timing things.
+ */
+static inline double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -3,10 +3,54 @@
  *
  * This source code is licensed under the MIT license which is detailed in the LICENSE.txt file.
  */
+#include <time.h>
+#include <sys/stat.h>
+
+#include "utils.h"
 #include "utils.c"
+#include "libs/base64.c"
+#include "libs/base85.c"
+#include "libs/sha256.c"
+#include "protocol_encoder.c"
+#include "lz_block.c"
+#include "tree_hash.c"
+#include "chunk_dedup.c"
+#include "delta.c"
+#include "line_reader.c"
+#include "json_scan.c"
+#include "libs/parson.c"
 
 #include "libs/munit/munit.c"
 
+/*
+ * Allocation counting. `task build_test` links with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc so that every allocation in
+ * this program passes through here. The counter is volatile because the
+ * compiler assumes that malloc() doesn't touch our globals.
+ */
+static volatile size_t allocation_count = 0;
+
+#ifdef UTILS_TEST_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocation_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocation_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocation_count++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
 
 MunitResult test_replace_char(const MunitParameter params[], void* user_data_or_fixture) {
     static char test_string[] = "foo/bar/smeg.txt";
@@ -81,6 +125,606 @@ MunitResult test_find_suitable_filename_3(const MunitParameter params[], void* u
     return MUNIT_OK;
 }
 
+#define MANY_FILES_COUNT 10000
+
+/**
+ * Fixture: a temp directory full of "image-png(N).png" files, like a well
+ * used download directory.
+ */
+static void *many_files_setup(const MunitParameter params[], void* user_data) {
+    char *directory = strdup("/tmp/extraterm_utils_test_XXXXXX");
+    munit_assert_not_null(mkdtemp(directory));
+
+    char path[PATH_MAX];
+    for (int i=0; i<=MANY_FILES_COUNT; i++) {
+        if (i == 0) {
+            snprintf(path, sizeof(path), "%s/image-png.png", directory);
+        } else {
+            snprintf(path, sizeof(path), "%s/image-png(%d).png", directory, i);
+        }
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        munit_assert_int(fd, !=, -1);
+        close(fd);
+    }
+    /* Names which must not be mistaken for variations. */
+    const char *others[] = { "image-png(0).png", "image-png(x).png", "image-png(20000).jpg", "image-png(20000)" };
+    for (int i=0; i<sizeof(others)/sizeof(others[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", directory, others[i]);
+        close(open(path, O_WRONLY | O_CREAT, 0644));
+    }
+    return directory;
+}
+
+static void many_files_tear_down(void* fixture) {
+    char *directory = fixture;
+    char path[PATH_MAX];
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    rmdir(directory);
+    free(directory);
+}
+
+MunitResult test_find_suitable_filename_many(const MunitParameter params[], void* fixture) {
+    char filename[PATH_MAX];
+    char expected[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/image-png.png", (char *) fixture);
+    snprintf(expected, sizeof(expected), "%s/image-png(%d).png", (char *) fixture, MANY_FILES_COUNT + 1);
+
+    const int rounds = 10;
+    double start = now_seconds();
+    for (int i=0; i<rounds; i++) {
+        char *new_filename = find_suitable_filename(filename);
+        munit_assert_string_equal(new_filename, expected);
+        free(new_filename);
+    }
+    double scan_seconds = (now_seconds() - start) / rounds;
+
+    /* For comparison, probing one name at a time with access(). */
+    start = now_seconds();
+    char candidate[PATH_MAX];
+    for (int i=1; ; i++) {
+        snprintf(candidate, sizeof(candidate), "%s/image-png(%d).png", (char *) fixture, i);
+        if (access(candidate, F_OK) != 0) {
+            break;
+        }
+    }
+    double probe_seconds = now_seconds() - start;
+
+    munit_logf(MUNIT_LOG_INFO, "%d files: directory scan %.3f ms, access() probing %.3f ms",
+        MANY_FILES_COUNT, scan_seconds * 1e3, probe_seconds * 1e3);
+    return MUNIT_OK;
+}
+
+MunitResult test_claim_suitable_filename(const MunitParameter params[], void* fixture) {
+    char filename[PATH_MAX];
+    char expected[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/image-png.png", (char *) fixture);
+
+    /* Each claim must get a new name, even though nothing else changes. */
+    for (int i=1; i<=3; i++) {
+        int fd = -1;
+        char *claimed = claim_suitable_filename(filename, create_file_exclusive, &fd);
+        snprintf(expected, sizeof(expected), "%s/image-png(%d).png", (char *) fixture, MANY_FILES_COUNT + i);
+        munit_assert_string_equal(claimed, expected);
+        munit_assert_int(fd, !=, -1);
+        close(fd);
+        free(claimed);
+    }
+
+    snprintf(filename, sizeof(filename), "%s/new.txt", (char *) fixture);
+    int fd = -1;
+    char *claimed = claim_suitable_filename(filename, create_file_exclusive, &fd);
+    munit_assert_string_equal(claimed, filename);
+    close(fd);
+    free(claimed);
+    return MUNIT_OK;
+}
+
+MunitResult test_claim_suitable_filename_unlisted(const MunitParameter params[], void* fixture) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/unlisted.txt", (char *) fixture);
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+
+    /* Writable, but it can't be listed. */
+    chmod(fixture, 0300);
+    DIR *dir = opendir(fixture);
+    if (dir != NULL) {
+        /* Permissions don't stop root. */
+        closedir(dir);
+        chmod(fixture, 0700);
+        return MUNIT_SKIP;
+    }
+
+    char expected[PATH_MAX];
+    snprintf(expected, sizeof(expected), "%s/unlisted(1).txt", (char *) fixture);
+    char *new_filename = find_suitable_filename(path);
+    munit_assert_string_equal(new_filename, expected);
+    free(new_filename);
+
+    int fd = -1;
+    char *claimed = claim_suitable_filename(path, create_file_exclusive, &fd);
+    chmod(fixture, 0700);
+    munit_assert_string_equal(claimed, expected);
+    munit_assert_int(fd, !=, -1);
+    close(fd);
+    free(claimed);
+    return MUNIT_OK;
+}
+
+MunitResult test_find_suitable_filename_wide_counter(const MunitParameter params[], void* fixture) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/wide(1)", (char *) fixture);
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+    snprintf(path, sizeof(path), "%s/wide", (char *) fixture);
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+
+    /* Counters aren't limited to 3 digits. A gap is filled first. */
+    for (int i=2; i<=1200; i++) {
+        if (i != 7) {
+            snprintf(path, sizeof(path), "%s/wide(%d)", (char *) fixture, i);
+            close(open(path, O_WRONLY | O_CREAT, 0644));
+        }
+    }
+    char filename[PATH_MAX];
+    char expected[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/wide", (char *) fixture);
+    snprintf(expected, sizeof(expected), "%s/wide(7)", (char *) fixture);
+    char *new_filename = find_suitable_filename(filename);
+    munit_assert_string_equal(new_filename, expected);
+    free(new_filename);
+
+    snprintf(path, sizeof(path), "%s/wide(7)", (char *) fixture);
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+    snprintf(expected, sizeof(expected), "%s/wide(1201)", (char *) fixture);
+    new_filename = find_suitable_filename(filename);
+    munit_assert_string_equal(new_filename, expected);
+    free(new_filename);
+    return MUNIT_OK;
+}
+
+MunitResult test_arena_snapshot_rewind(const MunitParameter params[], void* user_data_or_fixture) {
+    Arena arena = {0};
+
+    /* Rewinding to a snapshot of an empty arena is a reset. */
+    Arena_Mark empty = arena_snapshot(&arena);
+    char *first = arena_alloc(&arena, 100);
+    arena_rewind(&arena, empty);
+    munit_assert_ptr_equal(arena_alloc(&arena, 100), first);
+
+    Arena_Mark mark = arena_snapshot(&arena);
+    char *second = arena_alloc(&arena, 16);
+    /* Spill over into more regions. */
+    for (int i=0; i<10; i++) {
+        arena_alloc(&arena, REGION_DEFAULT_CAPACITY * sizeof(uintptr_t) / 2);
+    }
+    munit_assert_ptr_not_equal(arena.begin, arena.end);
+
+    arena_rewind(&arena, mark);
+    munit_assert_ptr_equal(arena.end, arena.begin);
+    munit_assert_ptr_equal(arena_alloc(&arena, 16), second);
+
+    /* The allocations before the snapshot survive. */
+    memcpy(first, "still here", 11);
+    arena_rewind(&arena, mark);
+    munit_assert_string_equal(first, "still here");
+
+    arena_free(&arena);
+    return MUNIT_OK;
+}
+
+/* Roughly the allocations for one frame's metadata parse: a handful of small
+   JSON values and strings plus a file name. */
+static void allocate_frame(Arena *arena) {
+    for (int i=0; i<64; i++) {
+        char *value = arena_alloc(arena, 16 + (i * 37) % 240);
+        value[0] = i;
+    }
+    arena_strdup(arena, "image-png(1234).png");
+}
+
+MunitResult test_arena_frame_cycle_benchmark(const MunitParameter params[], void* user_data_or_fixture) {
+    const int frames = 20000;
+
+    /* What from used to do: a new arena for every frame. */
+    double start = now_seconds();
+    for (int i=0; i<frames; i++) {
+        Arena arena = {0};
+        allocate_frame(&arena);
+        arena_free(&arena);
+    }
+    double fresh_seconds = now_seconds() - start;
+
+    /* One arena, rewound after each frame. */
+    start = now_seconds();
+    Arena arena = {0};
+    Arena_Mark frame_start = arena_snapshot(&arena);
+    for (int i=0; i<frames; i++) {
+        allocate_frame(&arena);
+        arena_rewind(&arena, frame_start);
+    }
+    arena_free(&arena);
+    double rewind_seconds = now_seconds() - start;
+
+    munit_logf(MUNIT_LOG_INFO, "per frame: new arena %.1f ns, snapshot/rewind %.1f ns",
+        fresh_seconds / frames * 1e9, rewind_seconds / frames * 1e9);
+    return MUNIT_OK;
+}
+
+MunitResult test_protocol_encode_start_file_transfer(const MunitParameter params[], void* user_data_or_fixture) {
+    char buffer[256];
+    ProtocolEncoder enc;
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    munit_assert_true(protocol_encode_start_file_transfer(&enc, "cookie", "text/plain", "utf8", "a\"b\\c\td\x01/é.txt",
+        1234567890123ULL, true, NULL, NULL, NULL, NULL));
+
+    static const char expected[] = "\x1b&cookie;5;122\x07"
+        "{\"mimeType\":\"text/plain\",\"filename\":\"a\\\"b\\\\c\\td\\u0001/é.txt\",\"charset\":\"utf8\","
+        "\"filesize\":1234567890123,\"download\":\"true\"}";
+    munit_assert_size(enc.length, ==, strlen(expected));
+    munit_assert_memory_equal(enc.length, buffer, expected);
+
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    protocol_encode_start_file_transfer(&enc, "c", NULL, NULL, NULL, PROTOCOL_NO_FILESIZE, false, NULL, NULL, NULL,
+        NULL);
+    munit_assert_memory_equal(enc.length, buffer, "\x1b&c;5;2\x07{}");
+
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    protocol_encode_start_file_transfer(&enc, "c", NULL, NULL, NULL, 3, false, CONTENT_ENCODING_LZ4_BLOCK, NULL, NULL,
+        NULL);
+    static const char expected_encoded[] = "\x1b&c;5;44\x07{\"filesize\":3,\"contentEncoding\":\"lz4-block\"}";
+    munit_assert_size(enc.length, ==, strlen(expected_encoded));
+    munit_assert_memory_equal(enc.length, buffer, expected_encoded);
+
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    protocol_encode_start_file_transfer(&enc, "c", NULL, NULL, NULL, PROTOCOL_NO_FILESIZE, false, NULL,
+        INTEGRITY_TREE_SHA256, NULL, NULL);
+    static const char expected_tree[] = "\x1b&c;5;27\x07{\"integrity\":\"tree-sha256\"}";
+    munit_assert_size(enc.length, ==, strlen(expected_tree));
+    munit_assert_memory_equal(enc.length, buffer, expected_tree);
+
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    protocol_encode_start_file_transfer(&enc, "c", NULL, NULL, NULL, PROTOCOL_NO_FILESIZE, false, NULL, NULL, "base85",
+        NULL);
+    static const char expected_base85[] = "\x1b&c;5;25\x07{\"lineEncoding\":\"base85\"}";
+    munit_assert_size(enc.length, ==, strlen(expected_base85));
+    munit_assert_memory_equal(enc.length, buffer, expected_base85);
+
+    protocol_encoder_init(&enc, buffer, sizeof(buffer));
+    protocol_encode_start_file_transfer(&enc, "c", NULL, NULL, NULL, PROTOCOL_NO_FILESIZE, false, NULL, NULL, NULL,
+        "chunk-dedup");
+    static const char expected_dedup[] = "\x1b&c;5;30\x07{\"transferMode\":\"chunk-dedup\"}";
+    munit_assert_size(enc.length, ==, strlen(expected_dedup));
+    munit_assert_memory_equal(enc.length, buffer, expected_dedup);
+    return MUNIT_OK;
+}
+
+MunitResult test_protocol_encode_overflow(const MunitParameter params[], void* user_data_or_fixture) {
+    char buffer[20];
+    ProtocolEncoder enc;
+    protocol_encoder_init(&enc, buffer, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 'X';
+    munit_assert_false(protocol_encode_request_frame(&enc, "cookie", "frame-name-which-is-too-long", NULL));
+    munit_assert_char(buffer[sizeof(buffer) - 1], ==, 'X');
+
+    /* A counting encoder measures exactly what fits. */
+    ProtocolEncoder count;
+    protocol_encoder_init_counting(&count);
+    protocol_encode_request_frame(&count, "cookie", "frame", NULL);
+    protocol_encoder_init(&enc, buffer, count.length);
+    munit_assert_true(protocol_encode_request_frame(&enc, "cookie", "frame", NULL));
+    munit_assert_memory_equal(count.length, buffer, "\x1b&cookie;4\x07" "frame");
+
+    char encoded_buffer[64];
+    protocol_encoder_init(&enc, encoded_buffer, sizeof(encoded_buffer));
+    munit_assert_true(protocol_encode_request_frame(&enc, "cookie", "frame",
+        CONTENT_ENCODING_LZ4_BLOCK "," INTEGRITY_TREE_SHA256));
+    munit_assert_memory_equal(enc.length, encoded_buffer, "\x1b&cookie;4;lz4-block,tree-sha256\x07" "frame");
+    return MUNIT_OK;
+}
+
+MunitResult test_protocol_encoder_no_allocations(const MunitParameter params[], void* user_data_or_fixture) {
+#ifndef UTILS_TEST_COUNT_ALLOCATIONS
+    return MUNIT_SKIP;
+#endif
+    char buffer[512];
+    ProtocolEncoder enc;
+    size_t allocations_before = allocation_count;
+    for (int i=0; i<1000; i++) {
+        protocol_encoder_init_counting(&enc);
+        protocol_encode_start_file_transfer(&enc, "cookie", "image/png", NULL, "holiday\nphoto.png", i, false, NULL,
+            NULL, NULL, NULL);
+        protocol_encoder_init(&enc, buffer, sizeof(buffer));
+        protocol_encode_start_file_transfer(&enc, "cookie", "image/png", NULL, "holiday\nphoto.png", i, false, NULL,
+            NULL, NULL, NULL);
+        protocol_encode_end_file_transfer(&enc);
+        protocol_encoder_init(&enc, buffer, sizeof(buffer));
+        protocol_encode_request_frame(&enc, "cookie", "123", NULL);
+    }
+    munit_assert_size(allocation_count, ==, allocations_before);
+
+    /* Check that the counting actually works. */
+    free(malloc(16));
+    munit_assert_size(allocation_count, ==, allocations_before + 1);
+    return MUNIT_OK;
+}
+
+static void fill_with_text(unsigned char *data, size_t length) {
+    static const char words[] = "the quick brown fox jumps over the lazy dog, status=200 path=/api/items ";
+    for (size_t i=0; i<length; i++) {
+        data[i] = words[(i + i / 97 * 5) % (sizeof(words) - 1)];
+    }
+}
+
+static void assert_lz_block_round_trip(const unsigned char *input, size_t length, bool compress) {
+    unsigned char *packed = malloc(LZ_BLOCK_PACKED_BOUND(length));
+    unsigned char *unpacked = malloc(length + 1);
+    size_t packed_length = lz_block_pack(input, length, compress, packed);
+    munit_assert_size(packed_length, <=, LZ_BLOCK_PACKED_BOUND(length));
+    munit_assert_size(packed_length, <=, LZ_BLOCK_PREFIX_BYTES + length);
+    munit_assert_llong(lz_block_unpacked_length(packed, packed_length), ==, length);
+    munit_assert_true(lz_block_unpack(packed, packed_length, unpacked));
+    munit_assert_memory_equal(length, unpacked, input);
+    free(unpacked);
+    free(packed);
+}
+
+MunitResult test_lz_block_round_trip(const MunitParameter params[], void* user_data_or_fixture) {
+    const size_t MAX_LEN = 3 * 64 * 1024;
+    unsigned char *text = malloc(MAX_LEN);
+    unsigned char *random = malloc(MAX_LEN);
+    unsigned char *zeros = calloc(MAX_LEN, 1);
+    fill_with_text(text, MAX_LEN);
+    munit_rand_memory(MAX_LEN, random);
+
+    for (size_t len=0; len <= MAX_LEN; len += (len < 300 ? 1 : len < 70000 ? 4099 : 61440)) {
+        assert_lz_block_round_trip(text, len, true);
+        assert_lz_block_round_trip(random, len, true);
+        assert_lz_block_round_trip(zeros, len, true);
+        assert_lz_block_round_trip(text, len, false);
+    }
+
+    /* Text has to actually shrink, and far beyond the 64K match window too. */
+    unsigned char *packed = malloc(LZ_BLOCK_PACKED_BOUND(MAX_LEN));
+    munit_assert_size(lz_block_pack(text, MAX_LEN, true, packed), <, MAX_LEN / 4);
+    munit_assert_size(lz_block_pack(zeros, MAX_LEN, true, packed), <, MAX_LEN / 100);
+
+    free(packed);
+    free(zeros);
+    free(random);
+    free(text);
+    return MUNIT_OK;
+}
+
+MunitResult test_lz_block_unpack_rejects(const MunitParameter params[], void* user_data_or_fixture) {
+    unsigned char text[4096];
+    unsigned char packed[LZ_BLOCK_PACKED_BOUND(sizeof(text))];
+    unsigned char unpacked[sizeof(text)];
+    fill_with_text(text, sizeof(text));
+    size_t packed_length = lz_block_pack(text, sizeof(text), true, packed);
+
+    /* Too short to hold a length. */
+    munit_assert_llong(lz_block_unpacked_length(packed, 3), ==, -1);
+    munit_assert_false(lz_block_unpack(packed, 3, unpacked));
+
+    /* Cut short, so it doesn't decode to the promised length. */
+    munit_assert_false(lz_block_unpack(packed, packed_length - 1, unpacked));
+
+    /* Claims more than the block could ever hold. */
+    unsigned char huge[] = { 0xff, 0xff, 0xff, 0x7f, 0x00 };
+    munit_assert_llong(lz_block_unpacked_length(huge, sizeof(huge)), ==, -1);
+
+    /* A match reaching back before the start of the output. */
+    unsigned char bad_offset[] = { 8, 0, 0, 0, 0x40, 'a', 'b', 'c', 'd', 0x05, 0x00 };
+    munit_assert_false(lz_block_unpack(bad_offset, sizeof(bad_offset), unpacked));
+
+    /* Stored, but with a length which doesn't match what follows. */
+    unsigned char bad_stored[] = { 3, 0, 0, 0x80, 'a', 'b' };
+    munit_assert_llong(lz_block_unpacked_length(bad_stored, sizeof(bad_stored)), ==, -1);
+    return MUNIT_OK;
+}
+
+MunitResult test_lz_block_is_worth_compressing(const MunitParameter params[], void* user_data_or_fixture) {
+    unsigned char data[3072];
+    munit_rand_memory(sizeof(data), data);
+    munit_assert_double(byte_entropy_bits(data, sizeof(data)), >, 7.8);
+    munit_assert_false(lz_block_is_worth_compressing(data, sizeof(data)));
+
+    fill_with_text(data, sizeof(data));
+    munit_assert_true(lz_block_is_worth_compressing(data, sizeof(data)));
+
+    memset(data, 'x', sizeof(data));
+    munit_assert_double(byte_entropy_bits(data, sizeof(data)), <, 0.01);
+    for (int i=0; i<256; i++) {
+        data[i] = i;
+    }
+    munit_assert_double(byte_entropy_bits(data, 256), >, 7.99);
+    munit_assert_double(byte_entropy_bits(data, 256), <, 8.01);
+    return MUNIT_OK;
+}
+
+static void tree_root_hex(const TreeHash *tree, char *hex) {
+    unsigned char root[SHA256_SIZE_BYTES];
+    tree_hash_root(tree, root);
+    sha256_hash_to_hex(root, hex);
+}
+
+/* The test vectors of RFC 6962's reference implementation, Certificate Transparency. */
+MunitResult test_tree_hash_known_answers(const MunitParameter params[], void* user_data_or_fixture) {
+    static const struct { const char *data; size_t length; } leaves[] = {
+        { "", 0 },
+        { "\x00", 1 },
+        { "\x10", 1 },
+        { "\x20\x21", 2 },
+        { "\x30\x31", 2 },
+        { "\x40\x41\x42\x43", 4 },
+        { "\x50\x51\x52\x53\x54\x55\x56\x57", 8 },
+        { "\x60\x61\x62\x63\x64\x65\x66\x67\x68\x69\x6a\x6b\x6c\x6d\x6e\x6f", 16 },
+    };
+    static const char *roots[] = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "6e340b9cffb37a989ca544e6bb780a2c78901d3fb33738768511a30617afa01d",
+        "fac54203e7cc696cf0dfcb42c92a1d9dbaf70ad9e621f4bd8d98662f00e3c125",
+        "aeb6bcfe274b70a14fb067a5e5578264db0fa9b51af5e0ba159158f329e06e77",
+        "d37ee418976dd95753c1c73862b9398fa2a2cf9b4ff0fdfe8b30cd95209614b7",
+        "4e3bbb1f7b478dcfe71fb631631519a3bca12c9aefca1612bfce4c13a86264d4",
+        "76e67dadbcdf1e10e1b74ddc608abd2f98dfb16fbce75277b5232a127f2087ef",
+        "ddb89be403809e325750d3d263cd78929c2942b7942a34b77e122c9594a74c8c",
+        "5dc9da79a70659a9ad559cb701ded9a2ab9d823aad2f4960cfe370eff4604328",
+    };
+
+    TreeHash tree;
+    tree_hash_init(&tree);
+    char hex[SHA256_SIZE_BYTES * 2 + 1];
+    tree_root_hex(&tree, hex);
+    munit_assert_string_equal(hex, roots[0]);
+
+    unsigned char leaf[SHA256_SIZE_BYTES];
+    for (int i=0; i<8; i++) {
+        tree_hash_leaf(leaves[i].data, leaves[i].length, leaf);
+        tree_hash_push(&tree, leaf);
+        tree_root_hex(&tree, hex);
+        munit_assert_string_equal(hex, roots[i + 1]);
+    }
+    return MUNIT_OK;
+}
+
+MunitResult test_tree_hash_order_matters(const MunitParameter params[], void* user_data_or_fixture) {
+    unsigned char a[SHA256_SIZE_BYTES];
+    unsigned char b[SHA256_SIZE_BYTES];
+    tree_hash_leaf("a", 1, a);
+    tree_hash_leaf("b", 1, b);
+
+    TreeHash tree;
+    char ab[SHA256_SIZE_BYTES * 2 + 1];
+    char ba[SHA256_SIZE_BYTES * 2 + 1];
+    tree_hash_init(&tree);
+    tree_hash_push(&tree, a);
+    tree_hash_push(&tree, b);
+    tree_root_hex(&tree, ab);
+    tree_hash_init(&tree);
+    tree_hash_push(&tree, b);
+    tree_hash_push(&tree, a);
+    tree_root_hex(&tree, ba);
+    munit_assert_string_not_equal(ab, ba);
+
+    /* Only whole subtrees are kept however many leaves there are. */
+    tree_hash_init(&tree);
+    for (int i=0; i<1000; i++) {
+        tree_hash_push(&tree, a);
+    }
+    munit_assert_int(tree.count, ==, 6);   /* 1000 = 0b1111101000 */
+    return MUNIT_OK;
+}
+
+MunitResult test_list_contains(const MunitParameter params[], void* user_data_or_fixture) {
+    munit_assert_true(list_contains("lz4-block", "lz4-block"));
+    munit_assert_true(list_contains("zstd,lz4-block", "lz4-block"));
+    munit_assert_true(list_contains("lz4-block,zstd", "zstd"));
+    munit_assert_false(list_contains("lz4-block-x,zstd", "lz4-block"));
+    munit_assert_false(list_contains("lz4", "lz4-block"));
+    munit_assert_false(list_contains("", "lz4-block"));
+    munit_assert_false(list_contains(NULL, "lz4-block"));
+
+    char list[17] = "";
+    munit_assert_true(list_append(list, sizeof(list), "lz4-block"));
+    munit_assert_string_equal(list, "lz4-block");
+    munit_assert_true(list_append(list, sizeof(list), "base85"));
+    munit_assert_string_equal(list, "lz4-block,base85");
+    munit_assert_false(list_append(list, sizeof(list), "x"));
+    munit_assert_string_equal(list, "lz4-block,base85");
+    return MUNIT_OK;
+}
+
+static JsonScanResult scan_string(Arena *arena, const char *json, const char *key, char **value) {
+    return json_scan_string_field(arena, json, strlen(json), key, value);
+}
+
+MunitResult test_json_scan_string_field(const MunitParameter params[], void* user_data_or_fixture) {
+    Arena arena = {0};
+    char *value;
+
+    static const char json[] = " { \"size\" : 12 , \"nested\": {\"filename\": \"no\", \"list\": [1, \"]}\", {}]},"
+        "\"tricky\": \"a\\\\\", \"filename\" : \"caf\\u00e9 \\\"1\\\"\\n\\ud83d\\ude00.txt\", \"empty\": \"\" } ";
+    munit_assert_int(scan_string(&arena, json, "filename", &value), ==, JSON_SCAN_FOUND);
+    munit_assert_string_equal(value, "caf\xc3\xa9 \"1\"\n\xf0\x9f\x98\x80.txt");
+    munit_assert_int(scan_string(&arena, json, "tricky", &value), ==, JSON_SCAN_FOUND);
+    munit_assert_string_equal(value, "a\\");
+    munit_assert_int(scan_string(&arena, json, "empty", &value), ==, JSON_SCAN_FOUND);
+    munit_assert_string_equal(value, "");
+
+    /* Only top-level keys count. */
+    munit_assert_int(scan_string(&arena, json, "list", &value), ==, JSON_SCAN_MISSING);
+    munit_assert_null(value);
+    /* Not a string. */
+    munit_assert_int(scan_string(&arena, json, "size", &value), ==, JSON_SCAN_MISSING);
+    munit_assert_null(value);
+
+    Slice raw;
+    munit_assert_int(json_scan_field(json, strlen(json), "size", &raw), ==, JSON_SCAN_FOUND);
+    munit_assert_memory_equal(raw.length, raw.data, "12");
+    munit_assert_int(scan_string(&arena, "{}", "filename", &value), ==, JSON_SCAN_MISSING);
+
+    arena_free(&arena);
+    return MUNIT_OK;
+}
+
+MunitResult test_json_scan_unsupported(const MunitParameter params[], void* user_data_or_fixture) {
+    Arena arena = {0};
+    char *value;
+    const char *bad[] = {
+        "",
+        "[\"filename\"]",
+        "{\"filename\": \"unterminated}",
+        "{\"a\": 1 \"filename\": \"x\"}",
+        "{\"file\\u006eame\": \"x\"}",
+        "{\"filename\": \"bad \\x escape\"}",
+        "{\"filename\": \"lone \\udc00 surrogate\"}",
+        "{\"filename\": \"nul \\u0000 char\"}",
+        "{\"a\": ",
+    };
+    for (int i=0; i<sizeof(bad)/sizeof(bad[0]); i++) {
+        munit_assert_int(scan_string(&arena, bad[i], "filename", &value), ==, JSON_SCAN_UNSUPPORTED);
+    }
+    arena_free(&arena);
+    return MUNIT_OK;
+}
+
+MunitResult test_json_scan_large_metadata_benchmark(const MunitParameter params[], void* user_data_or_fixture) {
+    /* Metadata carrying a 4MB thumbnail ahead of the fields we want. */
+    const size_t thumbnail_length = 4 * 1024 * 1024;
+    char *json = malloc(thumbnail_length + 256);
+    size_t length = sprintf(json, "{\"thumbnail\":\"");
+    for (size_t i=0; i<thumbnail_length; i++) {
+        json[length++] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i % 64];
+    }
+    length += sprintf(json + length, "\",\"mimeType\":\"image/png\",\"filename\":\"holiday.png\",\"filesize\":123}");
+
+    Arena arena = {0};
+    char *filename;
+    double start = now_seconds();
+    munit_assert_int(json_scan_string_field(&arena, json, length, "filename", &filename), ==, JSON_SCAN_FOUND);
+    double scan_seconds = now_seconds() - start;
+    munit_assert_string_equal(filename, "holiday.png");
+
+    start = now_seconds();
+    JSON_Value *root = json_parse_string(json);
+    munit_assert_string_equal(json_object_get_string(json_value_get_object(root), "filename"), "holiday.png");
+    double parse_seconds = now_seconds() - start;
+    json_value_free(root);
+
+    munit_logf(MUNIT_LOG_INFO, "4MB metadata: scan %.3f ms, parson %.3f ms", scan_seconds * 1e3, parse_seconds * 1e3);
+    arena_free(&arena);
+    free(json);
+    return MUNIT_OK;
+}
+
 MunitResult test_string_strip(const MunitParameter params[], void* user_data_or_fixture) {
     static char test_string[] = "foo bar";
     string_strip(test_string);
@@ -130,6 +774,571 @@ MunitResult test_convert_to_lowercase(const MunitParameter params[], void* user_
     return MUNIT_OK;
 }
 
+static const b64_impl b64_all_impls[] = { B64_IMPL_SCALAR, B64_IMPL_SSE41, B64_IMPL_AVX2, B64_IMPL_NEON };
+
+MunitResult test_b64_encode_known_answers(const MunitParameter params[], void* user_data_or_fixture) {
+    static const char *vectors[] = {
+        "", "",
+        "f", "Zg==",
+        "fo", "Zm8=",
+        "foo", "Zm9v",
+        "foob", "Zm9vYg==",
+        "fooba", "Zm9vYmE=",
+        "foobar", "Zm9vYmFy",
+        "The quick brown fox jumps over the lazy dog, twice: The quick brown fox jumps over the lazy dog.",
+        "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZywgdHdpY2U6IFRoZSBxdWljayBicm93biBmb3gganVtcHMgb3ZlciB0aGUgbGF6eSBkb2cu",
+    };
+    char out[256];
+
+    for (int impl_index=0; impl_index < sizeof(b64_all_impls)/sizeof(b64_all_impls[0]); impl_index++) {
+        if (!b64_set_impl(b64_all_impls[impl_index])) {
+            continue;
+        }
+        for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i += 2) {
+            unsigned int len = b64_encode((const unsigned char *) vectors[i], strlen(vectors[i]), (unsigned char *) out);
+            munit_assert_uint(len, ==, strlen(vectors[i+1]));
+            munit_assert_string_equal(out, vectors[i+1]);
+        }
+    }
+    b64_set_impl(B64_IMPL_AUTO);
+    return MUNIT_OK;
+}
+
+MunitResult test_b64_encode_impls_match_scalar(const MunitParameter params[], void* user_data_or_fixture) {
+    const unsigned int MAX_LEN = 3 * 1024 + 7;
+    unsigned char *input = malloc(MAX_LEN);
+    unsigned char *expected = malloc(b64e_size(MAX_LEN) + 1);
+    unsigned char *actual = malloc(b64e_size(MAX_LEN) + 1);
+    munit_rand_memory(MAX_LEN, input);
+
+    for (int impl_index=1; impl_index < sizeof(b64_all_impls)/sizeof(b64_all_impls[0]); impl_index++) {
+        if (!b64_set_impl(b64_all_impls[impl_index])) {
+            continue;
+        }
+        for (unsigned int len=0; len <= MAX_LEN; len += (len < 200 ? 1 : 97)) {
+            b64_set_impl(B64_IMPL_SCALAR);
+            unsigned int expected_len = b64_encode(input, len, expected);
+            b64_set_impl(b64_all_impls[impl_index]);
+            unsigned int actual_len = b64_encode(input, len, actual);
+
+            munit_assert_uint(actual_len, ==, expected_len);
+            munit_assert_memory_equal(expected_len + 1, actual, expected);
+        }
+    }
+    b64_set_impl(B64_IMPL_AUTO);
+
+    free(input);
+    free(expected);
+    free(actual);
+    return MUNIT_OK;
+}
+
+MunitResult test_b64_decode_validate_known_answers(const MunitParameter params[], void* user_data_or_fixture) {
+    static const char *vectors[] = {
+        "", "",
+        "Zg==", "f",
+        "Zm8=", "fo",
+        "Zm9v", "foo",
+        "Zm9vYg==", "foob",
+        "Zm9vYmE=", "fooba",
+        "Zm9vYmFy", "foobar",
+        "Zm9vYg", "foob",
+        "Zm9vYmE", "fooba",
+    };
+    unsigned char out[64];
+
+    for (int impl_index=0; impl_index < sizeof(b64_all_impls)/sizeof(b64_all_impls[0]); impl_index++) {
+        if (!b64_set_impl(b64_all_impls[impl_index])) {
+            continue;
+        }
+        for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i += 2) {
+            unsigned int out_len = 0;
+            long bad_offset = b64_decode_validate((const unsigned char *) vectors[i], strlen(vectors[i]), out, &out_len);
+            munit_assert_long(bad_offset, ==, -1);
+            munit_assert_uint(out_len, ==, strlen(vectors[i+1]));
+            munit_assert_memory_equal(out_len, out, vectors[i+1]);
+        }
+    }
+    b64_set_impl(B64_IMPL_AUTO);
+    return MUNIT_OK;
+}
+
+MunitResult test_b64_decode_validate_rejects(const MunitParameter params[], void* user_data_or_fixture) {
+    static const struct {
+        const char *input;
+        long bad_offset;
+    } vectors[] = {
+        { "Zm9v!mFy", 4 },
+        { "Z", 0 },
+        { "Zm9vY", 4 },
+        { "Zm=v", 2 },
+        { "Zm9vYmFy\n", 8 },
+        { "=m9v", 0 },
+    };
+    unsigned char out[64];
+
+    for (int impl_index=0; impl_index < sizeof(b64_all_impls)/sizeof(b64_all_impls[0]); impl_index++) {
+        if (!b64_set_impl(b64_all_impls[impl_index])) {
+            continue;
+        }
+        for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+            unsigned int out_len = 0;
+            long bad_offset = b64_decode_validate((const unsigned char *) vectors[i].input, strlen(vectors[i].input),
+                out, &out_len);
+            munit_assert_long(bad_offset, ==, vectors[i].bad_offset);
+        }
+    }
+    b64_set_impl(B64_IMPL_AUTO);
+    return MUNIT_OK;
+}
+
+MunitResult test_b64_decode_validate_round_trip(const MunitParameter params[], void* user_data_or_fixture) {
+    const unsigned int MAX_LEN = 3 * 1024 + 7;
+    unsigned char *input = malloc(MAX_LEN);
+    unsigned char *encoded = malloc(b64e_size(MAX_LEN) + 1);
+    unsigned char *decoded = malloc(MAX_LEN + 16);
+    munit_rand_memory(MAX_LEN, input);
+
+    for (int impl_index=0; impl_index < sizeof(b64_all_impls)/sizeof(b64_all_impls[0]); impl_index++) {
+        if (!b64_set_impl(b64_all_impls[impl_index])) {
+            continue;
+        }
+        for (unsigned int len=0; len <= MAX_LEN; len += (len < 200 ? 1 : 97)) {
+            unsigned int encoded_len = b64_encode(input, len, encoded);
+            unsigned int decoded_len = 0;
+            munit_assert_long(b64_decode_validate(encoded, encoded_len, decoded, &decoded_len), ==, -1);
+            munit_assert_uint(decoded_len, ==, len);
+            munit_assert_memory_equal(len, decoded, input);
+
+            /* Corrupt one character and expect the decoder to point right at it. */
+            unsigned int data_len = encoded_len;
+            while (data_len > 0 && encoded[data_len - 1] == '=') {
+                data_len--;
+            }
+            if (data_len > 0) {
+                unsigned int bad_index = munit_rand_int_range(0, data_len - 1);
+                unsigned char saved = encoded[bad_index];
+                encoded[bad_index] = munit_rand_int_range(0, 1) ? '*' : 0x80 | saved;
+                munit_assert_long(b64_decode_validate(encoded, encoded_len, decoded, &decoded_len), ==, bad_index);
+                encoded[bad_index] = saved;
+            }
+        }
+    }
+    b64_set_impl(B64_IMPL_AUTO);
+
+    free(input);
+    free(encoded);
+    free(decoded);
+    return MUNIT_OK;
+}
+
+MunitResult test_b85_known_answers(const MunitParameter params[], void* user_data_or_fixture) {
+    /* The same as Python's base64.b85encode(). */
+    static const struct {
+        const char *data;
+        unsigned int length;
+        const char *encoded;
+    } vectors[] = {
+        { "", 0, "" },
+        { "f", 1, "W&" },
+        { "fo", 2, "W^V" },
+        { "foo", 3, "W^Zo" },
+        { "foob", 4, "W^Zp|" },
+        { "fooba", 5, "W^Zp|VE" },
+        { "foobar", 6, "W^Zp|VR8" },
+        { "\0\0\0\0", 4, "00000" },
+        { "\xff\xff\xff\xff", 4, "|NsC0" },
+        { "The quick brown fox jumps over the lazy dog.", 44, "RA^-&adl~9Yan8BZ+C7WW^Z^PYISXJb0BYaWpW^NXk{R5VS0HWWN&9K" },
+    };
+    char out[128];
+    unsigned char decoded[128];
+
+    for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+        unsigned int len = b85_encode((const unsigned char *) vectors[i].data, vectors[i].length, (unsigned char *) out);
+        munit_assert_uint(len, ==, strlen(vectors[i].encoded));
+        munit_assert_uint(len, ==, b85e_size(vectors[i].length));
+        munit_assert_string_equal(out, vectors[i].encoded);
+
+        unsigned int decoded_len = 0;
+        munit_assert_long(b85_decode_validate((const unsigned char *) out, len, decoded, &decoded_len), ==, -1);
+        munit_assert_uint(decoded_len, ==, vectors[i].length);
+        munit_assert_uint(decoded_len, ==, b85d_size(len));
+        munit_assert_memory_equal(decoded_len, decoded, vectors[i].data);
+    }
+    return MUNIT_OK;
+}
+
+MunitResult test_b85_decode_validate_rejects(const MunitParameter params[], void* user_data_or_fixture) {
+    static const struct {
+        const char *input;
+        long bad_offset;
+    } vectors[] = {
+        { "W^Zp|VR8:", 8 },         /* The field separator is outside the alphabet. */
+        { "W^Z\"|", 3 },
+        { "W^Zp|V", 5 },            /* A lone character can't hold a byte. */
+        { "|NsC1", 0 },             /* More than 32 bits. */
+        { "00000|NsC1", 5 },
+        { "~~", 0 },
+        { "W^Zp|VR8\n", 8 },
+    };
+    unsigned char out[64];
+
+    for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+        unsigned int out_len = 0;
+        long bad_offset = b85_decode_validate((const unsigned char *) vectors[i].input, strlen(vectors[i].input),
+            out, &out_len);
+        munit_assert_long(bad_offset, ==, vectors[i].bad_offset);
+    }
+    return MUNIT_OK;
+}
+
+MunitResult test_b85_decode_validate_round_trip(const MunitParameter params[], void* user_data_or_fixture) {
+    const unsigned int MAX_LEN = 3 * 1024 + 7;
+    unsigned char *input = malloc(MAX_LEN);
+    unsigned char *encoded = malloc(b85e_size(MAX_LEN) + 1);
+    unsigned char *decoded = malloc(MAX_LEN);
+    munit_rand_memory(MAX_LEN, input);
+
+    for (unsigned int len=0; len <= MAX_LEN; len += (len < 200 ? 1 : 97)) {
+        unsigned int encoded_len = b85_encode(input, len, encoded);
+        munit_assert_uint(encoded_len, <=, b64e_size(len));
+        unsigned int decoded_len = 0;
+        munit_assert_long(b85_decode_validate(encoded, encoded_len, decoded, &decoded_len), ==, -1);
+        munit_assert_uint(decoded_len, ==, len);
+        munit_assert_memory_equal(len, decoded, input);
+
+        /* Corrupt one character and expect the decoder to point right at it. */
+        if (encoded_len > 0) {
+            unsigned int bad_index = munit_rand_int_range(0, encoded_len - 1);
+            unsigned char saved = encoded[bad_index];
+            encoded[bad_index] = munit_rand_int_range(0, 1) ? ':' : 0x80 | saved;
+            munit_assert_long(b85_decode_validate(encoded, encoded_len, decoded, &decoded_len), ==, bad_index);
+            encoded[bad_index] = saved;
+        }
+    }
+
+    free(input);
+    free(encoded);
+    free(decoded);
+    return MUNIT_OK;
+}
+
+MunitResult test_chunk_dedup_cut(const MunitParameter params[], void* user_data_or_fixture) {
+    const size_t LEN = 1024 * 1024;
+    unsigned char *data = malloc(LEN);
+    munit_rand_memory(LEN, data);
+
+    /* Cut the data, then cut it again with a byte inserted near the start. */
+    size_t cuts[LEN / CHUNK_DEDUP_MIN_BYTES + 1];
+    size_t cut_count = 0;
+    for (size_t offset=0; offset < LEN; ) {
+        size_t length = chunk_dedup_cut(data + offset, LEN - offset);
+        munit_assert_size(length, <=, CHUNK_DEDUP_MAX_BYTES);
+        if (offset + length != LEN) {
+            munit_assert_size(length, >, CHUNK_DEDUP_MIN_BYTES);
+        }
+        offset += length;
+        cuts[cut_count++] = offset;
+    }
+    munit_assert_size(cut_count, >, LEN / CHUNK_DEDUP_AVERAGE_BYTES / 2);
+    munit_assert_size(cut_count, <, LEN / CHUNK_DEDUP_AVERAGE_BYTES * 2);
+
+    memmove(data + 101, data + 100, LEN - 101);
+    size_t shared = 0;
+    size_t offset = 0;
+    for (size_t i=0; offset < LEN; ) {
+        offset += chunk_dedup_cut(data + offset, LEN - offset);
+        while (i < cut_count && cuts[i] + 1 < offset) {
+            i++;
+        }
+        if (i < cut_count && cuts[i] + 1 == offset) {
+            shared++;
+        }
+    }
+    /* Only the cuts around the insert move. */
+    munit_assert_size(shared, >=, cut_count - 3);
+
+    munit_assert_size(chunk_dedup_cut(data, 10), ==, 10);
+    free(data);
+    return MUNIT_OK;
+}
+
+MunitResult test_dedup_plan_answer(const MunitParameter params[], void* user_data_or_fixture) {
+    DedupPlan plan;
+    dedup_plan_init(&plan);
+    unsigned char digest[SHA256_SIZE_BYTES] = {0};
+    for (int i=0; i<6; i++) {
+        munit_assert_true(dedup_plan_add(&plan, digest, 100 + i));
+    }
+    munit_assert_uint64(plan.chunks[5].offset, ==, 100 + 101 + 102 + 103 + 104);
+
+    /* Chunks 0, 2, 3 and 4 are wanted, the rest of the last digit is padding. */
+    munit_assert_false(dedup_plan_take_answer(&plan, "x", 1));
+    munit_assert_true(dedup_plan_take_answer(&plan, "B", 1));
+    munit_assert_false(dedup_plan_is_answered(&plan));
+    munit_assert_true(dedup_plan_take_answer(&plan, "b", 1));
+    munit_assert_true(dedup_plan_is_answered(&plan));
+    munit_assert_size(plan.wanted_count, ==, 4);
+    munit_assert_uint64(plan.wanted_bytes, ==, 100 + 102 + 103 + 104);
+
+    uint64_t offset;
+    size_t length = 1000;
+    munit_assert_true(dedup_plan_next_range(&plan, &offset, &length));
+    munit_assert_uint64(offset, ==, 0);
+    munit_assert_size(length, ==, 100);
+
+    /* Wanted chunks next to each other come in one piece, up to the limit. */
+    length = 250;
+    munit_assert_true(dedup_plan_next_range(&plan, &offset, &length));
+    munit_assert_uint64(offset, ==, 201);
+    munit_assert_size(length, ==, 250);
+    length = 1000;
+    munit_assert_true(dedup_plan_next_range(&plan, &offset, &length));
+    munit_assert_uint64(offset, ==, 451);
+    munit_assert_size(length, ==, 102 + 103 + 104 - 250);
+    munit_assert_false(dedup_plan_next_range(&plan, &offset, &length));
+    dedup_plan_free(&plan);
+    return MUNIT_OK;
+}
+
+MunitResult test_delta_weak_roll(const MunitParameter params[], void* user_data_or_fixture) {
+    unsigned char data[4096];
+    munit_rand_memory(sizeof(data), data);
+    const size_t block = 700;
+    uint32_t weak = delta_weak_checksum(data, block);
+    for (size_t i=0; i + block < sizeof(data); i++) {
+        weak = delta_weak_roll(weak, data[i], data[i + block], block);
+        munit_assert_uint32(weak, ==, delta_weak_checksum(data + i + 1, block));
+    }
+    return MUNIT_OK;
+}
+
+/* Give `base` the signatures of `data` the way the terminal sends them. */
+static void take_delta_signatures(DeltaBase *base, const unsigned char *data, size_t length, uint32_t block_size) {
+    char header[64];
+    snprintf(header, sizeof(header), "%u:%zu", block_size, length);
+    munit_assert_true(delta_base_take_header(base, header));
+    for (size_t offset=0; offset<length; offset+=block_size) {
+        DeltaSignature signature;
+        delta_block_signature(data + offset, length - offset < block_size ? length - offset : block_size, &signature);
+        unsigned char weak[4] = { signature.weak >> 24, signature.weak >> 16, signature.weak >> 8, signature.weak };
+        char hex[DELTA_SIGNATURE_HEX_LENGTH];
+        bytes_to_hex(weak, sizeof(weak), hex);
+        bytes_to_hex(signature.strong, DELTA_STRONG_BYTES, hex + 8);
+        munit_assert_true(delta_base_take_signatures(base, hex, sizeof(hex)));
+    }
+    munit_assert_true(delta_base_is_complete(base));
+    munit_assert_false(delta_base_take_signatures(base, "00", 2));
+    munit_assert_true(delta_base_index(base));
+}
+
+/**
+ * Encode `new` against the base made from `old`, rebuild it from the delta and check the result.
+ *
+ * @return the length of the delta.
+ */
+static size_t delta_round_trip(const DeltaBase *base, const unsigned char *old, size_t old_length,
+        const unsigned char *new, size_t new_length) {
+    const size_t block_size = base->block_size;
+    FILE *new_file = tmpfile();
+    fwrite(new, 1, new_length, new_file);
+    fflush(new_file);
+    FILE *delta_file = tmpfile();
+    munit_assert_true(delta_encode(base, fileno(new_file), new_length, delta_file));
+    size_t delta_length = ftell(delta_file);
+    unsigned char *delta = malloc(delta_length);
+    rewind(delta_file);
+    munit_assert_size(fread(delta, 1, delta_length, delta_file), ==, delta_length);
+
+    unsigned char *rebuilt = malloc(new_length);
+    size_t rebuilt_length = 0;
+    bool is_ended = false;
+    for (size_t offset=0; offset<delta_length; ) {
+        munit_assert_false(is_ended);
+        DeltaRecord record;
+        long consumed = delta_parse_record(delta + offset, delta_length - offset, &record);
+        munit_assert_long(consumed, >, 0);
+        /* The same record cut short asks for more. */
+        munit_assert_long(delta_parse_record(delta + offset, consumed - 1, &record), ==, 0);
+        delta_parse_record(delta + offset, delta_length - offset, &record);
+        if (record.type == DELTA_RECORD_COPY) {
+            size_t start = (size_t) record.first_block * block_size;
+            size_t end = (size_t) (record.first_block + record.block_count) * block_size;
+            end = end > old_length ? old_length : end;
+            memcpy(rebuilt + rebuilt_length, old + start, end - start);
+            rebuilt_length += end - start;
+        } else if (record.type == DELTA_RECORD_LITERAL) {
+            memcpy(rebuilt + rebuilt_length, record.literal, record.literal_length);
+            rebuilt_length += record.literal_length;
+        } else {
+            unsigned char digest[SHA256_SIZE_BYTES];
+            sha256(new, new_length, digest);
+            munit_assert_memory_equal(SHA256_SIZE_BYTES, record.file_hash, digest);
+            is_ended = true;
+        }
+        offset += consumed;
+    }
+    munit_assert_true(is_ended);
+    munit_assert_size(rebuilt_length, ==, new_length);
+    munit_assert_memory_equal(new_length, rebuilt, new);
+
+    fclose(new_file);
+    fclose(delta_file);
+    free(delta);
+    free(rebuilt);
+    return delta_length;
+}
+
+MunitResult test_delta_round_trip(const MunitParameter params[], void* user_data_or_fixture) {
+    const size_t LEN = 200 * 1000 + 123;
+    const uint32_t BLOCK = 1024;
+    unsigned char *old = malloc(LEN);
+    munit_rand_memory(LEN, old);
+
+    /* An insert, a change and a cut, with the short last block left as it was. */
+    unsigned char *new = malloc(LEN + 100);
+    size_t new_length = 0;
+    memcpy(new, old, 5000);
+    new_length += 5000;
+    memcpy(new + new_length, "inserted", 8);
+    new_length += 8;
+    memcpy(new + new_length, old + 5000, 60000);
+    new_length += 60000;
+    new[30000] ^= 1;
+    memcpy(new + new_length, old + 90000, LEN - 90000);
+    new_length += LEN - 90000;
+
+    DeltaBase base;
+    delta_base_init(&base);
+    take_delta_signatures(&base, old, LEN, BLOCK);
+
+    /* Only the blocks around the edits are literal. */
+    munit_assert_size(delta_round_trip(&base, old, LEN, new, new_length), <, 4 * BLOCK);
+
+    DeltaRecord record;
+    munit_assert_long(delta_parse_record((const unsigned char *) "X", 1, &record), ==, -1);
+    munit_assert_long(delta_parse_record((const unsigned char *) "L\0\0\0\0", 5, &record), ==, -1);
+    munit_assert_long(delta_parse_record((const unsigned char *) "C\0\0\0\0\0\0\0\0", 9, &record), ==, -1);
+
+    delta_base_free(&base);
+    free(old);
+    free(new);
+    return MUNIT_OK;
+}
+
+MunitResult test_delta_across_reads(const MunitParameter params[], void* user_data_or_fixture) {
+    /* Base, then noise, then the whole base again: the copies sit past several 1 MB reads. */
+    const size_t LEN = 2 * 1024 * 1024 + 77;
+    const size_t HEAD = 300 * 1000;
+    const size_t NOISE = 1500 * 1000;
+    unsigned char *old = malloc(LEN);
+    munit_rand_memory(LEN, old);
+
+    size_t new_length = HEAD + NOISE + LEN;
+    unsigned char *new = malloc(new_length);
+    memcpy(new, old, HEAD);
+    munit_rand_memory(NOISE, new + HEAD);
+    memcpy(new + HEAD + NOISE, old, LEN);
+
+    DeltaBase base;
+    delta_base_init(&base);
+    take_delta_signatures(&base, old, LEN, delta_block_size(LEN));
+
+    /* Only the noise, and the blocks it cuts into, go as literals. */
+    munit_assert_size(delta_round_trip(&base, old, LEN, new, new_length), <, NOISE + 4 * base.block_size);
+
+    delta_base_free(&base);
+    free(old);
+    free(new);
+    return MUNIT_OK;
+}
+
+static const sha256_impl sha256_all_impls[] = { SHA256_IMPL_SCALAR, SHA256_IMPL_SHANI, SHA256_IMPL_ARMV8 };
+
+static const struct {
+    const char *input;
+    size_t repeat;
+    const char *digest;
+} sha256_known_answers[] = {
+    { "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+        "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+    { "The quick brown fox jumps over the lazy dog", 1,
+        "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592" },
+    { "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    { "0123456701234567012345670123456701234567012345670123456701234567", 10,
+        "594847328451bdfa85056225462cc1d867d877fb388df0ce35f25ab5562bfbb5" },
+};
+
+MunitResult test_sha256_known_answers(const MunitParameter params[], void* user_data_or_fixture) {
+    for (int impl_index=0; impl_index < sizeof(sha256_all_impls)/sizeof(sha256_all_impls[0]); impl_index++) {
+        if (!sha256_set_impl(sha256_all_impls[impl_index])) {
+            continue;
+        }
+
+        for (int i=0; i < sizeof(sha256_known_answers)/sizeof(sha256_known_answers[0]); i++) {
+            sha256_context hash;
+            unsigned char digest[SHA256_SIZE_BYTES];
+            char hex[SHA256_SIZE_BYTES*2+1];
+
+            sha256_init(&hash);
+            for (size_t j=0; j < sha256_known_answers[i].repeat; j++) {
+                sha256_hash(&hash, sha256_known_answers[i].input, strlen(sha256_known_answers[i].input));
+            }
+            sha256_done(&hash, digest);
+
+            sha256_hash_to_hex(digest, hex);
+            munit_assert_string_equal(hex, sha256_known_answers[i].digest);
+        }
+    }
+    sha256_set_impl(SHA256_IMPL_AUTO);
+    return MUNIT_OK;
+}
+
+MunitResult test_sha256_impls_match_scalar(const MunitParameter params[], void* user_data_or_fixture) {
+    const size_t MAX_LEN = 4 * 1024 + 13;
+    unsigned char *input = malloc(MAX_LEN);
+    munit_rand_memory(MAX_LEN, input);
+
+    for (int impl_index=1; impl_index < sizeof(sha256_all_impls)/sizeof(sha256_all_impls[0]); impl_index++) {
+        if (!sha256_set_impl(sha256_all_impls[impl_index])) {
+            continue;
+        }
+
+        for (size_t len=0; len <= MAX_LEN; len += (len < 300 ? 1 : 61)) {
+            unsigned char expected[SHA256_SIZE_BYTES];
+            unsigned char actual[SHA256_SIZE_BYTES];
+
+            sha256_set_impl(SHA256_IMPL_SCALAR);
+            sha256(input, len, expected);
+
+            /* Feed the accelerated path in uneven pieces to exercise the block buffering too. */
+            sha256_set_impl(sha256_all_impls[impl_index]);
+            sha256_context hash;
+            sha256_init(&hash);
+            size_t offset = 0;
+            while (offset < len) {
+                size_t piece = munit_rand_int_range(1, 150);
+                if (piece > len - offset) {
+                    piece = len - offset;
+                }
+                sha256_hash(&hash, input + offset, piece);
+                offset += piece;
+            }
+            sha256_done(&hash, actual);
+
+            munit_assert_memory_equal(SHA256_SIZE_BYTES, actual, expected);
+        }
+    }
+    sha256_set_impl(SHA256_IMPL_AUTO);
+
+    free(input);
+    return MUNIT_OK;
+}
+
 MunitTest tests[] = {
     /*name                                 test                              setup tear_down  options                 parameters */
     { "/test_replace_char",                test_replace_char,                NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
@@ -143,12 +1352,45 @@ MunitTest tests[] = {
     { "/test_find_suitable_filename",      test_find_suitable_filename,      NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_find_suitable_filename_2",    test_find_suitable_filename_2,    NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_find_suitable_filename_3",    test_find_suitable_filename_3,    NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_find_suitable_filename_many", test_find_suitable_filename_many, many_files_setup, many_files_tear_down, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_find_suitable_filename_wide_counter", test_find_suitable_filename_wide_counter, many_files_setup, many_files_tear_down, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_claim_suitable_filename",     test_claim_suitable_filename,     many_files_setup, many_files_tear_down, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_claim_suitable_filename_unlisted", test_claim_suitable_filename_unlisted, many_files_setup, many_files_tear_down, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_arena_snapshot_rewind",       test_arena_snapshot_rewind,       NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_arena_frame_cycle_benchmark", test_arena_frame_cycle_benchmark, NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_protocol_encode_start_file_transfer", test_protocol_encode_start_file_transfer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_protocol_encode_overflow",    test_protocol_encode_overflow,    NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_protocol_encoder_no_allocations", test_protocol_encoder_no_allocations, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_lz_block_round_trip",         test_lz_block_round_trip,         NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_lz_block_unpack_rejects",     test_lz_block_unpack_rejects,     NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_lz_block_is_worth_compressing", test_lz_block_is_worth_compressing, NULL, NULL,  MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_tree_hash_known_answers",     test_tree_hash_known_answers,     NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_tree_hash_order_matters",     test_tree_hash_order_matters,     NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_list_contains",               test_list_contains,               NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_json_scan_string_field",      test_json_scan_string_field,      NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_json_scan_unsupported",       test_json_scan_unsupported,       NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_json_scan_large_metadata_benchmark", test_json_scan_large_metadata_benchmark, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_string_strip",                test_string_strip,                NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_string_strip_2",              test_string_strip_2,              NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_string_strip_3",              test_string_strip_3,              NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_string_strip_4",              test_string_strip_4,              NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_sha256_hash_to_hex",          test_sha256_hash_to_hex,          NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
     { "/test_convert_to_lowercase",        test_convert_to_lowercase,        NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b64_encode_known_answers",    test_b64_encode_known_answers,    NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b64_encode_impls_match_scalar", test_b64_encode_impls_match_scalar, NULL, NULL,  MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b64_decode_validate_known_answers", test_b64_decode_validate_known_answers, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b64_decode_validate_rejects", test_b64_decode_validate_rejects, NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b64_decode_validate_round_trip", test_b64_decode_validate_round_trip, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b85_known_answers",           test_b85_known_answers,           NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b85_decode_validate_rejects", test_b85_decode_validate_rejects, NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_b85_decode_validate_round_trip", test_b85_decode_validate_round_trip, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_chunk_dedup_cut", test_chunk_dedup_cut, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_dedup_plan_answer", test_dedup_plan_answer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_delta_weak_roll", test_delta_weak_roll, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_delta_round_trip", test_delta_round_trip, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_delta_across_reads", test_delta_across_reads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_sha256_known_answers",        test_sha256_known_answers,        NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
+    { "/test_sha256_impls_match_scalar",   test_sha256_impls_match_scalar,   NULL, NULL,      MUNIT_TEST_OPTION_NONE, NULL },
 
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };